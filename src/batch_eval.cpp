@@ -0,0 +1,480 @@
+#include "tape.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BATCH_HAS_AVX2 1
+#else
+#define BATCH_HAS_AVX2 0
+#endif
+
+
+const size_t BATCH_BLOCK = 256;
+
+static BatchKernel BATCH_KERNEL = KERNEL_UNKNOWN;
+
+void        EvalTapeBatch     (const Tape* tape, const double* xs, const double* ys, double* out, size_t count);
+BatchKernel GetBatchKernel    ();
+const char* GetBatchKernelName();
+void        SetBatchKernel    (BatchKernel kernel);
+void        EvalBlockScalar   (const Tape* tape, double* stack, const double* xs, const double* ys, double* out, size_t count);
+void        EvalBlockAvx2     (const Tape* tape, double* stack, const double* xs, const double* ys, double* out, size_t count);
+
+
+void EvalTapeBatch(const Tape* tape, const double* xs, const double* ys, double* out, size_t count)
+{
+    assert(tape);
+    assert(xs);
+    assert(out);
+
+    // An empty tape has no column to copy out, EvalTapeOnStack gives NAN for it too
+    if (tape->size == 0)
+    {
+        for (size_t i = 0; i < count; ++i) out[i] = NAN;
+        return;
+    }
+
+    double* stack = (double*)aligned_alloc(32, (tape->max_stack + 1) * BATCH_BLOCK * sizeof(double));
+    assert(stack);
+
+    BatchKernel kernel = GetBatchKernel();
+
+    for (size_t start = 0; start < count; start += BATCH_BLOCK)
+    {
+        size_t block = (count - start < BATCH_BLOCK) ? count - start : BATCH_BLOCK;
+        const double* block_ys = (ys == nullptr) ? nullptr : ys + start;
+
+        if (kernel == KERNEL_AVX2)
+        {
+            EvalBlockAvx2(tape, stack, xs + start, block_ys, out + start, block);
+        }
+        else
+        {
+            EvalBlockScalar(tape, stack, xs + start, block_ys, out + start, block);
+        }
+    }
+
+    free(stack);
+}
+
+BatchKernel GetBatchKernel()
+{
+    if (BATCH_KERNEL == KERNEL_UNKNOWN)
+    {
+        BATCH_KERNEL = KERNEL_SCALAR;
+
+#if BATCH_HAS_AVX2
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) BATCH_KERNEL = KERNEL_AVX2;
+#endif
+    }
+
+    return BATCH_KERNEL;
+}
+
+const char* GetBatchKernelName()
+{
+    return (GetBatchKernel() == KERNEL_AVX2) ? "avx2" : "scalar";
+}
+
+void SetBatchKernel(BatchKernel kernel)
+{
+#if !BATCH_HAS_AVX2
+    if (kernel == KERNEL_AVX2) kernel = KERNEL_SCALAR;
+#endif
+
+    BATCH_KERNEL = kernel;
+}
+
+#define COLUMN(depth) (stack + (depth) * BATCH_BLOCK)
+
+void EvalBlockScalar(const Tape* tape, double* stack, const double* xs, const double* ys, double* out, size_t count)
+{
+    size_t depth = 0;
+
+    for (size_t i = 0; i < tape->size; ++i)
+    {
+        double* top  = COLUMN(depth);
+        double* prev = (depth >= 1) ? COLUMN(depth - 1) : nullptr;
+        double* arg  = (depth >= 2) ? COLUMN(depth - 2) : nullptr;
+
+        switch (tape->code[i])
+        {
+            case TAPE_CONST :
+            {
+                double value = tape->consts[tape->args[i]];
+                for (size_t j = 0; j < count; ++j) top[j] = value;
+                depth++;
+                break;
+            }
+            case TAPE_VAR :
+            {
+                if (tape->args[i] == 0)   for (size_t j = 0; j < count; ++j) top[j] = xs[j];
+                else if (ys != nullptr)   for (size_t j = 0; j < count; ++j) top[j] = ys[j];
+                else                      for (size_t j = 0; j < count; ++j) top[j] = 0;
+                depth++;
+                break;
+            }
+
+            case TAPE_ADD : for (size_t j = 0; j < count; ++j) arg[j] += prev[j];              depth--; break;
+            case TAPE_SUB : for (size_t j = 0; j < count; ++j) arg[j] -= prev[j];              depth--; break;
+            case TAPE_MUL : for (size_t j = 0; j < count; ++j) arg[j] *= prev[j];              depth--; break;
+            case TAPE_DIV : for (size_t j = 0; j < count; ++j) arg[j] /= prev[j];              depth--; break;
+            case TAPE_POW : for (size_t j = 0; j < count; ++j) arg[j] = pow(arg[j], prev[j]); depth--; break;
+
+            case TAPE_SIN  : for (size_t j = 0; j < count; ++j) prev[j] = sin(prev[j]);     break;
+            case TAPE_COS  : for (size_t j = 0; j < count; ++j) prev[j] = cos(prev[j]);     break;
+            case TAPE_TAN  : for (size_t j = 0; j < count; ++j) prev[j] = tan(prev[j]);     break;
+            case TAPE_CTG  : for (size_t j = 0; j < count; ++j) prev[j] = 1 / tan(prev[j]); break;
+            case TAPE_SQRT : for (size_t j = 0; j < count; ++j) prev[j] = sqrt(prev[j]);    break;
+            case TAPE_LN   : for (size_t j = 0; j < count; ++j) prev[j] = log(prev[j]);     break;
+            case TAPE_EXP  : for (size_t j = 0; j < count; ++j) prev[j] = exp(prev[j]);     break;
+
+            default :
+            {
+                for (size_t j = 0; j < count; ++j) top[j] = NAN;
+                depth++;
+                break;
+            }
+        }
+    }
+
+    memcpy(out, COLUMN(depth - 1), count * sizeof(double));
+}
+
+#if BATCH_HAS_AVX2
+
+#define AVX2 __attribute__((target("avx2")))
+
+/////////////////////////////////
+//AVX2 kernels, 4 lanes of double
+/////////////////////////////////
+AVX2 static inline __m256d Splat(double value)
+{
+    return _mm256_set1_pd(value);
+}
+
+AVX2 static inline __m256d Horner(__m256d x, const double* coefficients, size_t num)
+{
+    __m256d result = Splat(coefficients[num - 1]);
+
+    for (size_t i = num - 1; i > 0; --i)
+    {
+        result = _mm256_add_pd(_mm256_mul_pd(result, x), Splat(coefficients[i - 1]));
+    }
+
+    return result;
+}
+
+// 2^n for integral n in [-1022, 1023] built straight in the exponent field
+AVX2 static inline __m256d Pow2(__m256d n)
+{
+    __m128i n32 = _mm256_cvtpd_epi32(n);
+    __m256i n64 = _mm256_cvtepi32_epi64(n32);
+
+    n64 = _mm256_add_epi64(n64, _mm256_set1_epi64x(1023));
+
+    return _mm256_castsi256_pd(_mm256_slli_epi64(n64, 52));
+}
+
+const double EXP_MAX_ARG =  709.782712893384;
+const double EXP_MIN_ARG = -745.1332191019412;
+
+// exp(x) = 2^n exp(r), |r| <= ln2 / 2, exp(r) by its Taylor polynomial up to r^13
+AVX2 static __m256d Exp4(__m256d x)
+{
+    static const double EXP_COEFFICIENTS[] = {1.0, 1.0, 1.0 / 2, 1.0 / 6, 1.0 / 24, 1.0 / 120, 1.0 / 720,
+                                              1.0 / 5040, 1.0 / 40320, 1.0 / 362880, 1.0 / 3628800,
+                                              1.0 / 39916800, 1.0 / 479001600, 1.0 / 6227020800.0};
+
+    const __m256d LOG2E  = Splat(1.4426950408889634);
+    const __m256d LN2_HI = Splat(6.93147180369123816490e-01);
+    const __m256d LN2_LO = Splat(1.90821492927058770002e-10);
+
+    __m256d nan_mask = _mm256_cmp_pd(x, x, _CMP_UNORD_Q);
+    __m256d big      = _mm256_cmp_pd(x, Splat(EXP_MAX_ARG), _CMP_GT_OQ);
+    __m256d small    = _mm256_cmp_pd(x, Splat(EXP_MIN_ARG), _CMP_LT_OQ);
+
+    __m256d clamped = _mm256_min_pd(_mm256_max_pd(x, Splat(EXP_MIN_ARG)), Splat(EXP_MAX_ARG));
+
+    __m256d n = _mm256_round_pd(_mm256_mul_pd(clamped, LOG2E), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256d r = _mm256_sub_pd(clamped, _mm256_mul_pd(n, LN2_HI));
+    r         = _mm256_sub_pd(r,       _mm256_mul_pd(n, LN2_LO));
+
+    // n runs from -1075 to 1024, past what one exponent field holds, so 2^n is applied in two halves
+    __m256d half_n = _mm256_floor_pd(_mm256_mul_pd(n, Splat(0.5)));
+
+    __m256d result = Horner(r, EXP_COEFFICIENTS, sizeof(EXP_COEFFICIENTS) / sizeof(double));
+    result = _mm256_mul_pd(result, Pow2(half_n));
+    result = _mm256_mul_pd(result, Pow2(_mm256_sub_pd(n, half_n)));
+
+    result = _mm256_blendv_pd(result, Splat(INFINITY), big);
+    result = _mm256_blendv_pd(result, Splat(0.0),      small);
+    result = _mm256_blendv_pd(result, x,               nan_mask);
+
+    return result;
+}
+
+// x = 2^e m, sqrt(1/2) <= m < sqrt(2), ln(m) = 2 atanh(s) with s = (m - 1) / (m + 1)
+AVX2 static __m256d Ln4(__m256d x)
+{
+    static const double ATANH_COEFFICIENTS[] = {1.0, 1.0 / 3, 1.0 / 5, 1.0 / 7, 1.0 / 9, 1.0 / 11,
+                                                1.0 / 13, 1.0 / 15, 1.0 / 17, 1.0 / 19, 1.0 / 21};
+
+    const __m256d LN2 = Splat(0.6931471805599453);
+
+    __m256d negative  = _mm256_cmp_pd(x, Splat(0.0), _CMP_LT_OQ);
+    __m256d zero      = _mm256_cmp_pd(x, Splat(0.0), _CMP_EQ_OQ);
+    __m256d infinite  = _mm256_cmp_pd(x, Splat(INFINITY), _CMP_EQ_OQ);
+    __m256d nan_mask  = _mm256_cmp_pd(x, x, _CMP_UNORD_Q);
+    __m256d subnormal = _mm256_cmp_pd(x, Splat(2.2250738585072014e-308), _CMP_LT_OQ);
+
+    // Subnormals are scaled by 2^52 first so that their exponent field is meaningful
+    __m256d scaled = _mm256_blendv_pd(x, _mm256_mul_pd(x, Splat(4503599627370496.0)), subnormal);
+    __m256d shift  = _mm256_blendv_pd(Splat(0.0), Splat(52.0), subnormal);
+
+    __m256i bits     = _mm256_castpd_si256(scaled);
+    __m256i exponent = _mm256_sub_epi64(_mm256_srli_epi64(bits, 52), _mm256_set1_epi64x(1023));
+    __m256i mantissa = _mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi64x(0x000FFFFFFFFFFFFFLL)),
+                                       _mm256_set1_epi64x(0x3FF0000000000000LL));
+
+    __m256d m = _mm256_castsi256_pd(mantissa);
+
+    // exponent fits in 32 bits, collect the low halves for the int -> double conversion
+    __m256i packed = _mm256_permutevar8x32_epi32(exponent, _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6));
+    __m256d e      = _mm256_cvtepi32_pd(_mm256_castsi256_si128(packed));
+
+    __m256d big = _mm256_cmp_pd(m, Splat(1.4142135623730951), _CMP_GT_OQ);
+    m = _mm256_blendv_pd(m, _mm256_mul_pd(m, Splat(0.5)), big);
+    e = _mm256_add_pd(e, _mm256_and_pd(big, Splat(1.0)));
+    e = _mm256_sub_pd(e, shift);
+
+    __m256d s  = _mm256_div_pd(_mm256_sub_pd(m, Splat(1.0)), _mm256_add_pd(m, Splat(1.0)));
+    __m256d s2 = _mm256_mul_pd(s, s);
+
+    __m256d poly   = Horner(s2, ATANH_COEFFICIENTS, sizeof(ATANH_COEFFICIENTS) / sizeof(double));
+    __m256d result = _mm256_add_pd(_mm256_mul_pd(e, LN2), _mm256_mul_pd(_mm256_add_pd(s, s), poly));
+
+    result = _mm256_blendv_pd(result, Splat(-INFINITY), zero);
+    result = _mm256_blendv_pd(result, Splat(INFINITY),  infinite);
+    result = _mm256_blendv_pd(result, Splat(NAN),       negative);
+    result = _mm256_blendv_pd(result, x,                nan_mask);
+
+    return result;
+}
+
+// Cody-Waite reduction to |r| <= pi / 4, the quadrant picks sin or cos of r and the sign
+AVX2 static void SinCos4(__m256d x, __m256d* sin_result, __m256d* cos_result)
+{
+    static const double SIN_COEFFICIENTS[] = {1.0, -1.0 / 6, 1.0 / 120, -1.0 / 5040, 1.0 / 362880,
+                                              -1.0 / 39916800, 1.0 / 6227020800.0, -1.0 / 1307674368000.0};
+    static const double COS_COEFFICIENTS[] = {1.0, -1.0 / 2, 1.0 / 24, -1.0 / 720, 1.0 / 40320,
+                                              -1.0 / 3628800, 1.0 / 479001600, -1.0 / 87178291200.0,
+                                              1.0 / 20922789888000.0};
+
+    const __m256d TWO_OVER_PI = Splat(0.6366197723675814);
+    const __m256d PIO2_1      = Splat(1.57079632673412561417e+00);
+    const __m256d PIO2_2      = Splat(6.07710050650619224932e-11);
+    const __m256d PIO2_3      = Splat(2.02226624879595063154e-21);
+
+    __m256d n = _mm256_round_pd(_mm256_mul_pd(x, TWO_OVER_PI), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256d r = _mm256_sub_pd(x, _mm256_mul_pd(n, PIO2_1));
+    r         = _mm256_sub_pd(r, _mm256_mul_pd(n, PIO2_2));
+    r         = _mm256_sub_pd(r, _mm256_mul_pd(n, PIO2_3));
+
+    __m256d r2 = _mm256_mul_pd(r, r);
+
+    __m256d sin_r = _mm256_mul_pd(r, Horner(r2, SIN_COEFFICIENTS, sizeof(SIN_COEFFICIENTS) / sizeof(double)));
+    __m256d cos_r = Horner(r2, COS_COEFFICIENTS, sizeof(COS_COEFFICIENTS) / sizeof(double));
+
+    __m128i quadrant32 = _mm256_cvtpd_epi32(n);
+    __m256i quadrant   = _mm256_cvtepi32_epi64(quadrant32);
+
+    __m256i odd      = _mm256_and_si256(quadrant, _mm256_set1_epi64x(1));
+    __m256d swap     = _mm256_castsi256_pd(_mm256_cmpeq_epi64(odd, _mm256_set1_epi64x(1)));
+    __m256i sin_sign = _mm256_slli_epi64(_mm256_and_si256(quadrant, _mm256_set1_epi64x(2)), 62);
+    __m256i cos_sign = _mm256_slli_epi64(_mm256_and_si256(_mm256_add_epi64(quadrant, _mm256_set1_epi64x(1)),
+                                                          _mm256_set1_epi64x(2)), 62);
+
+    __m256d sin_value = _mm256_blendv_pd(sin_r, cos_r, swap);
+    __m256d cos_value = _mm256_blendv_pd(cos_r, sin_r, swap);
+
+    *sin_result = _mm256_xor_pd(sin_value, _mm256_castsi256_pd(sin_sign));
+    *cos_result = _mm256_xor_pd(cos_value, _mm256_castsi256_pd(cos_sign));
+}
+
+// Beyond this the three-part reduction loses digits, such lanes go to libm
+const double SINCOS_MAX_ARG = 1e5;
+
+AVX2 static bool IsReducible(__m256d x)
+{
+    __m256d magnitude = _mm256_andnot_pd(Splat(-0.0), x);
+    __m256d in_range  = _mm256_cmp_pd(magnitude, Splat(SINCOS_MAX_ARG), _CMP_LE_OQ);
+
+    return _mm256_movemask_pd(in_range) == 0xF;
+}
+
+AVX2 void Trigonometry4(int opcode, double* column, size_t count)
+{
+    size_t j = 0;
+
+    for (; j + 4 <= count; j += 4)
+    {
+        __m256d x = _mm256_load_pd(column + j);
+
+        if (!IsReducible(x))
+        {
+            for (size_t k = j; k < j + 4; ++k)
+            {
+                double value = column[k];
+                if      (opcode == TAPE_SIN) column[k] = sin(value);
+                else if (opcode == TAPE_COS) column[k] = cos(value);
+                else if (opcode == TAPE_TAN) column[k] = tan(value);
+                else                         column[k] = 1 / tan(value);
+            }
+            continue;
+        }
+
+        __m256d sin_x = x;
+        __m256d cos_x = x;
+        SinCos4(x, &sin_x, &cos_x);
+
+        __m256d result = sin_x;
+        if      (opcode == TAPE_COS) result = cos_x;
+        else if (opcode == TAPE_TAN) result = _mm256_div_pd(sin_x, cos_x);
+        else if (opcode == TAPE_CTG) result = _mm256_div_pd(cos_x, sin_x);
+
+        _mm256_store_pd(column + j, result);
+    }
+
+    for (; j < count; ++j)
+    {
+        double value = column[j];
+        if      (opcode == TAPE_SIN) column[j] = sin(value);
+        else if (opcode == TAPE_COS) column[j] = cos(value);
+        else if (opcode == TAPE_TAN) column[j] = tan(value);
+        else                         column[j] = 1 / tan(value);
+    }
+}
+
+#define VECTOR_LOOP(count, body_4, body_1)         \
+    {                                              \
+        size_t j = 0;                              \
+        for (; j + 4 <= (count); j += 4) { body_4; } \
+        for (; j < (count); ++j)         { body_1; } \
+    }
+
+AVX2 void EvalBlockAvx2(const Tape* tape, double* stack, const double* xs, const double* ys, double* out, size_t count)
+{
+    size_t depth = 0;
+
+    for (size_t i = 0; i < tape->size; ++i)
+    {
+        double* top  = COLUMN(depth);
+        double* prev = (depth >= 1) ? COLUMN(depth - 1) : nullptr;
+        double* arg  = (depth >= 2) ? COLUMN(depth - 2) : nullptr;
+
+        switch (tape->code[i])
+        {
+            case TAPE_CONST :
+            {
+                double value = tape->consts[tape->args[i]];
+                VECTOR_LOOP(count, _mm256_store_pd(top + j, Splat(value)), top[j] = value);
+                depth++;
+                break;
+            }
+            case TAPE_VAR :
+            {
+                const double* source = (tape->args[i] == 0) ? xs : ys;
+
+                if (source == nullptr) VECTOR_LOOP(count, _mm256_store_pd(top + j, Splat(0.0)), top[j] = 0)
+                else                   VECTOR_LOOP(count, _mm256_store_pd(top + j, _mm256_loadu_pd(source + j)),
+                                                   top[j] = source[j])
+                depth++;
+                break;
+            }
+            case TAPE_ADD :
+            {
+                VECTOR_LOOP(count, _mm256_store_pd(arg + j, _mm256_add_pd(_mm256_load_pd(arg + j), _mm256_load_pd(prev + j))),
+                                   arg[j] += prev[j]);
+                depth--;
+                break;
+            }
+            case TAPE_SUB :
+            {
+                VECTOR_LOOP(count, _mm256_store_pd(arg + j, _mm256_sub_pd(_mm256_load_pd(arg + j), _mm256_load_pd(prev + j))),
+                                   arg[j] -= prev[j]);
+                depth--;
+                break;
+            }
+            case TAPE_MUL :
+            {
+                VECTOR_LOOP(count, _mm256_store_pd(arg + j, _mm256_mul_pd(_mm256_load_pd(arg + j), _mm256_load_pd(prev + j))),
+                                   arg[j] *= prev[j]);
+                depth--;
+                break;
+            }
+            case TAPE_DIV :
+            {
+                VECTOR_LOOP(count, _mm256_store_pd(arg + j, _mm256_div_pd(_mm256_load_pd(arg + j), _mm256_load_pd(prev + j))),
+                                   arg[j] /= prev[j]);
+                depth--;
+                break;
+            }
+            case TAPE_POW :
+            {
+                // pow keeps libm semantics for negative bases and integral exponents
+                for (size_t j = 0; j < count; ++j) arg[j] = pow(arg[j], prev[j]);
+                depth--;
+                break;
+            }
+            case TAPE_SIN :
+            case TAPE_COS :
+            case TAPE_TAN :
+            case TAPE_CTG :
+            {
+                Trigonometry4(tape->code[i], prev, count);
+                break;
+            }
+            case TAPE_SQRT :
+            {
+                VECTOR_LOOP(count, _mm256_store_pd(prev + j, _mm256_sqrt_pd(_mm256_load_pd(prev + j))),
+                                   prev[j] = sqrt(prev[j]));
+                break;
+            }
+            case TAPE_LN :
+            {
+                VECTOR_LOOP(count, _mm256_store_pd(prev + j, Ln4(_mm256_load_pd(prev + j))),
+                                   prev[j] = log(prev[j]));
+                break;
+            }
+            case TAPE_EXP :
+            {
+                VECTOR_LOOP(count, _mm256_store_pd(prev + j, Exp4(_mm256_load_pd(prev + j))),
+                                   prev[j] = exp(prev[j]));
+                break;
+            }
+            default :
+            {
+                for (size_t j = 0; j < count; ++j) top[j] = NAN;
+                depth++;
+                break;
+            }
+        }
+    }
+
+    memcpy(out, COLUMN(depth - 1), count * sizeof(double));
+}
+
+#undef VECTOR_LOOP
+#undef AVX2
+
+#else
+
+void EvalBlockAvx2(const Tape* tape, double* stack, const double* xs, const double* ys, double* out, size_t count)
+{
+    EvalBlockScalar(tape, stack, xs, ys, out, count);
+}
+
+#endif
+
+#undef COLUMN
@@ -0,0 +1,464 @@
+#include <time.h>
+#include <unistd.h>
+
+#include "batch_mode.h"
+
+
+const char* BATCH_USAGE = "usage : derivative --batch [--threads N] [--derivative N | --taylor N | --gradient] [--dag] [--compact] [--cache] [--stats file] input [output]\n";
+
+// By BatchTask
+static const StoreTask STORE_TASKS[] = {STORE_DERIVATIVE, STORE_TAYLOR, STORE_GRADIENT};
+
+/////////////////////////////////
+//Batch mode
+/////////////////////////////////
+int    RunBatch          (const int argc, char* argv[]);
+bool   ParseBatchOptions (const int argc, char* argv[], BatchOptions* options);
+bool   ParseCount        (const char* str, size_t* count);
+ExprSpan* SplitExpressions(const InputFile* input, size_t* num_exprs);
+void   RunBatchPool      (BatchPool* pool);
+void*  WorkerMain        (void* arg);
+bool   PopJob            (WorkerQueue* queue, size_t* job);
+bool   StealJobs         (BatchPool* pool, BatchWorker* thief);
+void   ProcessExpression (BatchWorker* worker, const ExprSpan* expr, BatchResult* result);
+bool   WriteResults      (BatchPool* pool, const char* output);
+double WallTime          ();
+
+
+int RunBatch(const int argc, char* argv[])
+{
+    BatchOptions options = {};
+
+    if (!ParseBatchOptions(argc, argv, &options))
+    {
+        fprintf(stderr, "%s", BATCH_USAGE);
+        return 1;
+    }
+
+    BatchPool pool = {};
+    pool.options   = &options;
+
+    if (!MapInput(options.input, &pool.input))
+    {
+        fprintf(stderr, "Batch error : can't read %s\n", options.input);
+        return 1;
+    }
+
+    if (options.stats != nullptr) EnableStats();
+
+    pool.exprs   = SplitExpressions(&pool.input, &pool.num_exprs);
+    pool.results = (BatchResult*)calloc(pool.num_exprs + 1, sizeof(BatchResult));
+    assert(pool.results);
+
+    double start = WallTime();
+    RunBatchPool(&pool);
+    double end = WallTime();
+
+    bool is_written = WriteResults(&pool, options.output);
+
+    if (options.stats != nullptr && !WriteStats(nullptr, options.stats)) is_written = false;
+
+    size_t num_stolen = 0;
+    size_t num_cached = 0;
+    for (size_t i = 0; i < pool.num_workers; ++i)
+    {
+        num_stolen += pool.workers[i].num_stolen;
+        num_cached += pool.workers[i].num_cached;
+    }
+
+    fprintf(stderr, "%zu expressions, %zu threads, %zu stolen, %zu cached, %.2lf ms\n",
+            pool.num_exprs, pool.num_workers, num_stolen, num_cached, 1000 * (end - start));
+
+    for (size_t i = 0; i < pool.num_exprs; ++i)
+    {
+        free(pool.results[i].text);
+    }
+
+    free(pool.results);
+    free(pool.workers);
+    free(pool.exprs);
+    UnmapInput(&pool.input);
+
+    return is_written ? 0 : 1;
+}
+
+bool ParseBatchOptions(const int argc, char* argv[], BatchOptions* options)
+{
+    assert(argv);
+    assert(options);
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+
+        if (strcmp(arg, "--batch") == 0)
+        {
+            continue;
+        }
+        else if (strcmp(arg, "--dag") == 0)
+        {
+            options->is_dag = true;
+        }
+        else if (strcmp(arg, "--compact") == 0)
+        {
+            options->is_compact = true;
+        }
+        else if (strcmp(arg, "--cache") == 0)
+        {
+            options->is_cached = true;
+        }
+        else if (strcmp(arg, "--gradient") == 0)
+        {
+            options->task = BATCH_GRADIENT;
+        }
+        else if (strcmp(arg, "--stats") == 0)
+        {
+            if (i + 1 >= argc) return false;
+
+            options->stats = argv[++i];
+        }
+        else if (strcmp(arg, "--threads") == 0 || strcmp(arg, "--derivative") == 0 || strcmp(arg, "--taylor") == 0)
+        {
+            size_t count = 0;
+
+            if (i + 1 >= argc || !ParseCount(argv[++i], &count)) return false;
+
+            if      (strcmp(arg, "--threads")    == 0) options->num_threads = count;
+            else if (strcmp(arg, "--derivative") == 0) options->task = BATCH_DERIVATIVE, options->order = count;
+            else                                       options->task = BATCH_TAYLOR,     options->order = count;
+        }
+        else if (arg[0] == '-' && arg[1] == '-')
+        {
+            return false;
+        }
+        else if (options->input == nullptr)
+        {
+            options->input = arg;
+        }
+        else if (options->output == nullptr)
+        {
+            options->output = arg;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    if (options->num_threads == 0)
+    {
+        long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        options->num_threads = (num_cpus > 0) ? (size_t)num_cpus : 1;
+    }
+
+    return options->input != nullptr;
+}
+
+bool ParseCount(const char* str, size_t* count)
+{
+    assert(str);
+    assert(count);
+
+    char* end = nullptr;
+    long  num = strtol(str, &end, 10);
+
+    if (end == str || *end != '\0' || num < 0) return false;
+
+    *count = (size_t)num;
+
+    return true;
+}
+
+// Blank lines are skipped, an unfinished line goes on to the next one like in GetTree
+ExprSpan* SplitExpressions(const InputFile* input, size_t* num_exprs)
+{
+    assert(input);
+    assert(num_exprs);
+
+    const char* end = input->data + input->size;
+    const char* str = SkipBlanks(input->data, end);
+
+    size_t    capacity = 64;
+    ExprSpan* exprs    = (ExprSpan*)calloc(capacity, sizeof(ExprSpan));
+    assert(exprs);
+
+    *num_exprs = 0;
+
+    while (str < end)
+    {
+        if (*num_exprs == capacity)
+        {
+            capacity *= 2;
+
+            exprs = (ExprSpan*)realloc(exprs, capacity * sizeof(ExprSpan));
+            assert(exprs);
+        }
+
+        ExprSpan* expr = &exprs[(*num_exprs)++];
+
+        expr->start = str;
+        expr->end   = FindExpressionEnd(str, end);
+
+        str = SkipBlanks(expr->end, end);
+    }
+
+    return exprs;
+}
+
+void RunBatchPool(BatchPool* pool)
+{
+    assert(pool);
+    assert(pool->options);
+
+    size_t num_workers = pool->options->num_threads;
+    if (num_workers > pool->num_exprs) num_workers = pool->num_exprs;
+    if (num_workers == 0)              num_workers = 1;
+
+    pool->num_workers = num_workers;
+    pool->workers     = (BatchWorker*)calloc(num_workers, sizeof(BatchWorker));
+    assert(pool->workers);
+
+    // Every worker starts with a contiguous slice, stealing evens out expressions of different cost
+    for (size_t i = 0; i < num_workers; ++i)
+    {
+        BatchWorker* worker = &pool->workers[i];
+
+        worker->id          = i;
+        worker->pool        = pool;
+        worker->queue.begin = pool->num_exprs *  i      / num_workers;
+        worker->queue.end   = pool->num_exprs * (i + 1) / num_workers;
+
+        pthread_mutex_init(&worker->queue.lock, nullptr);
+    }
+
+    for (size_t i = 1; i < num_workers; ++i)
+    {
+        pthread_create(&pool->workers[i].thread, nullptr, WorkerMain, &pool->workers[i]);
+    }
+
+    WorkerMain(&pool->workers[0]);
+
+    for (size_t i = 1; i < num_workers; ++i)
+    {
+        pthread_join(pool->workers[i].thread, nullptr);
+    }
+
+    for (size_t i = 0; i < num_workers; ++i)
+    {
+        pthread_mutex_destroy(&pool->workers[i].queue.lock);
+    }
+}
+
+void* WorkerMain(void* arg)
+{
+    assert(arg);
+
+    BatchWorker* worker = (BatchWorker*)arg;
+    BatchPool*   pool   = worker->pool;
+
+    size_t job = 0;
+
+    while (true)
+    {
+        if (!PopJob(&worker->queue, &job))
+        {
+            // Jobs never spawn jobs, so once nothing is left to steal the worker is done
+            if (!StealJobs(pool, worker)) break;
+
+            continue;
+        }
+
+        ProcessExpression(worker, &pool->exprs[job], &pool->results[job]);
+        worker->num_done++;
+    }
+
+    NodeArena spare_arena = {};
+    spare_arena.spare     = worker->spare;
+    ArenaRelease(&spare_arena);
+
+    worker->spare = nullptr;
+
+    return nullptr;
+}
+
+bool PopJob(WorkerQueue* queue, size_t* job)
+{
+    assert(queue);
+    assert(job);
+
+    pthread_mutex_lock(&queue->lock);
+
+    bool has_job = queue->begin < queue->end;
+    if (has_job) *job = queue->begin++;
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return has_job;
+}
+
+bool StealJobs(BatchPool* pool, BatchWorker* thief)
+{
+    assert(pool);
+    assert(thief);
+
+    for (size_t i = 1; i < pool->num_workers; ++i)
+    {
+        BatchWorker* victim = &pool->workers[(thief->id + i) % pool->num_workers];
+
+        pthread_mutex_lock(&victim->queue.lock);
+
+        size_t end  = victim->queue.end;
+        size_t left = end - victim->queue.begin;
+        size_t mid  = end - (left + 1) / 2;
+
+        if (left > 0) victim->queue.end = mid;
+
+        pthread_mutex_unlock(&victim->queue.lock);
+
+        if (left == 0) continue;
+
+        pthread_mutex_lock(&thief->queue.lock);
+        thief->queue.begin = mid;
+        thief->queue.end   = end;
+        pthread_mutex_unlock(&thief->queue.lock);
+
+        thief->num_stolen += end - mid;
+
+        return true;
+    }
+
+    return false;
+}
+
+void ProcessExpression(BatchWorker* worker, const ExprSpan* expr, BatchResult* result)
+{
+    assert(worker);
+    assert(expr);
+    assert(result);
+
+    const BatchOptions* options = worker->pool->options;
+
+    DerTree* tree = NewTree();
+
+    tree->arena.spare = worker->spare;
+    worker->spare     = nullptr;
+
+    FILE* output = open_memstream(&result->text, &result->size);
+    assert(output);
+
+    double start = StatsClock();
+    tree->root   = GetAnswer(tree, expr->start, expr->end);
+
+    if (tree->root == nullptr)
+    {
+        fprintf(output, "error");
+    }
+    else
+    {
+        SetNils(tree, tree->root);
+        SetParents(tree);
+
+        StatsRecord(tree, PHASE_GET_TREE, start);
+
+        if (options->is_dag) MakeDag(tree);
+
+        // The derivative is taken in place, the other tasks make trees of their own
+        DerTree* results[NUM_VARIABLES] = {tree};
+        size_t   num_results            = (options->task == BATCH_GRADIENT) ? NUM_VARIABLES : 1;
+
+        StoreKey key       = {};
+        bool     is_stored = options->is_cached &&
+                             LoadStoredResult(tree, STORE_TASKS[options->task], options->order, &key, results, num_results);
+
+        if (is_stored)
+        {
+            worker->num_cached++;
+        }
+        else if (options->task == BATCH_TAYLOR)
+        {
+            results[0] = TaylorADTree(tree, options->order);
+        }
+        else if (options->task == BATCH_GRADIENT)
+        {
+            GradientTrees(tree, results);
+        }
+        else
+        {
+            TakeNthDerivative(tree, options->order);
+        }
+
+        if (options->is_cached && !is_stored)
+        {
+            start = StatsClock();
+            SaveStoredResult(&key, results, num_results);
+            StatsRecord(tree, PHASE_STORE, start);
+        }
+
+        DestructStoreKey(&key);
+
+        start = StatsClock();
+
+        // Once for the result, the print walks every node of it
+        for (size_t i = 0; options->is_compact && i < num_results; ++i)
+        {
+            RelayoutTree(results[i]);
+        }
+
+        // df/dx ; df/dy
+        for (size_t i = 0; i < num_results; ++i)
+        {
+            if (i > 0) fprintf(output, " ; ");
+            PrintFormula(results[i], output);
+        }
+
+        StatsRecord(tree, PHASE_PRINT, start);
+
+        for (size_t i = 0; i < num_results; ++i)
+        {
+            if (results[i] == tree) continue;
+
+            Destruct(results[i]);
+            Delete(results[i]);
+        }
+    }
+
+    fclose(output);
+
+    ArenaRecycle(&tree->arena);
+    worker->spare     = tree->arena.spare;
+    tree->arena.spare = nullptr;
+
+    Destruct(tree);
+    Delete(tree);
+}
+
+bool WriteResults(BatchPool* pool, const char* output)
+{
+    assert(pool);
+
+    FILE* file = (output != nullptr) ? fopen(output, "w") : stdout;
+
+    if (file == nullptr)
+    {
+        fprintf(stderr, "Batch error : can't open %s\n", output);
+        return false;
+    }
+
+    for (size_t i = 0; i < pool->num_exprs; ++i)
+    {
+        fwrite(pool->results[i].text, sizeof(char), pool->results[i].size, file);
+        fputc('\n', file);
+    }
+
+    if (file != stdout) fclose(file);
+
+    return true;
+}
+
+double WallTime()
+{
+    struct timespec now = {};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
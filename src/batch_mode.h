@@ -0,0 +1,81 @@
+#pragma once
+
+#include <pthread.h>
+
+#include "derivative.h"
+#include "expression_loader.h"
+
+enum BatchTask
+{
+    BATCH_DERIVATIVE = 0,
+    BATCH_TAYLOR     = 1,
+    BATCH_GRADIENT   = 2
+};
+
+struct BatchOptions
+{
+    const char* input  = nullptr;
+    const char* output = nullptr;
+    const char* stats  = nullptr;
+
+    size_t    num_threads = 0;
+    BatchTask task        = BATCH_DERIVATIVE;
+    size_t    order       = 1;
+    bool      is_dag      = false;
+    bool      is_compact  = false;
+    bool      is_cached   = false;
+};
+
+struct BatchResult
+{
+    char*  text = nullptr;
+    size_t size = 0;
+};
+
+// Jobs are expression numbers, the owner pops from begin and thieves cut off the upper half
+struct WorkerQueue
+{
+    pthread_mutex_t lock;
+
+    size_t begin = 0;
+    size_t end   = 0;
+};
+
+struct BatchPool;
+
+struct BatchWorker
+{
+    pthread_t thread;
+    size_t    id = 0;
+
+    WorkerQueue queue;
+
+    // Node blocks kept between expressions, every tree of this worker is built in them
+    NodeBlock* spare = nullptr;
+
+    BatchPool* pool = nullptr;
+
+    size_t num_done   = 0;
+    size_t num_stolen = 0;
+    size_t num_cached = 0;
+};
+
+struct BatchPool
+{
+    const BatchOptions* options = nullptr;
+
+    InputFile input;
+
+    ExprSpan* exprs     = nullptr;
+    size_t    num_exprs = 0;
+
+    BatchResult* results = nullptr;
+
+    BatchWorker* workers     = nullptr;
+    size_t       num_workers = 0;
+};
+
+int  RunBatch         (const int argc, char* argv[]);
+bool ParseBatchOptions(const int argc, char* argv[], BatchOptions* options);
+void RunBatchPool     (BatchPool* pool);
+ExprSpan* SplitExpressions(const InputFile* input, size_t* num_exprs);
@@ -0,0 +1,1294 @@
+#include <time.h>
+
+#include "derivative.h"
+#include "expression_loader.h"
+#include "tape.h"
+#include "codegen.h"
+
+
+const size_t BENCH_LINE_SIZE = 512;
+const size_t BENCH_ORDER     = 5;
+const size_t BENCH_EVALS     = 1000000;
+const size_t BENCH_PARSE_MB  = 64;
+const char*  BENCH_INPUT     = "src/derivative.txt";
+const size_t STRESS_DEPTH    = 1000000;
+const size_t STRESS_ORDER    = 2;
+const size_t BENCH_PRINTS    = 20;
+
+const size_t BENCH_COMPACT_EVALS = 10000;
+const size_t BENCH_GRADIENTS     = 10000;
+const size_t BENCH_HESSIANS      = 10000;
+const size_t BENCH_DUMP_DEPTH    = 6;
+const size_t BENCH_DUMP_COLLAPSE = 50;
+
+
+bool IsBlankLine(const char* line)
+{
+    assert(line);
+
+    while (isspace(*line)) line++;
+
+    return *line == '\0';
+}
+
+DerTree* BenchParse(char* line, const char* expression)
+{
+    assert(line);
+    assert(expression);
+
+    strncpy(line, expression, BENCH_LINE_SIZE - 1);
+    line[strcspn(line, "\r\n")] = '\0';
+
+    DerTree* tree = NewTree();
+    tree->root    = GetAnswer(tree, line, line + strlen(line));
+
+    if (tree->root == nullptr)
+    {
+        Destruct(tree);
+        Delete(tree);
+        return nullptr;
+    }
+
+    SetNils(tree, tree->root);
+    SetParents(tree);
+
+    return tree;
+}
+
+void BenchAllocations(const char* expression)
+{
+    assert(expression);
+
+    char     line[BENCH_LINE_SIZE] = "";
+    DerTree* tree = BenchParse(line, expression);
+
+    if (tree == nullptr) return;
+
+    clock_t start = clock();
+
+    for (size_t i = 0; i < BENCH_ORDER; ++i)
+    {
+        TakeDerivative(tree);
+    }
+
+    Destruct(tree);
+
+    clock_t end = clock();
+
+    NodeArena* arena = &tree->arena;
+
+    // Without the arena every node was its own calloc and every release its own free
+    size_t calls_before = arena->num_allocs + arena->num_frees;
+    size_t calls_after  = 2 * arena->num_blocks;
+
+    printf("%-40.40s %10zu %10zu %14zu %12zu %10.2lf\n", line, arena->num_allocs, arena->num_reused,
+           calls_before, calls_after, 1000.0 * (double)(end - start) / CLOCKS_PER_SEC);
+
+    Delete(tree);
+}
+
+void BenchDagGrowth(const char* expression)
+{
+    assert(expression);
+
+    char     line[BENCH_LINE_SIZE] = "";
+    DerTree* tree = BenchParse(line, expression);
+
+    if (tree == nullptr) return;
+
+    DerTree* dag = CopyTree(tree);
+    MakeDag(dag);
+
+    printf("%-40.40s", line);
+
+    for (size_t i = 0; i < BENCH_ORDER; ++i)
+    {
+        TakeDerivative(tree);
+        TakeDerivative(dag);
+
+        printf(" %8zu/%-6zu", CountNodes(tree), CountNodes(dag));
+    }
+    printf("\n");
+
+    Destruct(tree);
+    Delete(tree);
+    Destruct(dag);
+    Delete(dag);
+}
+
+bool IsSameFormula(DerTree* first, DerTree* second)
+{
+    assert(first);
+    assert(second);
+
+    char*  first_text  = nullptr;
+    char*  second_text = nullptr;
+    size_t first_size  = 0;
+    size_t second_size = 0;
+
+    FILE* first_file  = open_memstream(&first_text,  &first_size);
+    FILE* second_file = open_memstream(&second_text, &second_size);
+    assert(first_file);
+    assert(second_file);
+
+    PrintFormula(first,  first_file);
+    PrintFormula(second, second_file);
+
+    fclose(first_file);
+    fclose(second_file);
+
+    bool is_same = (first_size == second_size) && (memcmp(first_text, second_text, first_size) == 0);
+
+    free(first_text);
+    free(second_text);
+
+    return is_same;
+}
+
+// Simplifies the raw derivative once by passes and once by the worklist, the trees have to come out the same
+void BenchSimplify(const char* expression)
+{
+    assert(expression);
+
+    char     line[BENCH_LINE_SIZE] = "";
+    DerTree* tree = BenchParse(line, expression);
+
+    if (tree == nullptr) return;
+
+    for (size_t i = 1; i <= BENCH_ORDER; ++i)
+    {
+        DerTree* passes = CopyTree(tree);
+        DerNode* raw    = Derivative(passes, passes->root);
+        DestructNodes(passes, passes->root);
+        passes->root    = raw;
+        SetParents(passes);
+
+        DerTree* worklist = CopyTree(passes);
+
+        clock_t start = clock();
+        SimplifyByPasses(passes);
+        clock_t middle = clock();
+        Simplify(worklist);
+        clock_t end = clock();
+
+        bool is_same = IsSameFormula(passes, worklist);
+
+        printf("%-40.40s %5zu %7zu %11zu %11zu %10.2lf %10.2lf %s\n", (i == 1) ? line : "", i,
+               passes->simplify_stats.passes, passes->simplify_stats.visits, worklist->simplify_stats.visits,
+               1000.0 * (double)(middle - start) / CLOCKS_PER_SEC, 1000.0 * (double)(end - middle) / CLOCKS_PER_SEC,
+               is_same ? "same" : "DIFFERENT");
+
+        Destruct(tree);
+        Delete(tree);
+        Destruct(passes);
+        Delete(passes);
+
+        tree = worklist;
+    }
+
+    Destruct(tree);
+    Delete(tree);
+}
+
+size_t FormulaSize(DerTree* tree, bool is_shared)
+{
+    assert(tree);
+
+    char*  text = nullptr;
+    size_t size = 0;
+
+    FILE* file = open_memstream(&text, &size);
+    assert(file);
+
+    if (is_shared) PrintSharedFormula(tree, file);
+    else           PrintFormula(tree, file);
+
+    fclose(file);
+    free(text);
+
+    return size;
+}
+
+// Bytes of LaTeX for every derivative order, without and with the repeated subtrees named
+void BenchSharedOutput(const char* expression)
+{
+    assert(expression);
+
+    char     line[BENCH_LINE_SIZE] = "";
+    DerTree* tree = BenchParse(line, expression);
+
+    if (tree == nullptr) return;
+
+    printf("%-40.40s", line);
+
+    for (size_t i = 1; i <= BENCH_ORDER; ++i)
+    {
+        TakeDerivative(tree);
+
+        printf(" %9zu/%-9zu", FormulaSize(tree, false), FormulaSize(tree, true));
+    }
+
+    printf("\n");
+
+    Destruct(tree);
+    Delete(tree);
+}
+
+void BenchTape(const char* expression)
+{
+    assert(expression);
+
+    char     line[BENCH_LINE_SIZE] = "";
+    DerTree* tree = BenchParse(line, expression);
+
+    if (tree == nullptr) return;
+
+    Tape* tape = CompileTape(tree);
+
+    clock_t start = clock();
+
+    double sum = 0;
+    for (size_t i = 0; i < BENCH_EVALS; ++i)
+    {
+        sum += EvalTape(tape, 0.5 + 1e-6 * (double)i, 0.25);
+    }
+
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    printf("%-40.40s %10zu %12.2lf %16.6lg\n", line, tape->size,
+           (seconds > 0) ? (double)BENCH_EVALS / seconds / 1e6 : 0, sum / (double)BENCH_EVALS);
+
+    DestructTape(tape);
+    Destruct(tree);
+    Delete(tree);
+}
+
+double BenchPrint(DerTree* tree)
+{
+    assert(tree);
+
+    clock_t start = clock();
+
+    for (size_t i = 0; i < BENCH_PRINTS; ++i)
+    {
+        FormulaSize(tree, false);
+    }
+
+    return 1000.0 * (double)(clock() - start) / CLOCKS_PER_SEC / BENCH_PRINTS;
+}
+
+// Bytes of the nodes and of a compact copy after the last derivative, printing before and after
+// the nodes are laid out again and evaluations of the compact copy against the tape
+void BenchCompact(const char* expression)
+{
+    assert(expression);
+
+    char     line[BENCH_LINE_SIZE] = "";
+    DerTree* tree = BenchParse(line, expression);
+
+    if (tree == nullptr) return;
+
+    for (size_t i = 0; i < BENCH_ORDER; ++i)
+    {
+        TakeDerivative(tree);
+    }
+
+    double print_ms = BenchPrint(tree);
+
+    RelayoutTree(tree);
+
+    double relaid_ms = BenchPrint(tree);
+
+    CompactTree compact_tree = {};
+    BuildCompact(tree, &compact_tree);
+
+    CompactTree* compact = &compact_tree;
+    Tape*        tape    = CompileTape(tree);
+
+    double* values = (double*)calloc(compact->size + 1, sizeof(double));
+    assert(values);
+
+    double tape_sum    = 0;
+    double compact_sum = 0;
+
+    clock_t start = clock();
+
+    for (size_t i = 0; i < BENCH_COMPACT_EVALS; ++i)
+    {
+        tape_sum += EvalTape(tape, 0.5 + 1e-6 * (double)i, 0.25);
+    }
+
+    double tape_seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    start = clock();
+
+    for (size_t i = 0; i < BENCH_COMPACT_EVALS; ++i)
+    {
+        compact_sum += EvalCompact(compact, values, 0.5 + 1e-6 * (double)i, 0.25);
+    }
+
+    double compact_seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    // The relative difference of the sums is about the rounding error when both compute the same
+    double diff = fabs(tape_sum - compact_sum) / fmax(1, fabs(tape_sum));
+
+    printf("%-40.40s %8zu %10zu %10zu %9.3lf %9.3lf %10.2lf %10.2lf %8.2lg\n", line, compact->size,
+           compact->size * sizeof(DerNode), CompactBytes(compact), print_ms, relaid_ms,
+           (tape_seconds    > 0) ? (double)BENCH_COMPACT_EVALS / tape_seconds    / 1e6 : 0,
+           (compact_seconds > 0) ? (double)BENCH_COMPACT_EVALS / compact_seconds / 1e6 : 0, diff);
+
+    free(values);
+    DestructCompact(compact);
+    DestructTape(tape);
+    Destruct(tree);
+    Delete(tree);
+}
+
+// The cost of a numeric gradient against one evaluation, and how far the symbolic partials are from it
+void BenchGradient(const char* expression)
+{
+    assert(expression);
+
+    char     line[BENCH_LINE_SIZE] = "";
+    DerTree* tree = BenchParse(line, expression);
+
+    if (tree == nullptr) return;
+
+    CompactTree compact_tree = {};
+    BuildCompact(tree, &compact_tree);
+
+    CompactTree* compact = &compact_tree;
+
+    double* values   = (double*)calloc(compact->size + 1, sizeof(double));
+    double* adjoints = (double*)calloc(compact->size + 1, sizeof(double));
+    assert(values);
+    assert(adjoints);
+
+    double gradient[NUM_VARIABLES] = {};
+    double sum                     = 0;
+
+    clock_t start = clock();
+
+    for (size_t i = 0; i < BENCH_GRADIENTS; ++i)
+    {
+        sum += EvalCompact(compact, values, 0.5 + 1e-6 * (double)i, 0.25);
+    }
+
+    double eval_seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    start = clock();
+
+    for (size_t i = 0; i < BENCH_GRADIENTS; ++i)
+    {
+        sum += GradientCompact(compact, values, adjoints, 0.5 + 1e-6 * (double)i, 0.25, gradient);
+    }
+
+    double gradient_seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    start = clock();
+
+    DerTree* partials[NUM_VARIABLES] = {};
+    GradientTrees(tree, partials);
+
+    double symbolic_ms = 1000.0 * (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    size_t symbolic_nodes = 0;
+    double diff           = 0;
+
+    for (size_t i = 0; i < NUM_VARIABLES; ++i)
+    {
+        Tape* tape = CompileTape(partials[i]);
+
+        double value = EvalTape(tape, 0.5, 0.25);
+
+        GradientCompact(compact, values, adjoints, 0.5, 0.25, gradient);
+
+        if (isfinite(value) || isfinite(gradient[i])) diff = fmax(diff, fabs(value - gradient[i]) / fmax(1, fabs(value)));
+
+        symbolic_nodes += CountNodes(partials[i]);
+
+        DestructTape(tape);
+        Destruct(partials[i]);
+        Delete(partials[i]);
+    }
+
+    printf("%-40.40s %8zu %10.2lf %10.2lf %8.2lf %9zu %11.3lf %8.2lg\n", line, compact->size,
+           (eval_seconds     > 0) ? (double)BENCH_GRADIENTS / eval_seconds     / 1e6 : 0,
+           (gradient_seconds > 0) ? (double)BENCH_GRADIENTS / gradient_seconds / 1e6 : 0,
+           (eval_seconds     > 0) ? gradient_seconds / eval_seconds : 0,
+           symbolic_nodes, symbolic_ms, diff);
+
+    free(values);
+    free(adjoints);
+    DestructCompact(compact);
+    Destruct(tree);
+    Delete(tree);
+}
+
+// The Hessian made once and evaluated at many points, against the partials of the partials as tapes
+void BenchHessian(const char* expression)
+{
+    assert(expression);
+
+    char     line[BENCH_LINE_SIZE] = "";
+    DerTree* tree = BenchParse(line, expression);
+
+    if (tree == nullptr) return;
+
+    clock_t start = clock();
+
+    Hessian* hessian = CompileHessian(tree);
+
+    double compile_ms = 1000.0 * (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    double gradient[NUM_VARIABLES]               = {};
+    double matrix[NUM_VARIABLES * NUM_VARIABLES] = {};
+    double sum                                   = 0;
+
+    start = clock();
+
+    for (size_t i = 0; i < BENCH_HESSIANS; ++i)
+    {
+        sum += EvalHessian(hessian, 0.5 + 1e-6 * (double)i, 0.25, gradient, matrix);
+    }
+
+    double hessian_seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    start = clock();
+
+    Tape*    tapes[NUM_VARIABLES * NUM_VARIABLES] = {};
+    DerTree* partials[NUM_VARIABLES]              = {};
+    GradientTrees(tree, partials);
+
+    for (size_t i = 0; i < NUM_VARIABLES; ++i)
+    {
+        DerTree* seconds[NUM_VARIABLES] = {};
+        GradientTrees(partials[i], seconds);
+
+        for (size_t j = 0; j < NUM_VARIABLES; ++j)
+        {
+            tapes[i * NUM_VARIABLES + j] = CompileTape(seconds[j]);
+
+            Destruct(seconds[j]);
+            Delete(seconds[j]);
+        }
+
+        Destruct(partials[i]);
+        Delete(partials[i]);
+    }
+
+    double symbolic_ms = 1000.0 * (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    start = clock();
+
+    for (size_t i = 0; i < BENCH_HESSIANS; ++i)
+    {
+        for (size_t j = 0; j < NUM_VARIABLES * NUM_VARIABLES; ++j)
+        {
+            sum += EvalTape(tapes[j], 0.5 + 1e-6 * (double)i, 0.25);
+        }
+    }
+
+    double tapes_seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    // The second point puts x at 0, where the powers of the sweep must not turn into 0 * inf
+    const double points[][NUM_VARIABLES] = {{0.5, 0.25}, {0, 1}};
+
+    double diff = 0;
+
+    for (size_t p = 0; p < sizeof(points) / sizeof(points[0]); ++p)
+    {
+        EvalHessian(hessian, points[p][0], points[p][1], gradient, matrix);
+
+        for (size_t j = 0; j < NUM_VARIABLES * NUM_VARIABLES; ++j)
+        {
+            double value = EvalTape(tapes[j], points[p][0], points[p][1]);
+
+            // fmax would drop a NaN of the sweep, it has to show up as a difference
+            double error = fabs(value - matrix[j]) / fmax(1, fabs(value));
+
+            if ((isfinite(value) || isfinite(matrix[j])) && !(error <= diff)) diff = error;
+        }
+    }
+
+    for (size_t j = 0; j < NUM_VARIABLES * NUM_VARIABLES; ++j) DestructTape(tapes[j]);
+
+    printf("%-40.40s %8zu %10.3lf %10.3lf %10.3lf %10.3lf %8.2lg\n", line, hessian->compact.size, compile_ms,
+           1e6 * hessian_seconds / (double)BENCH_HESSIANS, symbolic_ms,
+           1e6 * tapes_seconds / (double)BENCH_HESSIANS, diff);
+
+    DestructHessian(hessian);
+    Destruct(tree);
+    Delete(tree);
+}
+
+// Powers at a zero base against Hessians worked out by hand, the symbolic tapes are NaN there themselves
+void BenchHessianZero()
+{
+    struct { const char* expression; double matrix[NUM_VARIABLES * NUM_VARIABLES]; } checks[] =
+    {
+        {"x^1*y",   {0, 1, 1, 0}},
+        {"x^0+y",   {0, 0, 0, 0}},
+        {"x^0*y*y", {0, 0, 0, 2}},
+        {"x^2*y",   {2, 0, 0, 0}},
+    };
+
+    for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); ++i)
+    {
+        char     line[BENCH_LINE_SIZE] = "";
+        DerTree* tree = BenchParse(line, checks[i].expression);
+
+        if (tree == nullptr) continue;
+
+        Hessian* hessian = CompileHessian(tree);
+
+        double gradient[NUM_VARIABLES]               = {};
+        double matrix[NUM_VARIABLES * NUM_VARIABLES] = {};
+
+        EvalHessian(hessian, 0, 1, gradient, matrix);
+
+        double diff = 0;
+
+        for (size_t j = 0; j < NUM_VARIABLES * NUM_VARIABLES; ++j)
+        {
+            double error = fabs(matrix[j] - checks[i].matrix[j]);
+
+            if (!(error <= diff)) diff = error;
+        }
+
+        printf("%-40.40s at (0, 1) %8.2lg\n", line, diff);
+
+        DestructHessian(hessian);
+        Destruct(tree);
+        Delete(tree);
+    }
+}
+
+// DOT text of the derivative for every kind of dump, the graphs dot would have to lay out
+void BenchDump(const char* expression)
+{
+    assert(expression);
+
+    char     line[BENCH_LINE_SIZE] = "";
+    DerTree* tree = BenchParse(line, expression);
+
+    if (tree == nullptr) return;
+
+    for (size_t i = 0; i < BENCH_ORDER; ++i)
+    {
+        TakeDerivative(tree);
+    }
+
+    DumpOptions options[] = { {}, { .is_compact = true },
+                              { .max_depth = BENCH_DUMP_DEPTH, .is_compact = true },
+                              { .collapse_size = BENCH_DUMP_COLLAPSE, .is_compact = true } };
+
+    printf("%-40.40s %8zu", line, CountNodes(tree));
+
+    for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); ++i)
+    {
+        clock_t start = clock();
+
+        StrBuf dump = {};
+        DumpNodes(tree, &options[i], &dump);
+
+        double ms = 1000.0 * (double)(clock() - start) / CLOCKS_PER_SEC;
+
+        printf(" %9.1lf %7.3lf", (double)dump.size / 1024, ms);
+
+        StrBufDestruct(&dump);
+    }
+
+    printf("\n");
+
+    Destruct(tree);
+    Delete(tree);
+}
+
+// Derivative of order BENCH_ORDER step by step and at once, with the sizes of both results
+void BenchNthDerivative(const char* expression)
+{
+    assert(expression);
+
+    char     line[BENCH_LINE_SIZE] = "";
+    DerTree* steps = BenchParse(line, expression);
+    DerTree* once  = BenchParse(line, expression);
+
+    if (steps == nullptr || once == nullptr) return;
+
+    clock_t start = clock();
+
+    for (size_t i = 0; i < BENCH_ORDER; ++i)
+    {
+        TakeDerivative(steps);
+    }
+
+    double steps_ms = 1000.0 * (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    start = clock();
+
+    TakeNthDerivative(once, BENCH_ORDER);
+
+    double once_ms = 1000.0 * (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    Tape*  steps_tape  = CompileTape(steps);
+    Tape*  once_tape   = CompileTape(once);
+    double steps_value = EvalTape(steps_tape, 0.5, 0.25);
+    double once_value  = EvalTape(once_tape,  0.5, 0.25);
+    double diff        = (isfinite(steps_value) || isfinite(once_value)) ?
+                         fabs(steps_value - once_value) / fmax(1, fabs(steps_value)) : 0;
+
+    printf("%-40.40s %10zu %10zu %10.3lf %10.3lf %8.2lg\n", line, CountNodes(steps), CountNodes(once),
+           steps_ms, once_ms, diff);
+
+    DestructTape(steps_tape);
+    DestructTape(once_tape);
+    Destruct(steps);
+    Delete(steps);
+    Destruct(once);
+    Delete(once);
+}
+
+void BenchBatch(const char* expression)
+{
+    assert(expression);
+
+    char     line[BENCH_LINE_SIZE] = "";
+    DerTree* tree = BenchParse(line, expression);
+
+    if (tree == nullptr) return;
+
+    Tape* tape = CompileTape(tree);
+
+    double* xs  = (double*)calloc(BENCH_EVALS, sizeof(double));
+    double* ys  = (double*)calloc(BENCH_EVALS, sizeof(double));
+    double* out = (double*)calloc(BENCH_EVALS, sizeof(double));
+    assert(xs);
+    assert(ys);
+    assert(out);
+
+    for (size_t i = 0; i < BENCH_EVALS; ++i)
+    {
+        xs[i] = 0.5 + 1e-6 * (double)i;
+        ys[i] = 0.25;
+    }
+
+    clock_t start = clock();
+
+    for (size_t i = 0; i < BENCH_EVALS; ++i)
+    {
+        out[i] = EvalTape(tape, xs[i], ys[i]);
+    }
+
+    double tape_seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    start = clock();
+    EvalTapeBatch(tape, xs, ys, out, BENCH_EVALS);
+
+    double batch_seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    printf("%-40.40s %12.2lf %12.2lf\n", line,
+           (tape_seconds  > 0) ? (double)BENCH_EVALS / tape_seconds  / 1e6 : 0,
+           (batch_seconds > 0) ? (double)BENCH_EVALS / batch_seconds / 1e6 : 0);
+
+    free(xs);
+    free(ys);
+    free(out);
+    DestructTape(tape);
+    Destruct(tree);
+    Delete(tree);
+}
+
+double BenchNativeCompile(DerTree* tree, NativeModule** module)
+{
+    assert(tree);
+    assert(module);
+
+    struct timespec start = {};
+    struct timespec end   = {};
+
+    // clock() would not see the time spent in the compiler process
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    *module = CompileNative(tree, BENCH_ORDER);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return 1000.0 * (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+void BenchNative(const char* expression)
+{
+    assert(expression);
+
+    char     line[BENCH_LINE_SIZE] = "";
+    DerTree* tree = BenchParse(line, expression);
+
+    if (tree == nullptr) return;
+
+    NativeModule* module   = nullptr;
+    double        first_ms = BenchNativeCompile(tree, &module);
+    bool          cached   = (module != nullptr) && module->was_cached;
+
+    if (module != nullptr) DestructNativeModule(module);
+
+    double second_ms = BenchNativeCompile(tree, &module);
+
+    if (module == nullptr)
+    {
+        Destruct(tree);
+        Delete(tree);
+        return;
+    }
+
+    NativeFunc func = module->funcs[BENCH_ORDER];
+
+    clock_t start = clock();
+
+    double sum = 0;
+    for (size_t i = 0; i < BENCH_EVALS; ++i)
+    {
+        sum += func(0.5 + 1e-6 * (double)i, 0.25);
+    }
+
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    printf("%-40.40s %10.2lf%c %10.2lf %12.2lf %16.6lg\n", line, first_ms, cached ? '*' : ' ', second_ms,
+           (seconds > 0) ? (double)BENCH_EVALS / seconds / 1e6 : 0, sum / (double)BENCH_EVALS);
+
+    DestructNativeModule(module);
+    Destruct(tree);
+    Delete(tree);
+}
+
+// Derivative of order BENCH_ORDER taken and stored, then found again by the same expression parsed anew
+void BenchStore(const char* expression)
+{
+    assert(expression);
+
+    char     line[BENCH_LINE_SIZE] = "";
+    DerTree* tree  = BenchParse(line, expression);
+    DerTree* input = BenchParse(line, expression);
+
+    if (tree == nullptr || input == nullptr) return;
+
+    StoreKey key    = {};
+    DerTree* result = tree;
+
+    clock_t start     = clock();
+    bool    is_stored = LoadStoredResult(tree, STORE_DERIVATIVE, BENCH_ORDER, &key, &result, 1);
+
+    double derive_ms = 0;
+    double save_ms   = 0;
+
+    if (!is_stored)
+    {
+        start = clock();
+        TakeNthDerivative(tree, BENCH_ORDER);
+        derive_ms = 1000.0 * (double)(clock() - start) / CLOCKS_PER_SEC;
+
+        start = clock();
+        SaveStoredResult(&key, &result, 1);
+        save_ms = 1000.0 * (double)(clock() - start) / CLOCKS_PER_SEC;
+    }
+
+    DestructStoreKey(&key);
+
+    DerTree* loaded = nullptr;
+
+    start = clock();
+    bool is_loaded = LoadStoredResult(input, STORE_DERIVATIVE, BENCH_ORDER, &key, &loaded, 1);
+    double load_ms = 1000.0 * (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    FILE*  file = fopen(key.name, "rb");
+    size_t size = 0;
+
+    if (file != nullptr)
+    {
+        fseek(file, 0, SEEK_END);
+        size = (size_t)ftell(file);
+        fclose(file);
+    }
+
+    // A star marks a result stored by an earlier run, it was not derived here
+    printf("%-40.40s %10zu %9.1lf %10.3lf%c %9.3lf %9.3lf\n", line, is_loaded ? CountNodes(loaded) : 0,
+           (double)size / 1024, derive_ms, is_stored ? '*' : ' ', save_ms, is_loaded ? load_ms : 0);
+
+    DestructStoreKey(&key);
+
+    if (result != tree)
+    {
+        Destruct(result);
+        Delete(result);
+    }
+
+    if (loaded != nullptr)
+    {
+        Destruct(loaded);
+        Delete(loaded);
+    }
+
+    Destruct(tree);
+    Delete(tree);
+    Destruct(input);
+    Delete(input);
+}
+
+bool BenchParseSpan(const char* str, const char* end, size_t* num_nodes)
+{
+    assert(str);
+    assert(end);
+    assert(num_nodes);
+
+    DerTree* tree = NewTree();
+    tree->root    = GetAnswer(tree, str, end);
+
+    bool is_parsed = (tree->root != nullptr);
+    *num_nodes    += tree->arena.num_allocs;
+
+    Destruct(tree);
+    Delete(tree);
+
+    return is_parsed;
+}
+
+// Parses the valid expressions of the input over and over until BENCH_PARSE_MB megabytes went through
+void BenchParser(const char* input_name)
+{
+    assert(input_name);
+
+    InputFile input = {};
+    if (!MapInput(input_name, &input)) return;
+
+    const char* end = input.data + input.size;
+
+    size_t    num_spans = 0;
+    size_t    capacity  = 64;
+    ExprSpan* spans     = (ExprSpan*)calloc(capacity, sizeof(ExprSpan));
+    assert(spans);
+
+    size_t span_bytes = 0;
+    size_t num_nodes  = 0;
+
+    // Expressions with syntax errors report them once here and stay out of the timing
+    for (const char* str = SkipBlanks(input.data, end); str < end; )
+    {
+        const char* expr_end = FindExpressionEnd(str, end);
+
+        if (BenchParseSpan(str, expr_end, &num_nodes))
+        {
+            if (num_spans == capacity)
+            {
+                capacity *= 2;
+
+                spans = (ExprSpan*)realloc(spans, capacity * sizeof(ExprSpan));
+                assert(spans);
+            }
+
+            spans[num_spans].start = str;
+            spans[num_spans].end   = expr_end;
+            num_spans++;
+
+            span_bytes += (size_t)(expr_end - str);
+        }
+
+        str = SkipBlanks(expr_end, end);
+    }
+
+    size_t num_bytes = 0;
+    num_nodes        = 0;
+
+    clock_t start = clock();
+
+    while (span_bytes > 0 && num_bytes < BENCH_PARSE_MB * 1000000)
+    {
+        for (size_t i = 0; i < num_spans; ++i)
+        {
+            BenchParseSpan(spans[i].start, spans[i].end, &num_nodes);
+        }
+
+        num_bytes += span_bytes;
+    }
+
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    printf("%-40.40s %10.2lf %12.2lf %12.2lf\n", input_name, (double)num_bytes / 1e6,
+           (seconds > 0) ? (double)num_bytes / seconds / 1e6 : 0,
+           (seconds > 0) ? (double)num_nodes / seconds / 1e6 : 0);
+
+    free(spans);
+    UnmapInput(&input);
+}
+
+// x^2 + y^2 + x^2 + ... as one left-deep chain, every sum is the left child of the next one
+DerNode* StressSum(DerTree* tree, size_t depth)
+{
+    assert(tree);
+
+    DerNode* root = nullptr;
+
+    for (size_t i = 0; i < depth; ++i)
+    {
+        DerNode* var  = ConstructNode(tree, TYPE_VAR,   { .var = (i % 2 == 0) ? 'x' : 'y' }, tree->nil, tree->nil);
+        DerNode* two  = ConstructNode(tree, TYPE_CONST, { .number = 2 }, tree->nil, tree->nil);
+        DerNode* term = ConstructNode(tree, TYPE_BIN_OP, { .op = OP_POW }, var, two);
+
+        root = (root == nullptr) ? term : ConstructNode(tree, TYPE_BIN_OP, { .op = OP_ADD }, root, term);
+    }
+
+    return root;
+}
+
+// sin(sin(...sin(2)...)), a chain without variables that constant folding takes down to one node
+DerNode* StressUnary(DerTree* tree, size_t depth)
+{
+    assert(tree);
+
+    DerNode* root = ConstructNode(tree, TYPE_CONST, { .number = 2 }, tree->nil, tree->nil);
+
+    for (size_t i = 0; i < depth; ++i)
+    {
+        root = ConstructNode(tree, TYPE_UN_OP, { .op = OP_SIN }, tree->nil, root);
+    }
+
+    return root;
+}
+
+// sin(exp(sin(...x...))), every level has x under it, so nothing folds and every walk goes all the way down
+DerNode* StressChain(DerTree* tree, size_t depth)
+{
+    assert(tree);
+
+    DerNode* root = ConstructNode(tree, TYPE_VAR, { .var = 'x' }, tree->nil, tree->nil);
+
+    for (size_t i = 0; i < depth; ++i)
+    {
+        root = ConstructNode(tree, TYPE_UN_OP, { .op = (i % 2 == 0) ? OP_EXP : OP_SIN }, tree->nil, root);
+    }
+
+    return root;
+}
+
+void StressLine(const char* walk, DerTree* tree, clock_t start)
+{
+    assert(walk);
+    assert(tree);
+
+    printf("%-28s %12zu %10.2lf\n", walk, tree->arena.num_live, 1000.0 * (double)(clock() - start) / CLOCKS_PER_SEC);
+}
+
+// Every walk over trees a million nodes deep, each would overflow the call stack if it recursed.
+// The chain has x under every level, so the derivatives, Taylor, the tape and CSE see all of it
+void BenchStress(size_t depth)
+{
+    FILE* null_file = fopen("/dev/null", "w");
+    assert(null_file);
+
+    printf("%-28s %12s %10s\n", "walk", "live nodes", "ms");
+
+    DerTree* tree = NewTree();
+
+    clock_t start = clock();
+    tree->root    = StressSum(tree, depth);
+    StressLine("sum : build", tree, start);
+
+    start = clock();
+    tree->root->parent = nullptr;
+    SetNils(tree, tree->root);
+    StressLine("sum : SetNils", tree, start);
+
+    start = clock();
+    SetParents(tree);
+    StressLine("sum : SetParents", tree, start);
+
+    start = clock();
+    DerNode* copy = CopySubTree(tree, tree->root);
+    StressLine("sum : CopySubTree", tree, start);
+
+    start = clock();
+    DestructNodes(tree, copy);
+    StressLine("sum : DestructNodes", tree, start);
+
+    start = clock();
+    DerNode* derivative = Derivative(tree, tree->root);
+    StressLine("sum : Derivative", tree, start);
+
+    DestructNodes(tree, derivative);
+
+    start = clock();
+    PrintFormula(tree, null_file);
+    StressLine("sum : PrintFormula", tree, start);
+
+    start = clock();
+    DumpOptions dump_options = {};
+    StrBuf      dump         = {};
+    DumpNodes(tree, &dump_options, &dump);
+    fwrite(dump.data, sizeof(char), dump.size, null_file);
+    StrBufDestruct(&dump);
+    StressLine("sum : DumpNodes", tree, start);
+
+    start = clock();
+    DerTree* copy_tree   = CopyTree(tree);
+    DerTree* taylor_tree = TaylorTree(copy_tree, STRESS_ORDER);
+    StressLine("sum : Taylor", tree, start);
+
+    Destruct(copy_tree);
+    Delete(copy_tree);
+    Destruct(taylor_tree);
+    Delete(taylor_tree);
+
+    start = clock();
+    TakeDerivative(tree);
+    StressLine("sum : TakeDerivative", tree, start);
+
+    PrintFormula(tree, stdout);
+    printf("\n");
+
+    Destruct(tree);
+    Delete(tree);
+
+    tree = NewTree();
+
+    start = clock();
+    tree->root = StressUnary(tree, depth);
+    SetParents(tree);
+    StressLine("sin : build", tree, start);
+
+    start = clock();
+    bool has_var = IsThereVariable(tree, tree->root);
+    StressLine(has_var ? "sin : IsThereVariable (yes)" : "sin : IsThereVariable (no)", tree, start);
+
+    start = clock();
+    PrintFormula(tree, null_file);
+    StressLine("sin : PrintFormula", tree, start);
+
+    start = clock();
+    SimplifyByPasses(tree);
+    StressLine("sin : SimplifyByPasses", tree, start);
+
+    Destruct(tree);
+    Delete(tree);
+
+    // The derivative of a chain of functions copies what is under every level, only a DAG keeps it linear
+    tree = NewTree();
+
+    start = clock();
+    tree->root = StressChain(tree, depth);
+    SetParents(tree);
+    StressLine("chain : build", tree, start);
+
+    start = clock();
+    copy_tree = CopyTree(tree);
+    Canonicalize(copy_tree);
+    StressLine("chain : Canonicalize", tree, start);
+
+    Destruct(copy_tree);
+    Delete(copy_tree);
+
+    start = clock();
+    Tape* tape = CompileTape(tree);
+    EvalTape(tape, 0.5, 0);
+    StressLine("chain : CompileTape", tree, start);
+
+    DestructTape(tape);
+
+    start = clock();
+    taylor_tree = TaylorADTree(tree, STRESS_ORDER);
+    StressLine("chain : TaylorAD", tree, start);
+
+    Destruct(taylor_tree);
+    Delete(taylor_tree);
+
+    start = clock();
+    PrintSharedFormula(tree, null_file);
+    StressLine("chain : CSE", tree, start);
+
+    start = clock();
+    MakeDag(tree);
+    copy_tree = CopyTree(tree);
+    TakeDerivative(copy_tree);
+    StressLine("chain : dag TakeDerivative", tree, start);
+
+    Destruct(copy_tree);
+    Delete(copy_tree);
+
+    start = clock();
+    taylor_tree = TaylorTree(tree, STRESS_ORDER);
+    StressLine("chain : dag Taylor", tree, start);
+
+    Destruct(taylor_tree);
+    Delete(taylor_tree);
+
+    Destruct(tree);
+    Delete(tree);
+
+    fclose(null_file);
+}
+
+int main(const int argc, char* argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "--stress") == 0)
+    {
+        size_t depth = (argc > 2) ? strtoul(argv[2], nullptr, 10) : STRESS_DEPTH;
+
+        BenchStress(depth);
+        return 0;
+    }
+
+    const char* input_name = (argc > 1) ? argv[1] : BENCH_INPUT;
+
+    printf("%-40s %10s %12s %12s\n", "input", "MB parsed", "MB/s", "Mnodes/s");
+
+    BenchParser(input_name);
+
+    FILE* input = fopen(input_name, "r");
+    assert(input);
+
+    printf("\n");
+
+    printf("%-40s %10s %10s %14s %12s %10s\n", "expression", "nodes", "reused",
+           "malloc before", "malloc after", "ms");
+
+    char line[BENCH_LINE_SIZE] = "";
+
+    while (fgets(line, BENCH_LINE_SIZE, input))
+    {
+        if (IsBlankLine(line)) continue;
+
+        BenchAllocations(line);
+    }
+
+    printf("\n%-40s tree/dag nodes per derivative order\n", "expression");
+
+    rewind(input);
+    while (fgets(line, BENCH_LINE_SIZE, input))
+    {
+        if (IsBlankLine(line)) continue;
+
+        BenchDagGrowth(line);
+    }
+
+    printf("\n%-40s %5s %7s %11s %11s %10s %10s\n", "expression", "order", "passes", "pass visits",
+           "list visits", "passes ms", "list ms");
+
+    rewind(input);
+    while (fgets(line, BENCH_LINE_SIZE, input))
+    {
+        if (IsBlankLine(line)) continue;
+
+        BenchSimplify(line);
+    }
+
+    printf("\n%-40s plain/shared tex bytes per derivative order\n", "expression");
+
+    rewind(input);
+    while (fgets(line, BENCH_LINE_SIZE, input))
+    {
+        if (IsBlankLine(line)) continue;
+
+        BenchSharedOutput(line);
+    }
+
+    printf("\n%-40s %10s %12s %16s\n", "expression", "tape size", "Mevals/s", "mean value");
+
+    rewind(input);
+    while (fgets(line, BENCH_LINE_SIZE, input))
+    {
+        if (IsBlankLine(line)) continue;
+
+        BenchTape(line);
+    }
+
+    printf("\n%-40s %8s %10s %10s %9s %9s %10s %10s %8s\n", "expression", "nodes", "node bytes", "compact",
+           "print ms", "relaid ms", "tape Meval", "cmpct Meval", "diff");
+
+    rewind(input);
+    while (fgets(line, BENCH_LINE_SIZE, input))
+    {
+        if (IsBlankLine(line)) continue;
+
+        BenchCompact(line);
+    }
+
+    // The ratio is the time of a value with both partials over the time of the value alone
+    printf("\n%-40s %8s %10s %10s %8s %9s %11s %8s\n", "expression", "nodes", "eval Meval", "grad Meval",
+           "ratio", "sym nodes", "sym ms", "diff");
+
+    rewind(input);
+    while (fgets(line, BENCH_LINE_SIZE, input))
+    {
+        if (IsBlankLine(line)) continue;
+
+        BenchGradient(line);
+    }
+
+    // Made once and evaluated at every point, us are per point for the whole matrix
+    printf("\n%-40s %8s %10s %10s %10s %10s %8s\n", "expression", "nodes", "build ms", "hess us",
+           "sym ms", "tapes us", "diff");
+
+    rewind(input);
+    while (fgets(line, BENCH_LINE_SIZE, input))
+    {
+        if (IsBlankLine(line)) continue;
+
+        BenchHessian(line);
+    }
+
+    BenchHessianZero();
+
+    // KB and ms of the DOT text: full records, compact labels, depth limit and collapsed subtrees
+    printf("\n%-40s %8s %9s %7s %9s %7s %9s %7s %9s %7s\n", "expression", "nodes", "full KB", "ms",
+           "cmpct KB", "ms", "depth KB", "ms", "clps KB", "ms");
+
+    rewind(input);
+    while (fgets(line, BENCH_LINE_SIZE, input))
+    {
+        if (IsBlankLine(line)) continue;
+
+        BenchDump(line);
+    }
+
+    printf("\n%-40s %10s %10s %10s %10s %8s\n", "expression", "step nodes", "nth nodes", "step ms", "nth ms", "diff");
+
+    rewind(input);
+    while (fgets(line, BENCH_LINE_SIZE, input))
+    {
+        if (IsBlankLine(line)) continue;
+
+        BenchNthDerivative(line);
+    }
+
+    printf("\n%-40s %12s %12s  (%s kernel)\n", "expression", "tape Mevals", "batch Mevals",
+           GetBatchKernelName());
+
+    rewind(input);
+    while (fgets(line, BENCH_LINE_SIZE, input))
+    {
+        if (IsBlankLine(line)) continue;
+
+        BenchBatch(line);
+    }
+
+    // A star marks a first build that was already in the cache from an earlier run
+    printf("\n%-40s %11s %10s %12s %16s\n", "expression", "build ms", "load ms", "Mevals/s", "mean value");
+
+    rewind(input);
+    while (fgets(line, BENCH_LINE_SIZE, input))
+    {
+        if (IsBlankLine(line)) continue;
+
+        BenchNative(line);
+    }
+
+    printf("\n%-40s %10s %9s %11s %9s %9s\n", "expression", "nodes", "file KB", "derive ms", "save ms", "load ms");
+
+    rewind(input);
+    while (fgets(line, BENCH_LINE_SIZE, input))
+    {
+        if (IsBlankLine(line)) continue;
+
+        BenchStore(line);
+    }
+
+    fclose(input);
+
+    return 0;
+}
@@ -0,0 +1,398 @@
+#include "derivative.h"
+#include "expression_loader.h"
+#include "batch_mode.h"
+
+
+const size_t SUITE_REPS    = 21;
+const size_t SUITE_ORDER   = 4;
+const char*  SUITE_VERSION = "1";
+
+const char* SUITE_USAGE = "usage : bench_suite [--reps N] [--order N] [--csv file] [--json file] input...\n";
+
+enum SuitePhase
+{
+    SUITE_PARSE    = 0,
+    SUITE_DERIVE   = 1,
+    SUITE_SIMPLIFY = 2,
+    SUITE_TAYLOR   = 3,
+
+    NUM_SUITE_PHASES = 4
+};
+
+static const char* SUITE_PHASE_NAMES[] = {"parse", "derive", "simplify", "taylor"};
+
+struct SuiteOptions
+{
+    size_t reps  = SUITE_REPS;
+    size_t order = SUITE_ORDER;
+
+    const char* csv  = nullptr;
+    const char* json = nullptr;
+
+    char** inputs     = nullptr;
+    size_t num_inputs = 0;
+};
+
+// One timed thing: parse has order 0, the others one row per order, samples hold a time per repetition
+struct SuiteRow
+{
+    SuitePhase phase = SUITE_PARSE;
+    size_t     order = 0;
+    size_t     nodes = 0;
+
+    double* samples = nullptr;
+};
+
+struct SuiteOutput
+{
+    FILE* csv  = nullptr;
+    FILE* json = nullptr;
+
+    size_t num_rows = 0;
+};
+
+/////////////////////////////////
+//Benchmark suite
+/////////////////////////////////
+bool   ParseSuiteOptions(const int argc, char* argv[], SuiteOptions* options);
+bool   ParseSuiteCount  (const char* str, size_t* count);
+size_t RunSuiteInput    (const SuiteOptions* options, const char* name, SuiteOutput* output);
+bool   IsValidExpression(const ExprSpan* expr);
+void   RunSuiteExpr     (const SuiteOptions* options, const ExprSpan* expr, SuiteRow* rows, size_t rep);
+double SplitSimplifyTime(DerTree* tree, size_t first_event, double* simplify_ms);
+void   WriteSuiteRow    (SuiteOutput* output, const char* input, size_t expr_id, const ExprSpan* expr,
+                         size_t reps, SuiteRow* row);
+double SamplePercentile (const double* sorted, size_t size, double percentile);
+int    CompareSamples   (const void* first, const void* second);
+void   PrintJsonText    (FILE* file, const ExprSpan* expr);
+
+
+int main(const int argc, char* argv[])
+{
+    SuiteOptions options = {};
+
+    if (!ParseSuiteOptions(argc, argv, &options))
+    {
+        fprintf(stderr, "%s", SUITE_USAGE);
+        return 1;
+    }
+
+    SuiteOutput output = {};
+
+    output.csv  = (options.csv  != nullptr) ? fopen(options.csv,  "w") : stdout;
+    output.json = (options.json != nullptr) ? fopen(options.json, "w") : nullptr;
+
+    if (output.csv == nullptr || (options.json != nullptr && output.json == nullptr))
+    {
+        fprintf(stderr, "Bench error : can't open the output\n");
+        return 1;
+    }
+
+    // TakeDerivative reports its own Simplify calls, that is how derive and simplify come apart
+    EnableStats();
+
+    fprintf(output.csv, "input,expression,phase,order,nodes,reps,min_ms,p50_ms,p90_ms,max_ms,mean_ms\n");
+
+    if (output.json != nullptr)
+    {
+        fprintf(output.json, "{\n  \"version\": %s,\n  \"reps\": %zu,\n  \"order\": %zu,\n  \"results\": [",
+                SUITE_VERSION, options.reps, options.order);
+    }
+
+    for (size_t i = 0; i < options.num_inputs; ++i)
+    {
+        double start = StatsClock();
+        size_t count = RunSuiteInput(&options, options.inputs[i], &output);
+
+        fprintf(stderr, "%s : %zu expressions, %.2lf ms\n", options.inputs[i], count, StatsClock() - start);
+    }
+
+    if (output.json != nullptr)
+    {
+        fprintf(output.json, "\n  ]\n}\n");
+        fclose(output.json);
+    }
+
+    if (output.csv != stdout) fclose(output.csv);
+
+    return 0;
+}
+
+bool ParseSuiteOptions(const int argc, char* argv[], SuiteOptions* options)
+{
+    assert(argv);
+    assert(options);
+
+    options->inputs = (char**)calloc((size_t)argc, sizeof(char*));
+    assert(options->inputs);
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+
+        if (strcmp(arg, "--reps") == 0 || strcmp(arg, "--order") == 0)
+        {
+            size_t count = 0;
+
+            if (i + 1 >= argc || !ParseSuiteCount(argv[++i], &count) || count == 0) return false;
+
+            if (strcmp(arg, "--reps") == 0) options->reps  = count;
+            else                            options->order = count;
+        }
+        else if (strcmp(arg, "--csv") == 0 || strcmp(arg, "--json") == 0)
+        {
+            if (i + 1 >= argc) return false;
+
+            if (strcmp(arg, "--csv") == 0) options->csv  = argv[++i];
+            else                           options->json = argv[++i];
+        }
+        else if (arg[0] == '-' && arg[1] == '-')
+        {
+            return false;
+        }
+        else
+        {
+            options->inputs[options->num_inputs++] = argv[i];
+        }
+    }
+
+    return options->num_inputs > 0;
+}
+
+bool ParseSuiteCount(const char* str, size_t* count)
+{
+    assert(str);
+    assert(count);
+
+    char* end = nullptr;
+    *count    = strtoul(str, &end, 10);
+
+    return end != str && *end == '\0';
+}
+
+// Every expression is measured reps times in a row, rows are written as soon as it is done
+size_t RunSuiteInput(const SuiteOptions* options, const char* name, SuiteOutput* output)
+{
+    assert(options);
+    assert(name);
+    assert(output);
+
+    InputFile input = {};
+    if (!MapInput(name, &input))
+    {
+        fprintf(stderr, "Bench error : can't read %s\n", name);
+        return 0;
+    }
+
+    size_t    num_exprs = 0;
+    ExprSpan* exprs     = SplitExpressions(&input, &num_exprs);
+
+    size_t    num_rows = 1 + (NUM_SUITE_PHASES - 1) * options->order;
+    SuiteRow* rows     = (SuiteRow*)calloc(num_rows, sizeof(SuiteRow));
+    assert(rows);
+
+    // Parse, then derive, simplify and taylor for order 1, then for order 2 and so on
+    for (size_t i = 0; i < num_rows; ++i)
+    {
+        rows[i].phase = (i == 0) ? SUITE_PARSE : (SuitePhase)(1 + (i - 1) % (NUM_SUITE_PHASES - 1));
+        rows[i].order = (i == 0) ? 0           : 1 + (i - 1) / (NUM_SUITE_PHASES - 1);
+
+        rows[i].samples = (double*)calloc(options->reps, sizeof(double));
+        assert(rows[i].samples);
+    }
+
+    size_t num_done = 0;
+
+    // Expression numbers count the invalid ones too, so they stay the same as the file is fixed
+    for (size_t i = 0; i < num_exprs; ++i)
+    {
+        if (!IsValidExpression(&exprs[i])) continue;
+
+        for (size_t rep = 0; rep < options->reps; ++rep)
+        {
+            RunSuiteExpr(options, &exprs[i], rows, rep);
+        }
+
+        for (size_t j = 0; j < num_rows; ++j)
+        {
+            WriteSuiteRow(output, name, i + 1, &exprs[i], options->reps, &rows[j]);
+        }
+
+        num_done++;
+    }
+
+    for (size_t i = 0; i < num_rows; ++i)
+    {
+        free(rows[i].samples);
+    }
+
+    free(rows);
+    free(exprs);
+    UnmapInput(&input);
+
+    return num_done;
+}
+
+// Syntax errors are printed once here and the expression is left out
+bool IsValidExpression(const ExprSpan* expr)
+{
+    assert(expr);
+
+    DerTree* tree = NewTree();
+    tree->root    = GetAnswer(tree, expr->start, expr->end);
+
+    bool is_valid = (tree->root != nullptr);
+
+    Destruct(tree);
+    Delete(tree);
+
+    return is_valid;
+}
+
+void RunSuiteExpr(const SuiteOptions* options, const ExprSpan* expr, SuiteRow* rows, size_t rep)
+{
+    assert(options);
+    assert(expr);
+    assert(rows);
+
+    double start = StatsClock();
+
+    DerTree* tree = NewTree();
+    tree->root    = GetAnswer(tree, expr->start, expr->end);
+
+    SetNils(tree, tree->root);
+    SetParents(tree);
+
+    rows[0].samples[rep] = StatsClock() - start;
+    rows[0].nodes        = CountNodes(tree);
+
+    for (size_t order = 1; order <= options->order; ++order)
+    {
+        SuiteRow* row = &rows[1 + (NUM_SUITE_PHASES - 1) * (order - 1)];
+
+        start = StatsClock();
+        DerTree* taylor_tree = TaylorADTree(tree, order);
+
+        row[SUITE_TAYLOR - 1].samples[rep] = StatsClock() - start;
+        row[SUITE_TAYLOR - 1].nodes        = CountNodes(taylor_tree);
+
+        Destruct(taylor_tree);
+        Delete(taylor_tree);
+    }
+
+    for (size_t order = 1; order <= options->order; ++order)
+    {
+        SuiteRow* row = &rows[1 + (NUM_SUITE_PHASES - 1) * (order - 1)];
+
+        size_t first_event = tree->stats->size;
+        TakeDerivative(tree);
+
+        double simplify_ms = 0;
+        double derive_ms   = SplitSimplifyTime(tree, first_event, &simplify_ms);
+
+        row[SUITE_DERIVE   - 1].samples[rep] = derive_ms;
+        row[SUITE_SIMPLIFY - 1].samples[rep] = simplify_ms;
+
+        size_t nodes = CountNodes(tree);
+        row[SUITE_DERIVE   - 1].nodes = nodes;
+        row[SUITE_SIMPLIFY - 1].nodes = nodes;
+    }
+
+    Destruct(tree);
+    Delete(tree);
+}
+
+// The derivative event of one TakeDerivative includes the simplifications recorded before it
+double SplitSimplifyTime(DerTree* tree, size_t first_event, double* simplify_ms)
+{
+    assert(tree);
+    assert(tree->stats);
+    assert(simplify_ms);
+
+    double derivative_ms = 0;
+    *simplify_ms         = 0;
+
+    for (size_t i = first_event; i < tree->stats->size; ++i)
+    {
+        PhaseEvent* event = &tree->stats->events[i];
+
+        if (event->phase == PHASE_SIMPLIFY)   *simplify_ms  += event->ms;
+        if (event->phase == PHASE_DERIVATIVE) derivative_ms += event->ms;
+    }
+
+    return derivative_ms - *simplify_ms;
+}
+
+void WriteSuiteRow(SuiteOutput* output, const char* input, size_t expr_id, const ExprSpan* expr,
+                   size_t reps, SuiteRow* row)
+{
+    assert(output);
+    assert(input);
+    assert(expr);
+    assert(row);
+
+    double sum = 0;
+    for (size_t i = 0; i < reps; ++i) sum += row->samples[i];
+
+    qsort(row->samples, reps, sizeof(double), CompareSamples);
+
+    double min  = row->samples[0];
+    double p50  = SamplePercentile(row->samples, reps, 50);
+    double p90  = SamplePercentile(row->samples, reps, 90);
+    double max  = row->samples[reps - 1];
+    double mean = sum / (double)reps;
+
+    const char* phase = SUITE_PHASE_NAMES[row->phase];
+
+    fprintf(output->csv, "%s,%zu,%s,%zu,%zu,%zu,%.4lf,%.4lf,%.4lf,%.4lf,%.4lf\n",
+            input, expr_id, phase, row->order, row->nodes, reps, min, p50, p90, max, mean);
+
+    if (output->json != nullptr)
+    {
+        fprintf(output->json, "%s\n    {\"input\": \"%s\", \"expression\": %zu, \"text\": \"",
+                (output->num_rows == 0) ? "" : ",", input, expr_id);
+        PrintJsonText(output->json, expr);
+        fprintf(output->json, "\", \"phase\": \"%s\", \"order\": %zu, \"nodes\": %zu, "
+                              "\"min_ms\": %.4lf, \"p50_ms\": %.4lf, \"p90_ms\": %.4lf, \"max_ms\": %.4lf, \"mean_ms\": %.4lf}",
+                phase, row->order, row->nodes, min, p50, p90, max, mean);
+    }
+
+    output->num_rows++;
+}
+
+// Nearest rank, so every reported time is one that was measured
+double SamplePercentile(const double* sorted, size_t size, double percentile)
+{
+    assert(sorted);
+    assert(size > 0);
+
+    size_t rank = (size_t)ceil(percentile / 100 * (double)size);
+    if (rank == 0) rank = 1;
+
+    return sorted[rank - 1];
+}
+
+int CompareSamples(const void* first, const void* second)
+{
+    assert(first);
+    assert(second);
+
+    double first_ms  = *(const double*)first;
+    double second_ms = *(const double*)second;
+
+    return (first_ms > second_ms) - (first_ms < second_ms);
+}
+
+// Line breaks of a multi-line expression become spaces
+void PrintJsonText(FILE* file, const ExprSpan* expr)
+{
+    assert(file);
+    assert(expr);
+
+    for (const char* str = expr->start; str < expr->end; ++str)
+    {
+        if      (*str == '"' || *str == '\\') fprintf(file, "\\%c", *str);
+        else if (isspace(*str))               fputc(' ', file);
+        else                                  fputc(*str, file);
+    }
+}
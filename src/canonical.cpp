@@ -0,0 +1,740 @@
+#include "derivative.h"
+
+
+const size_t CANONICAL_SHARED_SIZE = 32;
+
+// A term of a sum is coefficient * node, a factor of a product is node ^ exponent
+struct CanonicalPart
+{
+    DerNode* node   = nullptr;
+    double   number = 0;
+};
+
+struct CanonicalParts
+{
+    CanonicalPart* parts = nullptr;
+
+    size_t size     = 0;
+    size_t capacity = 0;
+};
+
+/////////////////////////////////
+//Canonical form
+/////////////////////////////////
+void     Canonicalize        (DerTree* tree);
+DerNode* CanonicalNode       (DerTree* tree, DerNode* node);
+void     PushOperands        (DerTree* tree, WalkStack* stack, DerNode* node);
+DerNode* CanonicalOperation  (DerTree* tree, DerNode* node);
+DerNode* CanonicalOperand    (DerTree* tree, DerNode* node);
+void     CountParents        (DerTree* tree, DerNode* node, NodeMap* uses);
+bool     IsSharedChain       (DerTree* tree, DerNode* node);
+bool     IsSumNode           (DerNode* node);
+bool     IsProductNode       (DerNode* node);
+DerNode* CanonicalSum        (DerTree* tree, DerNode* node);
+DerNode* CanonicalProduct    (DerTree* tree, DerNode* node);
+DerNode* CanonicalFactors    (DerTree* tree, DerNode* node, double* coefficient);
+DerNode* ScaleFactors        (DerTree* tree, DerNode* factors, double coefficient);
+void     CollectTerms        (DerTree* tree, DerNode* node, double sign, CanonicalParts* terms, double* constant);
+void     CollectFactors      (DerTree* tree, DerNode* node, CanonicalParts* factors, double* coefficient);
+void     AddFactors          (DerTree* tree, DerNode* factor, int sign, CanonicalParts* factors, double* coefficient);
+void     ScaleCoefficient    (double* coefficient, double number, int sign);
+void     MergeParts          (DerTree* tree, CanonicalParts* parts);
+void     AddPart             (CanonicalParts* parts, DerNode* node, double number);
+int      ComparePartNodes    (const void* first, const void* second);
+int      CompareSubTrees     (DerNode* first, DerNode* second);
+int      CompareNodes        (DerNode* first, DerNode* second);
+int      NodeTypeRank        (NodeType type);
+int      CompareNumbers      (double first, double second);
+
+
+#define ADD(left, right) ConstructNode(tree, TYPE_BIN_OP, { .op = OP_ADD  }, left, right)
+#define SUB(left, right) ConstructNode(tree, TYPE_BIN_OP, { .op = OP_SUB  }, left, right)
+#define MUL(left, right) ConstructNode(tree, TYPE_BIN_OP, { .op = OP_MUL  }, left, right)
+#define DIV(left, right) ConstructNode(tree, TYPE_BIN_OP, { .op = OP_DIV  }, left, right)
+#define POW(left, right) ConstructNode(tree, TYPE_BIN_OP, { .op = OP_POW  }, left, right)
+#define CONST(NUM)       ConstructNode(tree, TYPE_CONST,  { .number = NUM }, tree->nil, tree->nil)
+
+// Sums and products become sorted chains with one constant, like terms and like factors are collected
+void Canonicalize(DerTree* tree)
+{
+    assert(tree);
+
+    if (tree->root == tree->nil) return;
+
+    NodeMap memo = {};
+    NodeMap uses = {};
+
+    if (tree->is_dag)
+    {
+        CountParents(tree, tree->root, &uses);
+
+        tree->canonical_memo = &memo;
+        tree->canonical_uses = &uses;
+    }
+
+    tree->root = CanonicalNode(tree, tree->root);
+    SetParents(tree);
+
+    tree->canonical_memo = nullptr;
+    tree->canonical_uses = nullptr;
+    NodeMapDestruct(&memo);
+    NodeMapDestruct(&uses);
+
+    // Collected terms may leave 0 / x or x ^ 0 behind
+    Simplify(tree);
+}
+
+// Works in place, the operations and constants of a flattened chain are destructed.
+// Operands before their operation on an explicit stack, a slot of a frame is where the canonical operand goes.
+// A DAG keeps its nodes, a shared one is made canonical once and the result goes to canonical_memo
+DerNode* CanonicalNode(DerTree* tree, DerNode* node)
+{
+    assert(tree);
+    assert(node);
+
+    if (node == tree->nil) return tree->nil;
+
+    DerNode*  result = node;
+    WalkStack stack;
+    InitWalkStack(&stack);
+
+    PushFrame(&stack, node, nullptr, &result, 0);
+
+    while (stack.size > 0)
+    {
+        WalkFrame frame = stack.frames[stack.size - 1];
+
+        if (frame.state == 0)
+        {
+            if (tree->is_dag && NodeMapGet(tree->canonical_memo, frame.node) != nullptr)
+            {
+                stack.size--;
+                continue;
+            }
+
+            stack.frames[stack.size - 1].state = 1;
+            PushOperands(tree, &stack, frame.node);
+            continue;
+        }
+
+        stack.size--;
+
+        DerNode* canonical = CanonicalOperation(tree, frame.node);
+
+        if (tree->is_dag) NodeMapSet(tree->canonical_memo, frame.node, canonical);
+        else              *frame.slot = canonical;
+    }
+
+    DestructWalkStack(&stack);
+
+    return tree->is_dag ? CanonicalOperand(tree, node) : result;
+}
+
+// A sum or a product is flattened at its top, so its operands are what CollectTerms and CollectFactors
+// reach through the chain: terms, factors of product terms and factors, divisors among them. Other nodes have their children
+void PushOperands(DerTree* tree, WalkStack* stack, DerNode* node)
+{
+    assert(tree);
+    assert(stack);
+    assert(node);
+
+    if (!IsSumNode(node) && !IsProductNode(node))
+    {
+        if (node->right != tree->nil) PushFrame(stack, node->right, nullptr, &node->right, 0);
+        if (node->left  != tree->nil) PushFrame(stack, node->left,  nullptr, &node->left,  0);
+        return;
+    }
+
+    WalkStack chain;
+    InitWalkStack(&chain);
+
+    PushFrame(&chain, node, nullptr, nullptr, IsSumNode(node));
+
+    while (chain.size > 0)
+    {
+        WalkFrame link = chain.frames[--chain.size];
+
+        DerNode** slots[] = {&link.node->right, &link.node->left};
+
+        for (size_t i = 0; i < 2; ++i)
+        {
+            DerNode* operand = *slots[i];
+
+            // A sum inside a product is an operand of its own
+            if      (IsSharedChain(tree, operand))     PushFrame(stack,  operand, nullptr, slots[i], 0);
+            else if (link.state && IsSumNode(operand)) PushFrame(&chain, operand, nullptr, nullptr, 1);
+            else if (IsProductNode(operand))           PushFrame(&chain, operand, nullptr, nullptr, 0);
+            else if (operand->type != TYPE_CONST)      PushFrame(stack,  operand, nullptr, slots[i], 0);
+        }
+    }
+
+    DestructWalkStack(&chain);
+}
+
+// The operands are canonical already
+DerNode* CanonicalOperation(DerTree* tree, DerNode* node)
+{
+    assert(tree);
+    assert(node);
+
+    if (IsSumNode(node))     return CanonicalSum(tree, node);
+    if (IsProductNode(node)) return CanonicalProduct(tree, node);
+
+    if (!tree->is_dag)
+    {
+        InvalidateNode(tree, node);
+        return node;
+    }
+
+    DerNode* left  = CanonicalOperand(tree, node->left);
+    DerNode* right = CanonicalOperand(tree, node->right);
+
+    if (left == node->left && right == node->right) return node;
+
+    return ConstructNode(tree, node->type, node->value, left, right);
+}
+
+// The canonical form of a DAG node that was made canonical already, any other node as it is.
+// Chains of a DAG are flattened through their nodes, so the operands are looked up as they are reached
+DerNode* CanonicalOperand(DerTree* tree, DerNode* node)
+{
+    assert(tree);
+    assert(node);
+
+    if (!tree->is_dag) return node;
+
+    DerNode* canonical = NodeMapGet(tree->canonical_memo, node);
+
+    return (canonical != nullptr) ? canonical : node;
+}
+
+// The map keeps the number of parents + 1, so a reached node is never null there
+void CountParents(DerTree* tree, DerNode* node, NodeMap* uses)
+{
+    assert(tree);
+    assert(node);
+    assert(uses);
+
+    WalkStack stack;
+    InitWalkStack(&stack);
+
+    NodeMapSet(uses, node, (DerNode*)1);
+    PushFrame(&stack, node, nullptr, nullptr, 0);
+
+    while (stack.size > 0)
+    {
+        node = stack.frames[--stack.size].node;
+
+        DerNode* children[] = {node->left, node->right};
+
+        for (size_t i = 0; i < 2; ++i)
+        {
+            if (children[i] == tree->nil) continue;
+
+            size_t count = (size_t)NodeMapGet(uses, children[i]);
+
+            if (count == 0) PushFrame(&stack, children[i], nullptr, nullptr, 0);
+
+            NodeMapSet(uses, children[i], (DerNode*)((count == 0) ? 2 : count + 1));
+        }
+    }
+
+    DestructWalkStack(&stack);
+}
+
+// A big sum or product of a DAG with several parents is an operand of its own, merging it
+// into the chains of all of them would make a copy of it for each. A small one is merged, so 7 / (7 x) cancels
+bool IsSharedChain(DerTree* tree, DerNode* node)
+{
+    assert(tree);
+    assert(node);
+
+    if (!tree->is_dag || (!IsSumNode(node) && !IsProductNode(node))) return false;
+
+    return node->size > CANONICAL_SHARED_SIZE && (size_t)NodeMapGet(tree->canonical_uses, node) > 2;
+}
+
+bool IsSumNode(DerNode* node)
+{
+    assert(node);
+
+    return node->type == TYPE_BIN_OP && (node->value.op == OP_ADD || node->value.op == OP_SUB);
+}
+
+// a / b is a * b ^ -1, so a quotient is a product too
+bool IsProductNode(DerNode* node)
+{
+    assert(node);
+
+    return node->type == TYPE_BIN_OP && (node->value.op == OP_MUL || node->value.op == OP_DIV);
+}
+
+// Terms come sorted with the constant last, a negative coefficient turns its + into -
+DerNode* CanonicalSum(DerTree* tree, DerNode* node)
+{
+    assert(tree);
+    assert(node);
+
+    CanonicalParts terms    = {};
+    double         constant = 0;
+
+    CollectTerms(tree, node, 1, &terms, &constant);
+    MergeParts(tree, &terms);
+
+    DerNode* result = nullptr;
+
+    for (size_t i = 0; i < terms.size; ++i)
+    {
+        DerNode* term        = terms.parts[i].node;
+        double   coefficient = terms.parts[i].number;
+
+        if (coefficient == ADD_NEUT)
+        {
+            DestructNodes(tree, term);
+            continue;
+        }
+
+        if (result == nullptr)
+        {
+            result = (coefficient == 1) ? term : ScaleFactors(tree, term, coefficient);
+            continue;
+        }
+
+        double abs_coefficient = fabs(coefficient);
+        if (abs_coefficient != 1) term = ScaleFactors(tree, term, abs_coefficient);
+
+        result = (coefficient < 0) ? SUB(result, term) : ADD(result, term);
+    }
+
+    free(terms.parts);
+
+    if (result == nullptr) return CONST(constant);
+
+    if      (constant > 0) result = ADD(result, CONST( constant));
+    else if (constant < 0) result = SUB(result, CONST(-constant));
+
+    return result;
+}
+
+DerNode* CanonicalProduct(DerTree* tree, DerNode* node)
+{
+    assert(tree);
+    assert(node);
+
+    double   coefficient = 1;
+    DerNode* factors     = CanonicalFactors(tree, node, &coefficient);
+
+    if (factors == nullptr) return CONST(coefficient);
+
+    if (coefficient == MUL_NULL)
+    {
+        DestructNodes(tree, factors);
+        return CONST(0);
+    }
+
+    return (coefficient == 1) ? factors : ScaleFactors(tree, factors, coefficient);
+}
+
+// Returns the factors without the constant as a left-deep chain, nullptr when there are none.
+// Factors with a negative exponent go to a divisor chain, then the result is numerator / divisor with 1 for no numerator
+DerNode* CanonicalFactors(DerTree* tree, DerNode* node, double* coefficient)
+{
+    assert(tree);
+    assert(node);
+    assert(coefficient);
+
+    CanonicalParts factors = {};
+
+    CollectFactors(tree, node, &factors, coefficient);
+    MergeParts(tree, &factors);
+
+    DerNode* numerator = nullptr;
+    DerNode* divisor   = nullptr;
+
+    for (size_t i = 0; i < factors.size; ++i)
+    {
+        DerNode* factor   = factors.parts[i].node;
+        double   exponent = factors.parts[i].number;
+
+        if (exponent == POW_NULL)
+        {
+            DestructNodes(tree, factor);
+            continue;
+        }
+
+        DerNode** chain = (exponent < 0) ? &divisor : &numerator;
+
+        exponent = fabs(exponent);
+        if (exponent != 1) factor = POW(factor, CONST(exponent));
+
+        *chain = (*chain == nullptr) ? factor : MUL(*chain, factor);
+    }
+
+    free(factors.parts);
+
+    if (divisor == nullptr) return numerator;
+
+    return DIV((numerator == nullptr) ? CONST(1) : numerator, divisor);
+}
+
+// coefficient * factors, a quotient takes the coefficient into its numerator
+DerNode* ScaleFactors(DerTree* tree, DerNode* factors, double coefficient)
+{
+    assert(tree);
+    assert(factors);
+
+    if (factors->type != TYPE_BIN_OP || factors->value.op != OP_DIV) return MUL(CONST(coefficient), factors);
+
+    DerNode* numerator = factors->left;
+    DerNode* divisor   = factors->right;
+
+    DestructNode(tree, factors);
+
+    // CanonicalFactors leaves only 1 as a constant numerator
+    if (numerator->type == TYPE_CONST)
+    {
+        DestructNode(tree, numerator);
+        return DIV(CONST(coefficient), divisor);
+    }
+
+    return DIV(MUL(CONST(coefficient), numerator), divisor);
+}
+
+// Explicit stacks here: a long sum or product is a left-deep chain as long as it has terms.
+// Right is pushed first, so terms come left to right as they would recursively
+void CollectTerms(DerTree* tree, DerNode* node, double sign, CanonicalParts* terms, double* constant)
+{
+    assert(tree);
+    assert(node);
+    assert(terms);
+    assert(constant);
+
+    WalkStack stack;
+    InitWalkStack(&stack);
+
+    DerNode* top = node;
+
+    PushFrame(&stack, node, nullptr, nullptr, (sign < 0) ? -1 : 1);
+
+    while (stack.size > 0)
+    {
+        WalkFrame frame = stack.frames[--stack.size];
+
+        node = CanonicalOperand(tree, frame.node);
+        sign = frame.state;
+
+        // A big shared sum stays one term. A shared product is still flattened, it is a whole term of its own
+        // and comes out as the same interned chain
+        if (IsSumNode(node) && (frame.node == top || !IsSharedChain(tree, frame.node)))
+        {
+            PushFrame(&stack, node->right, nullptr, nullptr, (node->value.op == OP_SUB) ? -frame.state : frame.state);
+            PushFrame(&stack, node->left,  nullptr, nullptr, frame.state);
+
+            DestructNode(tree, node);
+            continue;
+        }
+
+        if (node->type == TYPE_CONST)
+        {
+            *constant += sign * node->value.number;
+
+            DestructNode(tree, node);
+            continue;
+        }
+
+        // A product gives its constant to the term as the coefficient
+        if (IsProductNode(node))
+        {
+            double   coefficient = 1;
+            DerNode* factors     = CanonicalFactors(tree, node, &coefficient);
+
+            if (factors == nullptr) *constant += sign * coefficient;
+            else                    AddPart(terms, factors, sign * coefficient);
+
+            continue;
+        }
+
+        AddPart(terms, node, sign);
+    }
+
+    DestructWalkStack(&stack);
+}
+
+void CollectFactors(DerTree* tree, DerNode* node, CanonicalParts* factors, double* coefficient)
+{
+    assert(tree);
+    assert(node);
+    assert(factors);
+    assert(coefficient);
+
+    WalkStack stack;
+    InitWalkStack(&stack);
+
+    DerNode* top = node;
+
+    // The state of a frame is the sign of its exponent, a divisor flips it
+    PushFrame(&stack, node, nullptr, nullptr, 1);
+
+    while (stack.size > 0)
+    {
+        WalkFrame frame = stack.frames[--stack.size];
+
+        node = CanonicalOperand(tree, frame.node);
+
+        bool is_shared = frame.node != top && IsSharedChain(tree, frame.node) && IsProductNode(frame.node);
+
+        if (IsProductNode(node) && !is_shared)
+        {
+            PushFrame(&stack, node->right, nullptr, nullptr, (node->value.op == OP_DIV) ? -frame.state : frame.state);
+            PushFrame(&stack, node->left,  nullptr, nullptr, frame.state);
+
+            DestructNode(tree, node);
+            continue;
+        }
+
+        if (node->type == TYPE_CONST)
+        {
+            ScaleCoefficient(coefficient, node->value.number, frame.state);
+
+            DestructNode(tree, node);
+            continue;
+        }
+
+        if (is_shared) AddPart(factors, node, frame.state);
+        else           AddFactors(tree, node, frame.state, factors, coefficient);
+    }
+
+    DestructWalkStack(&stack);
+}
+
+// Splits a factor that is canonical already, x + x inside a product comes back as 2 * x.
+// A negative sign puts the factor into a divisor
+void AddFactors(DerTree* tree, DerNode* factor, int sign, CanonicalParts* factors, double* coefficient)
+{
+    assert(tree);
+    assert(factor);
+    assert(factors);
+    assert(coefficient);
+
+    WalkStack stack;
+    InitWalkStack(&stack);
+
+    PushFrame(&stack, factor, nullptr, nullptr, sign);
+
+    while (stack.size > 0)
+    {
+        WalkFrame frame = stack.frames[--stack.size];
+
+        factor = frame.node;
+        sign   = frame.state;
+
+        if (IsProductNode(factor))
+        {
+            PushFrame(&stack, factor->right, nullptr, nullptr, (factor->value.op == OP_DIV) ? -sign : sign);
+            PushFrame(&stack, factor->left,  nullptr, nullptr, sign);
+
+            DestructNode(tree, factor);
+            continue;
+        }
+
+        if (factor->type == TYPE_CONST)
+        {
+            ScaleCoefficient(coefficient, factor->value.number, sign);
+
+            DestructNode(tree, factor);
+            continue;
+        }
+
+        // Only constant exponents add up, x ^ a * x ^ b stays as it is
+        if (factor->type == TYPE_BIN_OP && factor->value.op == OP_POW && factor->right->type == TYPE_CONST)
+        {
+            DerNode* base     = factor->left;
+            double   exponent = factor->right->value.number;
+
+            DestructNode(tree, factor->right);
+            DestructNode(tree, factor);
+
+            AddPart(factors, base, sign * exponent);
+            continue;
+        }
+
+        AddPart(factors, factor, sign);
+    }
+
+    DestructWalkStack(&stack);
+}
+
+// A constant in a divisor divides the coefficient
+void ScaleCoefficient(double* coefficient, double number, int sign)
+{
+    assert(coefficient);
+
+    if (sign < 0) *coefficient /= number;
+    else          *coefficient *= number;
+}
+
+// Sorts the parts and adds up the numbers of equal nodes, the duplicates are destructed
+void MergeParts(DerTree* tree, CanonicalParts* parts)
+{
+    assert(tree);
+    assert(parts);
+
+    if (parts->size == 0) return;
+
+    for (size_t i = 0; i < parts->size; ++i)
+    {
+        RefreshNodeInfo(tree, parts->parts[i].node);
+    }
+
+    qsort(parts->parts, parts->size, sizeof(CanonicalPart), ComparePartNodes);
+
+    size_t size = 0;
+
+    for (size_t i = 0; i < parts->size; ++i)
+    {
+        if (size > 0 && CompareSubTrees(parts->parts[size - 1].node, parts->parts[i].node) == 0)
+        {
+            parts->parts[size - 1].number += parts->parts[i].number;
+            DestructNodes(tree, parts->parts[i].node);
+            continue;
+        }
+
+        parts->parts[size++] = parts->parts[i];
+    }
+
+    parts->size = size;
+}
+
+void AddPart(CanonicalParts* parts, DerNode* node, double number)
+{
+    assert(parts);
+    assert(node);
+
+    if (parts->size == parts->capacity)
+    {
+        parts->capacity = (parts->capacity == 0) ? 8 : 2 * parts->capacity;
+
+        parts->parts = (CanonicalPart*)realloc(parts->parts, parts->capacity * sizeof(CanonicalPart));
+        assert(parts->parts);
+    }
+
+    parts->parts[parts->size].node   = node;
+    parts->parts[parts->size].number = number;
+    parts->size++;
+}
+
+int ComparePartNodes(const void* first, const void* second)
+{
+    assert(first);
+    assert(second);
+
+    return CompareSubTrees(((const CanonicalPart*)first)->node, ((const CanonicalPart*)second)->node);
+}
+
+// Constants, then variables, then operations, each ordered by value and then by children, left first.
+// Operations read the size and hash, so the info of both subtrees must be known, see RefreshNodeInfo
+int CompareSubTrees(DerNode* first, DerNode* second)
+{
+    assert(first);
+    assert(second);
+
+    int result = 0;
+
+    WalkStack stack;
+    InitWalkStack(&stack);
+
+    PushFrame(&stack, first, second, nullptr, 0);
+
+    while (stack.size > 0 && result == 0)
+    {
+        WalkFrame frame = stack.frames[--stack.size];
+
+        first  = frame.node;
+        second = frame.link;
+
+        if (first == second) continue;
+
+        result = CompareNodes(first, second);
+
+        if (result == 0 && (first->type == TYPE_BIN_OP || first->type == TYPE_UN_OP))
+        {
+            PushFrame(&stack, first->right, second->right, nullptr, 0);
+            PushFrame(&stack, first->left,  second->left,  nullptr, 0);
+        }
+    }
+
+    DestructWalkStack(&stack);
+
+    return result;
+}
+
+// Without the children
+int CompareNodes(DerNode* first, DerNode* second)
+{
+    assert(first);
+    assert(second);
+
+    int first_rank  = NodeTypeRank(first->type);
+    int second_rank = NodeTypeRank(second->type);
+
+    if (first_rank != second_rank) return (first_rank < second_rank) ? -1 : 1;
+
+    switch (first->type)
+    {
+        case TYPE_NIL :
+        {
+            return 0;
+        }
+        case TYPE_CONST :
+        case NODE_ERROR :
+        {
+            return CompareNumbers(first->value.number, second->value.number);
+        }
+        case TYPE_VAR :
+        {
+            if (first->value.var != second->value.var) return (first->value.var < second->value.var) ? -1 : 1;
+            return 0;
+        }
+        default :
+        {
+            if (first->value.op != second->value.op) return (first->value.op < second->value.op) ? -1 : 1;
+
+            // Smaller subtrees first, so two deep ones are seldom walked down. Past MAX_INFO_SIZE the hashes decide
+            if (first->size != second->size) return (first->size < second->size) ? -1 : 1;
+            if (first->size == MAX_INFO_SIZE && first->hash != second->hash) return (first->hash < second->hash) ? -1 : 1;
+
+            return 0;
+        }
+    }
+}
+
+int NodeTypeRank(NodeType type)
+{
+    switch (type)
+    {
+        case TYPE_NIL    : return 0;
+        case TYPE_CONST  : return 1;
+        case TYPE_VAR    : return 2;
+        case TYPE_UN_OP  : return 3;
+        case TYPE_BIN_OP : return 4;
+        default          : return 5;
+    }
+}
+
+// NaN goes after every other number and is equal to NaN, so the order stays strict for qsort
+int CompareNumbers(double first, double second)
+{
+    if (isnan(first) || isnan(second)) return (int)isnan(first) - (int)isnan(second);
+
+    if (first < second) return -1;
+    if (first > second) return  1;
+
+    return 0;
+}
+
+#undef ADD
+#undef SUB
+#undef MUL
+#undef DIV
+#undef POW
+#undef CONST
@@ -0,0 +1,357 @@
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "codegen.h"
+
+
+const char*  CODEGEN_DIR      = "codegen";
+const char*  CODEGEN_COMPILER = "g++ -O2 -fno-math-errno -shared -fPIC";
+const size_t CODEGEN_VERSION  = 2;
+const size_t CODEGEN_PROBES   = 8;
+const size_t CODEGEN_PATH_LEN = 128;
+const size_t CODEGEN_CMD_LEN  = 512;
+const size_t CODEGEN_NAME_LEN = 32;
+
+/////////////////////////////////
+//Native code generation
+/////////////////////////////////
+NativeModule* CompileNative       (DerTree* tree, size_t order);
+bool          OpenNativeLibrary   (DerTree* tree, size_t order, const char* library, const char* key, NativeModule* module);
+bool          BuildNativeLibrary  (DerTree* tree, size_t order, const char* library, const char* key);
+void          DestructNativeModule(NativeModule* module);
+void          EmitNativeSource    (DerTree* tree, size_t order, FILE* file);
+void          EmitNativeFunction  (DerTree* tree, size_t number, FILE* file);
+size_t        EmitNativeNode      (DerTree* tree, DerNode* node, NodeMap* emitted, size_t* num_values, FILE* file);
+void          EmitNativeConst     (double value, FILE* file);
+size_t        NativeExpressionHash(DerTree* tree, size_t order);
+char*         NativeExpressionKey (DerTree* tree, size_t order);
+
+
+// funcs[k] evaluates the k-th derivative, libraries are reused between runs by expression hash
+NativeModule* CompileNative(DerTree* tree, size_t order)
+{
+    assert(tree);
+
+    NativeModule* module = (NativeModule*)calloc(1, sizeof(NativeModule));
+    assert(module);
+
+    module->hash = NativeExpressionHash(tree, order);
+
+    char* key     = NativeExpressionKey(tree, order);
+    bool  is_open = true;
+
+    char library[CODEGEN_PATH_LEN] = "";
+
+    // Expressions with the same hash take the next names in turn, expr_key tells whose library it is
+    for (size_t probe = 0; probe < CODEGEN_PROBES && is_open && module->handle == nullptr; ++probe)
+    {
+        snprintf(library, CODEGEN_PATH_LEN, "%s/expr_%016zx_%zu_%zu.so", CODEGEN_DIR, module->hash, order, probe);
+
+        is_open = OpenNativeLibrary(tree, order, library, key, module);
+    }
+
+    free(key);
+
+    if (module->handle == nullptr)
+    {
+        if (is_open) printf("Codegen error : all %zu names of hash %016zx hold other expressions\nline = %d\n",
+                            CODEGEN_PROBES, module->hash, __LINE__);
+        free(module);
+        return nullptr;
+    }
+
+    module->num_funcs = order + 1;
+    module->funcs     = (NativeFunc*)calloc(module->num_funcs, sizeof(NativeFunc));
+    assert(module->funcs);
+
+    for (size_t i = 0; i < module->num_funcs; ++i)
+    {
+        char name[CODEGEN_NAME_LEN] = "";
+        snprintf(name, CODEGEN_NAME_LEN, "derivative_%zu", i);
+
+        module->funcs[i] = (NativeFunc)dlsym(module->handle, name);
+        if (module->funcs[i] == nullptr)
+        {
+            printf("Codegen error : %s is missing in %s\nline = %d\n", name, library, __LINE__);
+            DestructNativeModule(module);
+            return nullptr;
+        }
+    }
+
+    return module;
+}
+
+// False on an error, a library of another expression leaves module->handle nullptr
+bool OpenNativeLibrary(DerTree* tree, size_t order, const char* library, const char* key, NativeModule* module)
+{
+    assert(tree);
+    assert(library);
+    assert(key);
+    assert(module);
+
+    module->was_cached = (access(library, F_OK) == 0);
+
+    if (!module->was_cached && !BuildNativeLibrary(tree, order, library, key)) return false;
+
+    // A relative name would be looked up in the library path instead of the cache
+    char full_library[CODEGEN_PATH_LEN] = "";
+    snprintf(full_library, CODEGEN_PATH_LEN, "./%s", library);
+
+    module->handle = dlopen(full_library, RTLD_NOW | RTLD_LOCAL);
+    if (module->handle == nullptr)
+    {
+        printf("Codegen error : %s\nline = %d\n", dlerror(), __LINE__);
+        return false;
+    }
+
+    const char* stored_key = (const char*)dlsym(module->handle, "expr_key");
+
+    if (stored_key == nullptr || strcmp(stored_key, key) != 0)
+    {
+        dlclose(module->handle);
+        module->handle = nullptr;
+    }
+
+    return true;
+}
+
+bool BuildNativeLibrary(DerTree* tree, size_t order, const char* library, const char* key)
+{
+    assert(tree);
+    assert(library);
+    assert(key);
+
+    mkdir(CODEGEN_DIR, 0755);
+
+    // Other processes may build the same expression, so each one writes its own files and renames at the end
+    char source[CODEGEN_PATH_LEN] = "";
+    char output[CODEGEN_PATH_LEN] = "";
+    snprintf(source, CODEGEN_PATH_LEN, "%s.%d.cpp", library, (int)getpid());
+    snprintf(output, CODEGEN_PATH_LEN, "%s.%d",     library, (int)getpid());
+
+    FILE* source_file = fopen(source, "w");
+    if (source_file == nullptr)
+    {
+        printf("Codegen error : can't open %s\nline = %d\n", source, __LINE__);
+        return false;
+    }
+
+    EmitNativeSource(tree, order, source_file);
+    fprintf(source_file, "extern \"C\" const char expr_key[] = \"%s\";\n", key);
+    fclose(source_file);
+
+    char compile_cmd[CODEGEN_CMD_LEN] = "";
+    snprintf(compile_cmd, CODEGEN_CMD_LEN, "%s %s -o %s", CODEGEN_COMPILER, source, output);
+
+    bool is_built = (system(compile_cmd) == 0) && (rename(output, library) == 0);
+
+    if (!is_built)
+    {
+        printf("Codegen error : %s failed\nline = %d\n", compile_cmd, __LINE__);
+        remove(output);
+    }
+
+    remove(source);
+
+    return is_built;
+}
+
+void DestructNativeModule(NativeModule* module)
+{
+    assert(module);
+
+    if (module->handle != nullptr) dlclose(module->handle);
+
+    free(module->funcs);
+    free(module);
+}
+
+void EmitNativeSource(DerTree* tree, size_t order, FILE* file)
+{
+    assert(tree);
+    assert(file);
+
+    fprintf(file, "#include <math.h>\n\n");
+
+    DerTree* derivative = CopyTree(tree);
+
+    for (size_t i = 0; i <= order; ++i)
+    {
+        if (i > 0) TakeDerivative(derivative);
+
+        EmitNativeFunction(derivative, i, file);
+    }
+
+    Destruct(derivative);
+    Delete(derivative);
+}
+
+void EmitNativeFunction(DerTree* tree, size_t number, FILE* file)
+{
+    assert(tree);
+    assert(file);
+
+    fprintf(file, "extern \"C\" double derivative_%zu(double x, double y)\n{\n", number);
+    fprintf(file, "    (void)x;\n    (void)y;\n\n");
+
+    // Every node becomes one local, so shared DAG nodes are computed once and the nesting stays flat
+    NodeMap emitted    = {};
+    size_t  num_values = 0;
+    size_t  result     = EmitNativeNode(tree, tree->root, &emitted, &num_values, file);
+    NodeMapDestruct(&emitted);
+
+    fprintf(file, "\n    return v%zu;\n}\n\n", result);
+}
+
+// Children before their parent on an explicit stack, a finished child is found in emitted by its parent
+size_t EmitNativeNode(DerTree* tree, DerNode* node, NodeMap* emitted, size_t* num_values, FILE* file)
+{
+    assert(tree);
+    assert(node);
+    assert(emitted);
+    assert(num_values);
+    assert(file);
+
+    DerNode* root = node;
+
+    WalkStack stack;
+    InitWalkStack(&stack);
+
+    PushFrame(&stack, node, nullptr, nullptr, 0);
+
+    while (stack.size > 0)
+    {
+        WalkFrame frame = stack.frames[--stack.size];
+        node            = frame.node;
+
+        // The map keeps the number of the local + 1, a null value means not emitted
+        if (NodeMapGet(emitted, node) != nullptr) continue;
+
+        bool is_op = node->type == TYPE_BIN_OP || node->type == TYPE_UN_OP;
+
+        if (is_op && frame.state == 0)
+        {
+            PushFrame(&stack, node, nullptr, nullptr, 1);
+            PushFrame(&stack, node->right, nullptr, nullptr, 0);
+            if (node->type == TYPE_BIN_OP) PushFrame(&stack, node->left, nullptr, nullptr, 0);
+            continue;
+        }
+
+        size_t left  = 0;
+        size_t right = 0;
+
+        if (node->type == TYPE_BIN_OP) left  = (size_t)NodeMapGet(emitted, node->left)  - 1;
+        if (is_op)                     right = (size_t)NodeMapGet(emitted, node->right) - 1;
+
+        size_t number = (*num_values)++;
+
+        fprintf(file, "    const double v%zu = ", number);
+
+        switch (node->type)
+        {
+            case TYPE_CONST :
+            {
+                EmitNativeConst(node->value.number, file);
+                break;
+            }
+            case TYPE_VAR :
+            {
+                fprintf(file, "%c", node->value.var);
+                break;
+            }
+            case TYPE_BIN_OP :
+            {
+                if (node->value.op == OP_POW) fprintf(file, "pow(v%zu, v%zu)", left, right);
+                else                          fprintf(file, "v%zu %s v%zu", left, BINARY_OP[node->value.op], right);
+                break;
+            }
+            case TYPE_UN_OP :
+            {
+                if      (node->value.op == OP_CTG) fprintf(file, "1 / tan(v%zu)", right);
+                else if (node->value.op == OP_LN)  fprintf(file, "log(v%zu)", right);
+                else                               fprintf(file, "%s(v%zu)", UNARY_OP[node->value.op], right);
+                break;
+            }
+            default :
+            {
+                fprintf(file, "NAN");
+                break;
+            }
+        }
+
+        fprintf(file, ";\n");
+
+        NodeMapSet(emitted, node, (DerNode*)(number + 1));
+    }
+
+    DestructWalkStack(&stack);
+
+    return (size_t)NodeMapGet(emitted, root) - 1;
+}
+
+void EmitNativeConst(double value, FILE* file)
+{
+    assert(file);
+
+    if      (isnan(value)) fprintf(file, "NAN");
+    else if (isinf(value)) fprintf(file, (value > 0) ? "INFINITY" : "-INFINITY");
+    else                   fprintf(file, "%.17g", value);
+}
+
+size_t NativeExpressionHash(DerTree* tree, size_t order)
+{
+    assert(tree);
+
+    size_t size = 0;
+    size_t hash = SubTreeHash(tree, tree->root, &size);
+
+    // The node hashes are 32 bits, the size makes a clash of two library names less likely
+    hash = hash * 0x9e3779b97f4a7c15ULL + size;
+    hash = hash * 0x9e3779b97f4a7c15ULL + order;
+    hash = hash * 0x9e3779b97f4a7c15ULL + CODEGEN_VERSION;
+
+    return hash ^ (hash >> 29);
+}
+
+// The expression in prefix order with exact constants, no quotes or backslashes so it fits a string literal.
+// Shared nodes are written out every time, the text does not depend on whether the tree is a DAG
+char* NativeExpressionKey(DerTree* tree, size_t order)
+{
+    assert(tree);
+
+    char*  key  = nullptr;
+    size_t size = 0;
+
+    FILE* file = open_memstream(&key, &size);
+    assert(file);
+
+    fprintf(file, "%zu", order);
+
+    WalkStack stack;
+    InitWalkStack(&stack);
+
+    if (tree->root != tree->nil) PushFrame(&stack, tree->root, nullptr, nullptr, 0);
+
+    while (stack.size > 0)
+    {
+        DerNode* node = stack.frames[--stack.size].node;
+
+        switch (node->type)
+        {
+            case TYPE_CONST  : fprintf(file, " %a", node->value.number);          break;
+            case TYPE_VAR    : fprintf(file, " %c", node->value.var);             break;
+            case TYPE_BIN_OP : fprintf(file, " %s", BINARY_OP[node->value.op]);   break;
+            case TYPE_UN_OP  : fprintf(file, " %s", UNARY_OP[node->value.op]);    break;
+            default          : fprintf(file, " ?");                               break;
+        }
+
+        if (node->type == TYPE_BIN_OP || node->type == TYPE_UN_OP) PushFrame(&stack, node->right, nullptr, nullptr, 0);
+        if (node->type == TYPE_BIN_OP)                             PushFrame(&stack, node->left,  nullptr, nullptr, 0);
+    }
+
+    DestructWalkStack(&stack);
+    fclose(file);
+
+    return key;
+}
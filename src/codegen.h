@@ -0,0 +1,21 @@
+#pragma once
+
+#include "derivative.h"
+
+typedef double (*NativeFunc)(double x, double y);
+
+struct NativeModule
+{
+    void* handle = nullptr;
+
+    NativeFunc* funcs     = nullptr;
+    size_t      num_funcs = 0;
+
+    size_t hash       = 0;
+    bool   was_cached = false;
+};
+
+NativeModule* CompileNative       (DerTree* tree, size_t order);
+void          DestructNativeModule(NativeModule* module);
+void          EmitNativeSource    (DerTree* tree, size_t order, FILE* file);
+size_t        NativeExpressionHash(DerTree* tree, size_t order);
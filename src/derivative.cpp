@@ -4,49 +4,56 @@
 /////////////////////////////////
 //Simplification
 /////////////////////////////////
-void Simplify           (DerTree* tree);
-void CalculateConsts    (DerTree* tree, DerNode* node, bool* sth_has_changed);
-void CalculateBinOP     (DerTree* tree, DerNode* node);
-void CalculateUnOP      (DerTree* tree, DerNode* node);
-void CalculateNeutralOP (DerTree* tree, DerNode* node, bool* sth_has_changed);
-void CalculateNeutralAdd(DerTree* tree, DerNode* node);
-void CalculateNeutralSub(DerTree* tree, DerNode* node);
-void CalculateNeutralMul(DerTree* tree, DerNode* node);
-void CalculateNeutralDiv(DerTree* tree, DerNode* node);
-void CalculateNeutralPow(DerTree* tree, DerNode* node);
-void CalculateNeutralLn (DerTree* tree, DerNode* node);
-void CalculateNeutralExp(DerTree* tree, DerNode* node);
+void      Simplify            (DerTree* tree);
+void      SimplifyByPasses    (DerTree* tree);
+DerNode*  SimplifyFrom        (DerTree* tree, DerNode* node);
+DerNode*  SimplifyPostOrder   (DerTree* tree, DerNode* node);
+DerNode*  SimplifyNode        (DerTree* tree, DerNode* node, bool* sth_has_changed);
+DerNode** NodeSlot            (DerTree* tree, DerNode* node);
+void      CalculateConsts     (DerTree* tree, DerNode* node, bool* sth_has_changed);
+void      CalculateBinOP      (DerTree* tree, DerNode* node);
+void      CalculateUnOP       (DerTree* tree, DerNode* node);
+void      CalculateNeutralOP  (DerTree* tree, DerNode* node, bool* sth_has_changed);
+void      CalculateNeutralNode(DerTree* tree, DerNode* node);
+void      CalculateNeutralAdd (DerTree* tree, DerNode* node);
+void      CalculateNeutralSub (DerTree* tree, DerNode* node);
+void      CalculateNeutralMul (DerTree* tree, DerNode* node);
+void      CalculateNeutralDiv (DerTree* tree, DerNode* node);
+void      CalculateNeutralPow (DerTree* tree, DerNode* node);
+void      CalculateNeutralLn  (DerTree* tree, DerNode* node);
+void      CalculateNeutralExp (DerTree* tree, DerNode* node);
 
 /////////////////////////////////
 //Derivative
 /////////////////////////////////
 void     TakeDerivative       (DerTree* tree);
 DerNode* Derivative           (DerTree* tree, DerNode* node);
+DerNode* EnterDerivative      (DerTree* tree, DerNode* node, int* state);
+DerNode* FinishDerivative     (DerTree* tree, DerNode* node, DerNode* result, int state);
+DerNode* DerivativeNode       (DerTree* tree, DerNode* node, DerNode* d_left, DerNode* d_right);
 DerNode* CopySubTree          (DerTree* tree, DerNode* node);
-DerNode* SwitchBinOP          (DerTree* tree, DerNode* node);
-DerNode* SwitchUnOP           (DerTree* tree, DerNode* node);
+DerNode* SwitchBinOP          (DerTree* tree, DerNode* node, DerNode* d_left, DerNode* d_right);
+DerNode* SwitchUnOP           (DerTree* tree, DerNode* node, DerNode* d_right);
 void     TakeDerivative       (DerTree* tree);
 void     Taylor               (DerTree* tree, size_t order);
+DerTree* TaylorTree           (DerTree* tree, size_t order);
+DerNode* AddTaylorTerm        (DerTree* tree, size_t power, double factorial, double coefficient);
 void     SetParents           (DerTree* tree);
 void     SetParentsRecursively(DerTree* tree, DerNode* node);
 bool     IsThereVariable      (DerTree* tree, DerNode* node);
+void     SubstituteX          (DerTree* tree, double value);
 
-
-int main(const int argc, char* argv[])
+// Bits of a Derivative frame: which children need derivatives and whether the derivative is that of
+// a rewritten node held in the link of the frame
+enum DerivativeState
 {
-    DerTree* tree = GetTree(argc, argv);
-
-    Taylor(tree, 8);
-    // TakeDerivative(tree);
-    // PrintExpression(tree);
+    DERIVATIVE_ENTER   = 0,
+    DERIVATIVE_COMBINE = 1,
+    DERIVATIVE_LEFT    = 2,
+    DERIVATIVE_RIGHT   = 4,
+    DERIVATIVE_REWRITE = 8
+};
 
-    // TreeDump(tree);
-
-    Destruct(tree);
-    Delete(tree);
-
-    return 0;
-}
 
 DerNode* TakeDerivativeWithNewTree(DerTree* tree)
 {
@@ -66,53 +73,83 @@ void TakeDerivative(DerTree* tree)
 {
     assert(tree);
 
+    double start = StatsClock();
+
+    NodeMap memo = {};
+    if (tree->is_dag) tree->derivative_memo = &memo;
+
     DerNode* tmp = Derivative(tree, tree->root);
 
+    tree->derivative_memo = nullptr;
+    NodeMapDestruct(&memo);
+
     DestructNodes(tree, tree->root);
 
     tree->root = tmp;
     SetParents(tree);
 
     Simplify(tree);
+    Canonicalize(tree);
+
+    StatsRecord(tree, PHASE_DERIVATIVE, start);
 }
 
 void SetParents(DerTree* tree)
 {
+    // A shared node has several parents, DAG passes never look at them
+    if (tree->is_dag) return;
+
     tree->root->parent = tree->nil;
     SetParentsRecursively(tree, tree->root);
 }
 
 void SetParentsRecursively(DerTree* tree, DerNode* node)
 {
-    if (node->right != tree->nil)
-    {
-        node->right->parent = node;
-        SetParentsRecursively(tree, node->right);
-    }
+    assert(tree);
+    assert(node);
+
+    WalkStack stack;
+    InitWalkStack(&stack);
+
+    PushFrame(&stack, node, nullptr, nullptr, 0);
 
-    if (node->left  != tree->nil)
+    while (stack.size > 0)
     {
-        node->left->parent = node;
-        SetParentsRecursively(tree, node->left);
+        node = stack.frames[--stack.size].node;
+
+        if (node->right != tree->nil)
+        {
+            node->right->parent = node;
+            PushFrame(&stack, node->right, nullptr, nullptr, 0);
+        }
+
+        if (node->left  != tree->nil)
+        {
+            node->left->parent = node;
+            PushFrame(&stack, node->left, nullptr, nullptr, 0);
+        }
     }
+
+    DestructWalkStack(&stack);
 }
 
-#define dR    Derivative(tree, node->right)
-#define dL    Derivative(tree, node->left)
+#define dR    d_right
+#define dL    d_left
 #define cR    CopySubTree(tree, node->right)
 #define cL    CopySubTree(tree, node->left)
 #define COPY  CopySubTree(tree, node)
 
-#define ADD(left, right) ConstructNode(TYPE_BIN_OP, { .op = OP_ADD  }, left, right)
-#define SUB(left, right) ConstructNode(TYPE_BIN_OP, { .op = OP_SUB  }, left, right)
-#define MUL(left, right) ConstructNode(TYPE_BIN_OP, { .op = OP_MUL  }, left, right)
-#define DIV(left, right) ConstructNode(TYPE_BIN_OP, { .op = OP_DIV  }, left, right)
-#define POW(left, right) ConstructNode(TYPE_BIN_OP, { .op = OP_POW  }, left, right)
-#define EXP(right)       ConstructNode(TYPE_UN_OP,  { .op = OP_EXP  }, tree->nil, right)
-#define LN(right)        ConstructNode(TYPE_UN_OP,  { .op = OP_LN   }, tree->nil, right)
-#define CONST(NUM)       ConstructNode(TYPE_CONST,  { .number = NUM }, tree->nil, tree->nil)
-#define VAR(x)           ConstructNode(TYPE_VAR,    { .var = x      }, tree->nil, tree->nil)
-
+#define ADD(left, right) ConstructNode(tree, TYPE_BIN_OP, { .op = OP_ADD  }, left, right)
+#define SUB(left, right) ConstructNode(tree, TYPE_BIN_OP, { .op = OP_SUB  }, left, right)
+#define MUL(left, right) ConstructNode(tree, TYPE_BIN_OP, { .op = OP_MUL  }, left, right)
+#define DIV(left, right) ConstructNode(tree, TYPE_BIN_OP, { .op = OP_DIV  }, left, right)
+#define POW(left, right) ConstructNode(tree, TYPE_BIN_OP, { .op = OP_POW  }, left, right)
+#define EXP(right)       ConstructNode(tree, TYPE_UN_OP,  { .op = OP_EXP  }, tree->nil, right)
+#define LN(right)        ConstructNode(tree, TYPE_UN_OP,  { .op = OP_LN   }, tree->nil, right)
+#define CONST(NUM)       ConstructNode(tree, TYPE_CONST,  { .number = NUM }, tree->nil, tree->nil)
+#define VAR(x)           ConstructNode(tree, TYPE_VAR,    { .var = x      }, tree->nil, tree->nil)
+
+// Children before their parent on an explicit stack, every finished derivative goes onto values
 DerNode* Derivative(DerTree* tree, DerNode* node)
 {
     assert(tree);
@@ -120,6 +157,148 @@ DerNode* Derivative(DerTree* tree, DerNode* node)
 
     if (node == tree->nil) return tree->nil;
 
+    WalkStack stack;
+    WalkStack values;
+    InitWalkStack(&stack);
+    InitWalkStack(&values);
+
+    PushFrame(&stack, node, nullptr, nullptr, DERIVATIVE_ENTER);
+
+    while (stack.size > 0)
+    {
+        WalkFrame frame = stack.frames[--stack.size];
+        node            = frame.node;
+
+        if (frame.state == DERIVATIVE_ENTER)
+        {
+            int      state  = DERIVATIVE_COMBINE;
+            DerNode* result = EnterDerivative(tree, node, &state);
+
+            // f ^ g goes as exp(g * ln(f)), a temporary whose derivative is taken on the same stack,
+            // so x ^ (x ^ (x ^ ...)) does not recurse once per level
+            if (state & DERIVATIVE_REWRITE)
+            {
+                DerNode* power = EXP(MUL(cR, LN(cL)));
+
+                PushFrame(&stack, node,  power,   nullptr, state);
+                PushFrame(&stack, power, nullptr, nullptr, DERIVATIVE_ENTER);
+                continue;
+            }
+
+            // Leaves and x ^ 2 like nodes need no children, they are done right away
+            if (result == nullptr && !(state & (DERIVATIVE_LEFT | DERIVATIVE_RIGHT)))
+            {
+                result = FinishDerivative(tree, node, DerivativeNode(tree, node, nullptr, nullptr), state);
+            }
+
+            if (result != nullptr)
+            {
+                PushFrame(&values, result, nullptr, nullptr, 0);
+                continue;
+            }
+
+            // Left is pushed last, so its derivative is on values before the right one
+            PushFrame(&stack, node, nullptr, nullptr, state);
+            if (state & DERIVATIVE_RIGHT) PushFrame(&stack, node->right, nullptr, nullptr, DERIVATIVE_ENTER);
+            if (state & DERIVATIVE_LEFT)  PushFrame(&stack, node->left,  nullptr, nullptr, DERIVATIVE_ENTER);
+
+            continue;
+        }
+
+        if (frame.state & DERIVATIVE_REWRITE)
+        {
+            DerNode* result = FinishDerivative(tree, node, values.frames[--values.size].node, frame.state);
+
+            // The derivative holds copies of the temporary, not its nodes
+            DestructNodes(tree, frame.link);
+
+            PushFrame(&values, result, nullptr, nullptr, 0);
+            continue;
+        }
+
+        DerNode* d_right = (frame.state & DERIVATIVE_RIGHT) ? values.frames[--values.size].node : nullptr;
+        DerNode* d_left  = (frame.state & DERIVATIVE_LEFT)  ? values.frames[--values.size].node : nullptr;
+
+        DerNode* result = DerivativeNode(tree, node, d_left, d_right);
+        result          = FinishDerivative(tree, node, result, frame.state);
+
+        PushFrame(&values, result, nullptr, nullptr, 0);
+    }
+
+    DerNode* result = values.frames[0].node;
+
+    DestructWalkStack(&stack);
+    DestructWalkStack(&values);
+
+    return result;
+}
+
+// Returns the derivative when it is known without the children, otherwise sets which ones are needed
+DerNode* EnterDerivative(DerTree* tree, DerNode* node, int* state)
+{
+    assert(tree);
+    assert(node);
+    assert(state);
+
+    RefreshNodeInfo(tree, node);
+
+    // An undefined value stays undefined, see DerivativeNode
+    if (!(node->info & (INFO_VARIABLES | INFO_ERROR))) return CONST(0);
+
+    if (tree->derivative_memo != nullptr)
+    {
+        DerNode* result = NodeMapGet(tree->derivative_memo, node);
+
+        if (result != nullptr) return result;
+    }
+
+    if (node->type == TYPE_UN_OP)
+    {
+        *state |= DERIVATIVE_RIGHT;
+    }
+    else if (node->type == TYPE_BIN_OP && node->value.op != OP_POW)
+    {
+        *state |= DERIVATIVE_LEFT | DERIVATIVE_RIGHT;
+    }
+    else if (node->type == TYPE_BIN_OP)
+    {
+        bool is_var_in_left  = IsThereVariable(tree, node->left);
+        bool is_var_in_right = IsThereVariable(tree, node->right);
+
+        // f ^ g is rewritten by Derivative
+        if (is_var_in_left && is_var_in_right)
+        {
+            *state |= DERIVATIVE_REWRITE;
+            return nullptr;
+        }
+
+        if (is_var_in_left)  *state |= DERIVATIVE_LEFT;
+        if (is_var_in_right) *state |= DERIVATIVE_RIGHT;
+    }
+
+    return nullptr;
+}
+
+DerNode* FinishDerivative(DerTree* tree, DerNode* node, DerNode* result, int state)
+{
+    assert(tree);
+    assert(node);
+    assert(result);
+
+    if (tree->derivative_memo != nullptr)
+    {
+        NodeMapSet(tree->derivative_memo, node, result);
+    }
+
+    return result;
+}
+
+// One rule, d_left and d_right are the derivatives of the children or nullptr when they are not needed
+DerNode* DerivativeNode(DerTree* tree, DerNode* node, DerNode* d_left, DerNode* d_right)
+{
+    assert(tree);
+    assert(node);
+
     switch (node->type)
     {
         case TYPE_CONST :
@@ -132,11 +311,16 @@ DerNode* Derivative(DerTree* tree, DerNode* node)
         }
         case TYPE_BIN_OP :
         {
-            return SwitchBinOP(tree, node);
+            return SwitchBinOP(tree, node, d_left, d_right);
         }
         case TYPE_UN_OP :
         {
-            return SwitchUnOP(tree, node);
+            return SwitchUnOP(tree, node, d_right);
+        }
+        case NODE_ERROR :
+        {
+            // An undefined value like ln(-1) stays undefined, nil here would leave an operation without operand
+            return ConstructNode(tree, NODE_ERROR, node->value, tree->nil, tree->nil);
         }
         default :
         {
@@ -147,20 +331,53 @@ DerNode* Derivative(DerTree* tree, DerNode* node)
     }
 }
 
+// Parents before children, a frame carries the slot its copy goes to
 DerNode* CopySubTree(DerTree* tree, DerNode* node)
 {
     assert(tree);
     assert(node);
 
-    if (node == tree->nil)
+    if (node == tree->nil || tree->is_dag)
     {
-        return tree->nil;
+        return node;
     }
 
-    return ConstructNode(node->type, node->value, cL, cR);
+    // Most copies made by the rules are single constants and variables
+    if (node->left == tree->nil && node->right == tree->nil)
+    {
+        return ConstructNode(tree, node->type, node->value, tree->nil, tree->nil);
+    }
+
+    DerNode*  copy = nullptr;
+    WalkStack stack;
+    InitWalkStack(&stack);
+
+    PushFrame(&stack, node, nullptr, &copy, 0);
+
+    while (stack.size > 0)
+    {
+        WalkFrame frame = stack.frames[--stack.size];
+
+        DerNode* new_node = ConstructNode(tree, frame.node->type, frame.node->value, tree->nil, tree->nil);
+        *frame.slot       = new_node;
+
+        // The children are filled in below, the copy has the info of the original
+        new_node->hash     = frame.node->hash;
+        new_node->size     = frame.node->size;
+        new_node->info     = frame.node->info;
+        new_node->is_known = frame.node->is_known;
+
+        // The slots of nil children hold nil already
+        if (frame.node->right != tree->nil) PushFrame(&stack, frame.node->right, nullptr, &new_node->right, 0);
+        if (frame.node->left  != tree->nil) PushFrame(&stack, frame.node->left,  nullptr, &new_node->left,  0);
+    }
+
+    DestructWalkStack(&stack);
+
+    return copy;
 }
 
-DerNode* SwitchBinOP(DerTree* tree, DerNode* node)
+DerNode* SwitchBinOP(DerTree* tree, DerNode* node, DerNode* d_left, DerNode* d_right)
 {
     assert(tree);
     assert(node);
@@ -185,18 +402,12 @@ DerNode* SwitchBinOP(DerTree* tree, DerNode* node)
         }
         case OP_POW :
         {
-            bool IsVarInRight = IsThereVariable(tree, node->right);
-            bool IsVarInLeft  = IsThereVariable(tree, node->left);
-            
-            if (IsVarInLeft && IsVarInRight)
-            {
-                return Derivative(tree, EXP(MUL(cR, LN(cL))));
-            }
-            else if (IsVarInLeft)
+            // Only the side with a variable gets a derivative, EnterDerivative handles x ^ x
+            if (d_left != nullptr)
             {
                 return MUL(MUL(cR, POW(cL, SUB(cR, CONST(1)))), dL);
             } 
-            else if (IsVarInRight)
+            else if (d_right != nullptr)
             {
                 return MUL(MUL(COPY, LN(cL)), dR);
             }
@@ -213,11 +424,11 @@ DerNode* SwitchBinOP(DerTree* tree, DerNode* node)
     }
 }
 
-#define COS(right)  ConstructNode(TYPE_UN_OP, { .op = OP_COS  }, tree->nil, right)
-#define SIN(right)  ConstructNode(TYPE_UN_OP, { .op = OP_SIN  }, tree->nil, right)
-#define SQRT(right) ConstructNode(TYPE_UN_OP, { .op = OP_SQRT }, tree->nil, right)
+#define COS(right)  ConstructNode(tree, TYPE_UN_OP, { .op = OP_COS  }, tree->nil, right)
+#define SIN(right)  ConstructNode(tree, TYPE_UN_OP, { .op = OP_SIN  }, tree->nil, right)
+#define SQRT(right) ConstructNode(tree, TYPE_UN_OP, { .op = OP_SQRT }, tree->nil, right)
 
-DerNode* SwitchUnOP(DerTree* tree, DerNode* node)
+DerNode* SwitchUnOP(DerTree* tree, DerNode* node, DerNode* d_right)
 {
     assert(tree);
     assert(node);
@@ -262,47 +473,112 @@ DerNode* SwitchUnOP(DerTree* tree, DerNode* node)
 
 void SetX(DerTree* tree, DerNode* node, double value)
 {
+    assert(tree);
+    assert(node);
+
     if (node == tree->nil)
     {
         return;
     }
 
-    if (node->type == TYPE_VAR && node->value.var == 'x')
+    WalkStack stack;
+    InitWalkStack(&stack);
+
+    PushFrame(&stack, node, nullptr, nullptr, 0);
+
+    while (stack.size > 0)
     {
-        node->type = TYPE_CONST;
-        node->value.number = value;
+        node = stack.frames[--stack.size].node;
+
+        if (node->type == TYPE_VAR && node->value.var == 'x')
+        {
+            node->type = TYPE_CONST;
+            node->value.number = value;
+
+            InvalidateNode(tree, node);
+        }
+
+        if (node->left  != tree->nil) PushFrame(&stack, node->left,  nullptr, nullptr, 0);
+        if (node->right != tree->nil) PushFrame(&stack, node->right, nullptr, nullptr, 0);
     }
 
-    SetX(tree, node->right, value);
-    SetX(tree, node->left,  value);
+    DestructWalkStack(&stack);
+}
+
+void SubstituteX(DerTree* tree, double value)
+{
+    assert(tree);
+
+    if (tree->is_dag)
+    {
+        SubstituteXDag(tree, value);
+    }
+    else
+    {
+        SetX(tree, tree->root, value);
+    }
+}
+
+// Returns the new term, only it and the new root need simplifying, the old sum is simple already
+DerNode* AddTaylorTerm(DerTree* tree, size_t power, double factorial, double coefficient)
+{
+    assert(tree);
+
+    DerNode* term = MUL(DIV(POW(VAR('x'), CONST((double)power)), CONST(factorial)), CONST(coefficient));
+
+    tree->root = ADD(tree->root, term);
+
+    if (!tree->is_dag)
+    {
+        tree->root->parent       = tree->nil;
+        tree->root->left->parent = tree->root;
+        term->parent             = tree->root;
+        SetParentsRecursively(tree, term);
+    }
+
+    return term;
 }
 
 void Taylor(DerTree* tree, size_t order)
 {
-    size_t factorial = 1;
+    assert(tree);
+
+    DerTree* taylor_tree = TaylorTree(tree, order);
+
+    PrintExpression(taylor_tree);
+
+    Destruct(taylor_tree);
+    Delete(taylor_tree);
+}
+
+// Returns the Taylor polynomial at zero as a new tree, the caller destructs it. The tree becomes its derivative of order
+DerTree* TaylorTree(DerTree* tree, size_t order)
+{
+    assert(tree);
+
+    // In double, i! does not fit size_t past 20
+    double factorial = 1;
 
     DerTree* taylor_tree = CopyTree(tree);
-    SetX(taylor_tree, taylor_tree->root, 0);
+    SubstituteX(taylor_tree, 0);
     Simplify(taylor_tree);
 
     for (size_t i = 1; i <= order; ++i)
     {
-        if (i != 0)
-        {
-            factorial *= i;
-        }
+        factorial *= (double)i;
 
         TakeDerivative(tree);
         DerTree* tmp = CopyTree(tree);
-        SetX(tmp, tmp->root, 0);
+        SubstituteX(tmp, 0);
         Simplify(tmp);
 
-        taylor_tree->root = ADD(taylor_tree->root, MUL(DIV(POW(VAR('x'), CONST(i)), CONST(factorial)), CONST(tmp->root->value.number)));
-        SetParents(taylor_tree);
-        Simplify(taylor_tree);
+        SimplifyFrom(taylor_tree, AddTaylorTerm(taylor_tree, i, factorial, tmp->root->value.number));
+
+        Destruct(tmp);
+        Delete(tmp);
     }
 
-    PrintExpression(taylor_tree);
+    return taylor_tree;
 }
 
 #undef dR
@@ -323,16 +599,184 @@ void Simplify(DerTree* tree)
 {
     assert(tree);
 
+    double start = StatsClock();
+
+    if (tree->is_dag)
+    {
+        SimplifyDag(tree);
+    }
+    else
+    {
+        tree->simplify_stats.passes++;
+
+        SimplifyPostOrder(tree, tree->root);
+    }
+
+    StatsRecord(tree, PHASE_SIMPLIFY, start);
+}
+
+// The old fixed-point loop, kept to compare against the worklist
+void SimplifyByPasses(DerTree* tree)
+{
+    assert(tree);
+
+    if (tree->is_dag)
+    {
+        SimplifyDag(tree);
+        return;
+    }
+
     bool sth_has_changed = true;
 
     while (sth_has_changed)
     {
+        tree->simplify_stats.passes++;
+
         sth_has_changed = false;
         CalculateConsts(tree, tree->root, &sth_has_changed);
         CalculateNeutralOP(tree, tree->root, &sth_has_changed);
     }
 }
 
+// Simplifies a subtree that was just built or changed in an otherwise simple tree,
+// then climbs only as far as its ancestors keep changing
+DerNode* SimplifyFrom(DerTree* tree, DerNode* node)
+{
+    assert(tree);
+    assert(node);
+
+    if (tree->is_dag)
+    {
+        SimplifyDag(tree);
+        return tree->root;
+    }
+
+    tree->simplify_stats.passes++;
+
+    DerNode* result = SimplifyPostOrder(tree, node);
+
+    // An ancestor that stays the same leaves everything above it the same too
+    for (DerNode* parent = result->parent; parent != tree->nil; )
+    {
+        bool sth_has_changed = false;
+        DerNode* replacement = SimplifyNode(tree, parent, &sth_has_changed);
+
+        if (!sth_has_changed) break;
+
+        parent = replacement->parent;
+    }
+
+    return result;
+}
+
+// In post-order the children of a node are final before the rules are tried on it,
+// so one sweep gets to the same fixed point the passes did
+DerNode* SimplifyPostOrder(DerTree* tree, DerNode* node)
+{
+    assert(tree);
+    assert(node);
+
+    if (node == tree->nil) return node;
+
+    size_t    capacity = 64;
+    size_t    size     = 0;
+    DerNode** order    = (DerNode**)calloc(capacity, sizeof(DerNode*));
+    DerNode** stack    = (DerNode**)calloc(capacity, sizeof(DerNode*));
+    assert(order);
+    assert(stack);
+
+    size_t stack_size = 0;
+    stack[stack_size++] = node;
+
+    // Root, right, left popped from the stack is exactly the reverse of the post-order
+    while (stack_size > 0)
+    {
+        DerNode* current = stack[--stack_size];
+
+        if (size + 2 >= capacity)
+        {
+            capacity *= 2;
+
+            order = (DerNode**)realloc(order, capacity * sizeof(DerNode*));
+            stack = (DerNode**)realloc(stack, capacity * sizeof(DerNode*));
+            assert(order);
+            assert(stack);
+        }
+
+        order[size++] = current;
+
+        if (current->left  != tree->nil) stack[stack_size++] = current->left;
+        if (current->right != tree->nil) stack[stack_size++] = current->right;
+    }
+
+    DerNode** slot = NodeSlot(tree, node);
+
+    // Rewrites free only the node itself and nodes below it, which are all behind in the order
+    for (size_t i = size; i > 0; --i)
+    {
+        bool sth_has_changed = false;
+        SimplifyNode(tree, order[i - 1], &sth_has_changed);
+    }
+
+    tree->simplify_stats.visits += size;
+
+    free(order);
+    free(stack);
+
+    return *slot;
+}
+
+// Applies the rules to one node whose children are simple already, returns what now stands in its place
+DerNode* SimplifyNode(DerTree* tree, DerNode* node, bool* sth_has_changed)
+{
+    assert(tree);
+    assert(node);
+    assert(sth_has_changed);
+
+    if (node->type == TYPE_BIN_OP && node->left->type == TYPE_CONST && node->right->type == TYPE_CONST)
+    {
+        node->type = TYPE_CONST;
+        CalculateBinOP(tree, node);
+        *sth_has_changed = true;
+    }
+    else if (node->type == TYPE_UN_OP && node->right->type == TYPE_CONST)
+    {
+        node->type = TYPE_CONST;
+        CalculateUnOP(tree, node);
+        *sth_has_changed = true;
+    }
+    else if (node->type == TYPE_BIN_OP)
+    {
+        DerNode** slot = NodeSlot(tree, node);
+
+        CalculateNeutralNode(tree, node);
+
+        DerNode* replacement = *slot;
+
+        if (replacement != node || node->type != TYPE_BIN_OP)
+        {
+            tree->simplify_stats.rewrites++;
+            *sth_has_changed = true;
+        }
+
+        return replacement;
+    }
+
+    if (*sth_has_changed) tree->simplify_stats.rewrites++;
+
+    return node;
+}
+
+DerNode** NodeSlot(DerTree* tree, DerNode* node)
+{
+    assert(tree);
+    assert(node);
+
+    if (node->parent == tree->nil) return &tree->root;
+
+    return (node->parent->left == node) ? &node->parent->left : &node->parent->right;
+}
+
 #define Rval  node->right->value.number
 #define Lval  node->left->value.number
 #define VAL   node->value.number
@@ -344,30 +788,51 @@ void CalculateConsts(DerTree* tree, DerNode* node, bool* sth_has_changed)
     assert(tree);
     assert(node);
 
-    if (node == tree->nil) return;
+    WalkStack stack;
+    InitWalkStack(&stack);
 
-    CalculateConsts(tree, node->right, sth_has_changed);
-    CalculateConsts(tree, node->left,  sth_has_changed);
+    PushFrame(&stack, node, nullptr, nullptr, 0);
 
-    if (node->type == TYPE_BIN_OP)
+    // State 0 pushes the children, state 1 folds the node once they are done
+    while (stack.size > 0)
     {
-        if (Rtype == TYPE_CONST && Ltype == TYPE_CONST)
+        WalkFrame frame = stack.frames[--stack.size];
+        node            = frame.node;
+
+        if (node == tree->nil) continue;
+
+        if (frame.state == 0)
         {
-            node->type = TYPE_CONST;
-            CalculateBinOP(tree, node);
-            *sth_has_changed = true;
+            tree->simplify_stats.visits++;
+
+            PushFrame(&stack, node, nullptr, nullptr, 1);
+            if (node->left  != tree->nil) PushFrame(&stack, node->left,  nullptr, nullptr, 0);
+            if (node->right != tree->nil) PushFrame(&stack, node->right, nullptr, nullptr, 0);
+            continue;
         }
-    }
 
-    if (node->type == TYPE_UN_OP)
-    {
-        if (Rtype == TYPE_CONST)
+        if (node->type == TYPE_BIN_OP)
         {
-            node->type = TYPE_CONST;
-            CalculateUnOP(tree, node);
-            *sth_has_changed = true;
+            if (Rtype == TYPE_CONST && Ltype == TYPE_CONST)
+            {
+                node->type = TYPE_CONST;
+                CalculateBinOP(tree, node);
+                *sth_has_changed = true;
+            }
+        }
+
+        if (node->type == TYPE_UN_OP)
+        {
+            if (Rtype == TYPE_CONST)
+            {
+                node->type = TYPE_CONST;
+                CalculateUnOP(tree, node);
+                *sth_has_changed = true;
+            }
         }
     }
+
+    DestructWalkStack(&stack);
 }
 
 void CalculateBinOP(DerTree* tree, DerNode* node)
@@ -375,116 +840,124 @@ void CalculateBinOP(DerTree* tree, DerNode* node)
     assert(tree);
     assert(node);
 
-    switch (node->value.op)
+    if (!FoldBinOP(node->value.op, Lval, Rval, &VAL))
+    {
+        node->type = NODE_ERROR;
+    }
+
+    KillChildren(tree, node);
+}
+
+void CalculateUnOP(DerTree* tree, DerNode* node)
+{
+    assert(tree);
+    assert(node);
+
+    if (!FoldUnOP(node->value.op, Rval, &VAL))
+    {
+        node->type = NODE_ERROR;
+    }
+
+    DestructNode(tree, node->right);
+    node->right = tree->nil;
+
+    InvalidateNode(tree, node);
+}
+
+bool FoldBinOP(int op, double left, double right, double* result)
+{
+    assert(result);
+
+    switch (op)
     {
         case OP_ADD :
         {
-            VAL = Lval + Rval;
-            break;
+            *result = left + right;
+            return true;
         }
         case OP_SUB :
         {
-            VAL = Lval - Rval;
-            break;
+            *result = left - right;
+            return true;
         }
         case OP_MUL :
         {
-            VAL = Lval * Rval;
-            break;
+            *result = left * right;
+            return true;
         }
         case OP_DIV :
         {
-            if (Rval != 0)
-            {
-                VAL = Lval / Rval;
-            } 
-            else
-            {
-                node->type = NODE_ERROR;
-            }
-            break;
+            if (right == 0) return false;
+
+            *result = left / right;
+            return true;
         }
         case OP_POW :
         {
-            VAL = pow(Lval, Rval);
-            break;
+            *result = pow(left, right);
+            return true;
         }
         default :
         {
             printf("Error in calculating constants : unknown type of node\n");
-            break;
+            return false;
         }
     }
-    KillChildren(tree, node);
 }
 
-void CalculateUnOP(DerTree* tree, DerNode* node)
+bool FoldUnOP(int op, double right, double* result)
 {
-    assert(tree);
-    assert(node);
+    assert(result);
 
-    switch (node->value.op)
+    switch (op)
     {
         case OP_SIN :
         {
-            VAL = sin(Rval);
-            break;
+            *result = sin(right);
+            return true;
         }
         case OP_COS :
         {
-            VAL = cos(Rval);
-            break;
+            *result = cos(right);
+            return true;
         }
         case OP_TAN :
         {
-            VAL = tan(Rval);
-            break;
+            *result = tan(right);
+            return true;
         }
         case OP_CTG :
         {
-            if (Rval != 0)
-            {
-                VAL = 1 / tan(Rval);
-            }
-            break;
+            if (right == 0) return false;
+
+            *result = 1 / tan(right);
+            return true;
         }
         case OP_SQRT :
         {
-            if (Rval >= 0)
-            {
-                VAL = sqrt(Rval);
-            }
-            else
-            {
-                node->type = NODE_ERROR;
-            }
-            break;
+            if (right < 0) return false;
+
+            *result = sqrt(right);
+            return true;
         }
         case OP_LN :
         {
-            if (Rval >= 0)
-            {
-                VAL = log(Rval);
-            }
-            else
-            {
-                node->type = NODE_ERROR;
-            }
-            break;
+            if (right < 0) return false;
+
+            *result = log(right);
+            return true;
         }
         case OP_EXP :
         {
-            VAL = exp(Rval);
-            break;
+            *result = exp(right);
+            return true;
         }
         default :
         {
             printf("Error in calculating constants : unknown type of node\n");
-            break;
+            return false;
         }
     }
-    DestructNode(tree, node->right);
-    node->right = tree->nil;
 }
 
 void CalculateNeutralOP(DerTree* tree, DerNode* node, bool* sth_has_changed)
@@ -492,62 +965,89 @@ void CalculateNeutralOP(DerTree* tree, DerNode* node, bool* sth_has_changed)
     assert(tree);
     assert(node);
 
-    if (node == tree->nil)
-    {
-        return;
-    }
+    WalkStack stack;
+    InitWalkStack(&stack);
 
-    CalculateNeutralOP(tree, node->right, sth_has_changed);
-    CalculateNeutralOP(tree, node->left,  sth_has_changed);
+    PushFrame(&stack, node, nullptr, nullptr, 0);
 
-    if (node->type == TYPE_BIN_OP)
+    // As in CalculateConsts, a rule may destruct the node, but only after its children are done
+    while (stack.size > 0)
     {
-        switch (node->value.op)
+        WalkFrame frame = stack.frames[--stack.size];
+        node            = frame.node;
+
+        if (node == tree->nil) continue;
+
+        if (frame.state == 0)
         {
-            case OP_ADD :
-            {
-                CalculateNeutralAdd(tree, node);
-                break;  
-            }
-            case OP_SUB :
-            {
-                CalculateNeutralSub(tree, node);
-                break;  
-            }
-            case OP_MUL :
-            {
-                CalculateNeutralMul(tree, node);
-                break;
-            }
-            case OP_DIV :
-            {
-                CalculateNeutralDiv(tree, node);
-                break;  
-            }
-            case OP_POW :
-            {
-                CalculateNeutralPow(tree, node);
-                break;  
-            }
-            case OP_LN :
-            {
-                CalculateNeutralLn(tree, node);
-                break;
-            }
-            case OP_EXP :
-            {
-                CalculateNeutralExp(tree, node);
-                break;
-            }
-            default :
+            tree->simplify_stats.visits++;
+
+            PushFrame(&stack, node, nullptr, nullptr, 1);
+            if (node->left  != tree->nil) PushFrame(&stack, node->left,  nullptr, nullptr, 0);
+            if (node->right != tree->nil) PushFrame(&stack, node->right, nullptr, nullptr, 0);
+            continue;
+        }
+
+        if (node->type == TYPE_BIN_OP)
+        {
+            CalculateNeutralNode(tree, node);
+
+            if (node->type != TYPE_BIN_OP) 
             {
-                printf("Error in calculating neutrals : unknown value\nline = %d", __LINE__);
-                break;
+                *sth_has_changed = true;
             }
         }
-        if (node->type != TYPE_BIN_OP) 
+    }
+
+    DestructWalkStack(&stack);
+}
+
+void CalculateNeutralNode(DerTree* tree, DerNode* node)
+{
+    assert(tree);
+    assert(node);
+
+    switch (node->value.op)
+    {
+        case OP_ADD :
+        {
+            CalculateNeutralAdd(tree, node);
+            break;  
+        }
+        case OP_SUB :
         {
-            *sth_has_changed = true;
+            CalculateNeutralSub(tree, node);
+            break;  
+        }
+        case OP_MUL :
+        {
+            CalculateNeutralMul(tree, node);
+            break;
+        }
+        case OP_DIV :
+        {
+            CalculateNeutralDiv(tree, node);
+            break;  
+        }
+        case OP_POW :
+        {
+            CalculateNeutralPow(tree, node);
+            break;  
+        }
+        case OP_LN :
+        {
+            CalculateNeutralLn(tree, node);
+            break;
+        }
+        case OP_EXP :
+        {
+            CalculateNeutralExp(tree, node);
+            break;
+        }
+        default :
+        {
+            printf("Error in calculating neutrals : unknown value\nline = %d", __LINE__);
+            break;
         }
     }
 }
@@ -659,11 +1159,10 @@ void CalculateNeutralExp(DerTree* tree, DerNode* node)
 
 bool IsThereVariable(DerTree* tree, DerNode* node)
 {
-    if (node == tree->nil) return false;
-
-    if (node->type == TYPE_VAR) return true;
+    assert(tree);
+    assert(node);
 
-    if (IsThereVariable(tree, node->left)) return true;
+    RefreshNodeInfo(tree, node);
 
-    return IsThereVariable(tree, node->right);
+    return node->info & INFO_VARIABLES;
 }
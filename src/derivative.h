@@ -9,7 +9,8 @@
 
 typedef int ElemT;
 
-enum NodeType
+// One byte, so a node has room for the info below
+enum NodeType : unsigned char
 {
 	TYPE_NIL    = 0,
 	TYPE_CONST  = 1,
@@ -49,6 +50,8 @@ static const char* UNARY_OP[] = {"sin", "cos", "tan", "ctg", "sqrt", "ln", "exp"
 
 static const char* VARIABLES = "xy";
 
+const size_t NUM_VARIABLES = 2;
+
 enum NeutralElems
 {
 	ADD_NEUT = 0,
@@ -71,6 +74,18 @@ enum BreakElems
 	DIV_BREAK = 0
 };
 
+// Bits of DerNode::info, what a subtree contains
+enum NodeInfoBits
+{
+	INFO_X     = 1,
+	INFO_Y     = 2,
+	INFO_ERROR = 4,   // An error node or a constant that may fold into one
+
+	INFO_VARIABLES = INFO_X | INFO_Y
+};
+
+const size_t MAX_INFO_SIZE = 0xFFFF;
+
 union Value
 {
 	double number;
@@ -84,26 +99,277 @@ struct DerNode
 
 	NodeType type = TYPE_CONST;
 
+	// Of the whole subtree, set by RefreshNodeInfo when asked for and cleared up the parents by
+	// InvalidateNode when the subtree changes. A known node has only known nodes below it.
+	// size stops at MAX_INFO_SIZE, the thresholds that read it are far below.
+	// The fields fill the 7 bytes after type, a node takes 40 bytes as it did without them.
+	// Nodes come from the arena, which sets is_known, so the bit-fields have no initializers
+	unsigned char  info     : 7;
+	unsigned char  is_known : 1;
+	unsigned short size = 0;
+	unsigned int   hash = 0;
+
 	DerNode* left  = nullptr; 
 	DerNode* right = nullptr;
 
 	DerNode* parent = nullptr; 
 };
 
+const size_t NODE_BLOCK_SIZE = 1024;
+
+struct NodeBlock
+{
+	NodeBlock* next = nullptr;
+
+	DerNode nodes[NODE_BLOCK_SIZE];
+};
+
+struct NodeArena
+{
+	NodeBlock* blocks    = nullptr;
+	size_t     used      = 0;
+	DerNode*   free_list = nullptr;
+
+	NodeBlock* spare = nullptr;
+
+	size_t num_blocks = 0;
+	size_t num_allocs = 0;
+	size_t num_reused = 0;
+	size_t num_frees  = 0;
+
+	size_t num_live  = 0;
+	size_t peak_live = 0;
+};
+
+struct NodeTable
+{
+	DerNode** nodes = nullptr;
+
+	size_t size     = 0;
+	size_t capacity = 0;
+};
+
+struct NodeMap
+{
+	DerNode** keys   = nullptr;
+	DerNode** values = nullptr;
+
+	size_t size     = 0;
+	size_t capacity = 0;
+};
+
+// A class of equal subtrees, uses counts the places left after shared subtrees are printed once
+struct CseEntry
+{
+	DerNode* node = nullptr;
+	size_t   hash = 0;
+
+	size_t count = 0;
+	size_t uses  = 0;
+	size_t name  = 0;
+};
+
+struct CommonSubTrees
+{
+	CseEntry* entries = nullptr;
+
+	size_t size     = 0;
+	size_t capacity = 0;
+
+	// Nodes already counted, for DAGs only
+	NodeMap visited;
+
+	// Named subtrees in the order of their names, current is the definition being printed
+	DerNode** names          = nullptr;
+	size_t    num_names      = 0;
+	size_t    names_capacity = 0;
+
+	DerNode* current = nullptr;
+};
+
+// Cumulative over every simplification of the tree, visits counts nodes the rules were tried on
+struct SimplifyStats
+{
+	size_t passes   = 0;
+	size_t visits   = 0;
+	size_t rewrites = 0;
+};
+
+const size_t WALK_STACK_LOCAL = 64;
+
+// A frame of an explicit-stack walk, what link, slot and state mean is up to the walk.
+// No default values: the local frames of a WalkStack are written before they are read
+struct WalkFrame
+{
+	DerNode*  node;
+	DerNode*  link;
+	DerNode** slot;
+	int       state;
+};
+
+// Starts in local and moves to the heap only for deep trees, a walk over a small subtree does not malloc
+struct WalkStack
+{
+	WalkFrame* frames   = nullptr;
+	size_t     size     = 0;
+	size_t     capacity = 0;
+
+	WalkFrame local[WALK_STACK_LOCAL];
+};
+
+enum StatsPhase
+{
+	PHASE_GET_TREE   = 0,
+	PHASE_DERIVATIVE = 1,
+	PHASE_SIMPLIFY   = 2,
+	PHASE_PRINT      = 3,
+	PHASE_DUMP       = 4,
+	PHASE_STORE      = 5,
+
+	NUM_PHASES = 6
+};
+
+// live_nodes is taken when the phase ends, a derivative contains the simplifications recorded before it
+struct PhaseEvent
+{
+	StatsPhase phase = PHASE_GET_TREE;
+
+	double ms         = 0;
+	size_t live_nodes = 0;
+};
+
+struct TreeStats
+{
+	PhaseEvent* events = nullptr;
+
+	size_t size     = 0;
+	size_t capacity = 0;
+};
+
+const unsigned int COMPACT_NIL = 0xFFFFFFFF;
+
+// Structure of arrays in post-order, children come before their parent and the root is the last node.
+// kinds holds the NodeType in the high half and the operation in the low one, values the index of a
+// constant in consts or the number of a variable. 13 bytes per node and 8 per constant, a DerNode takes 40
+struct CompactTree
+{
+	unsigned char* kinds  = nullptr;
+	unsigned int*  values = nullptr;
+	unsigned int*  left   = nullptr;
+	unsigned int*  right  = nullptr;
+
+	size_t size     = 0;
+	size_t capacity = 0;
+
+	double* consts          = nullptr;
+	size_t  num_consts      = 0;
+	size_t  consts_capacity = 0;
+
+	unsigned int root = COMPACT_NIL;
+};
+
+// Forward-over-reverse over a compact copy made once, every array has one number per node.
+// EvalHessian may be called for any number of points, nothing is allocated there
+struct Hessian
+{
+	CompactTree compact;
+
+	double* values       = nullptr;
+	double* dots         = nullptr;
+	double* adjoints     = nullptr;
+	double* adjoint_dots = nullptr;
+};
+
+// Text built in memory and written out at once, data ends with a zero
+struct StrBuf
+{
+	char*  data     = nullptr;
+	size_t size     = 0;
+	size_t capacity = 0;
+};
+
+// What a dump leaves out of a big tree, 0 is no limit. A compact dump labels a node with its value only
+struct DumpOptions
+{
+	size_t max_depth     = 0;
+	size_t collapse_size = 0;
+	bool   is_compact    = false;
+};
+
+// What a stored file holds, STORE_TREE is one tree and the others are the input followed by the results
+enum StoreTask
+{
+	STORE_TREE       = 0,
+	STORE_DERIVATIVE = 1,
+	STORE_TAYLOR     = 2,
+	STORE_GRADIENT   = 3
+};
+
+const size_t STORE_PATH_LEN = 128;
+
+// The input with the operands of + and * in order, in the binary format, and the file it names. Made by LoadStoredResult
+struct StoreKey
+{
+	StrBuf    input;
+	StoreTask task  = STORE_TREE;
+	size_t    order = 0;
+
+	char name[STORE_PATH_LEN] = "";
+};
+
 struct DerTree
 {
 	DerNode* root = nullptr;
 
 	DerNode* nil = nullptr;
+
+	NodeArena arena;
+
+	bool      is_dag = false;
+	NodeTable table;
+
+	NodeMap* derivative_memo = nullptr;
+	NodeMap* simplify_memo   = nullptr;
+	NodeMap* canonical_memo  = nullptr;
+	NodeMap* canonical_uses  = nullptr;
+
+	CommonSubTrees* cse = nullptr;
+
+	SimplifyStats simplify_stats;
+	TreeStats*    stats = nullptr;
 };
 
 
+DerTree* NewTree                ();
 DerTree* GetTree                (const int argc, char* argv[]);
 DerTree* CopyTree               (DerTree* tree);
 DerNode* CopySubTree            (DerTree* tree, DerNode* node);
-DerNode* ConstructNode          (NodeType type, Value value, DerNode* left, DerNode* right);
+DerNode* CopyNodes              (DerTree* dest, DerTree* src, DerNode* node);
+DerNode* CopySharedNodes        (DerTree* dest, DerTree* src, DerNode* node, NodeMap* copies);
+DerNode* NewNode                (DerTree* tree);
+DerNode* ConstructNode          (DerTree* tree, NodeType type, Value value, DerNode* left, DerNode* right);
+DerNode* ArenaAlloc             (NodeArena* arena);
+void     ArenaFree              (NodeArena* arena, DerNode* node);
+void     ArenaRelease           (NodeArena* arena);
+void     ArenaRecycle           (NodeArena* arena);
+DerNode* InternNode             (DerTree* tree, NodeType type, Value value, DerNode* left, DerNode* right);
+void     MakeDag                (DerTree* tree);
+size_t   CountNodes             (DerTree* tree);
+size_t   HashNodeValue          (NodeType type, Value value);
+DerNode* NodeMapGet             (NodeMap* map, DerNode* key);
+void     NodeMapSet             (NodeMap* map, DerNode* key, DerNode* value);
+void     NodeMapDestruct        (NodeMap* map);
+void     SetNils                (DerTree* tree, DerNode* node);
+void     GrowWalkStack          (WalkStack* stack);
 void     TreeDump               (DerTree* tree);
+void     TreeDumpWith           (DerTree* tree, const DumpOptions* options);
+void     DumpNodes              (DerTree* tree, const DumpOptions* options, StrBuf* dump);
+void     StrBufPrintf           (StrBuf* buf, const char* format, ...);
+void     StrBufAppend           (StrBuf* buf, const char* text, size_t size);
+void     StrBufDestruct         (StrBuf* buf);
 void     PrintExpression        (DerTree* tree);
+void     PrintFormula           (DerTree* tree, FILE* file);
+void     EmitTex                (DerTree* tree, DerNode* node, size_t line_len, StrBuf* tex);
 void     Destruct               (DerTree* tree);
 void     DestructNode           (DerTree* tree, DerNode* node);
 void     DestructNodes          (DerTree* tree, DerNode* node);
@@ -111,3 +377,99 @@ void     KillChildren           (DerTree* tree, DerNode* node);
 void     KillYourselfAndChildren(DerTree* tree, DerNode* node, ElemT new_value);
 void     KillFatherAndBrother   (DerTree* tree, DerNode* node);
 void     Delete                 (DerTree* tree);
+
+void     Simplify               (DerTree* tree);
+void     SimplifyByPasses       (DerTree* tree);
+DerNode* SimplifyFrom           (DerTree* tree, DerNode* node);
+void     Canonicalize           (DerTree* tree);
+int      CompareSubTrees        (DerNode* first, DerNode* second);
+void     TakeDerivative         (DerTree* tree);
+void     TakeNthDerivative      (DerTree* tree, size_t order);
+void     Taylor                 (DerTree* tree, size_t order);
+DerTree* TaylorTree             (DerTree* tree, size_t order);
+DerNode* AddTaylorTerm          (DerTree* tree, size_t power, double factorial, double coefficient);
+double*  TaylorCoefficients     (DerTree* tree, size_t order, double point);
+void     TaylorAD               (DerTree* tree, size_t order);
+DerTree* TaylorADTree           (DerTree* tree, size_t order);
+void     SetParents             (DerTree* tree);
+void     SubstituteX            (DerTree* tree, double value);
+bool     IsThereVariable        (DerTree* tree, DerNode* node);
+
+// Inline because every walk, even over three nodes, goes through them, the heap is only touched by GrowWalkStack
+inline void InitWalkStack(WalkStack* stack)
+{
+	stack->frames   = stack->local;
+	stack->size     = 0;
+	stack->capacity = WALK_STACK_LOCAL;
+}
+
+inline void DestructWalkStack(WalkStack* stack)
+{
+	if (stack->frames != stack->local) free(stack->frames);
+
+	stack->frames   = nullptr;
+	stack->size     = 0;
+	stack->capacity = 0;
+}
+
+inline void PushFrame(WalkStack* stack, DerNode* node, DerNode* link, DerNode** slot, int state)
+{
+	if (stack->size == stack->capacity) GrowWalkStack(stack);
+
+	WalkFrame* frame = &stack->frames[stack->size++];
+
+	frame->node  = node;
+	frame->link  = link;
+	frame->slot  = slot;
+	frame->state = state;
+}
+
+DerNode* Derivative             (DerTree* tree, DerNode* node);
+DerNode* DerivativeNode         (DerTree* tree, DerNode* node, DerNode* d_left, DerNode* d_right);
+size_t   SubTreeHash            (DerTree* tree, DerNode* node, size_t* size);
+bool     IsSameSubTree          (DerTree* tree, DerNode* first, DerNode* second);
+void     SetNodeInfo            (DerTree* tree, DerNode* node);
+void     RefreshNodeInfo        (DerTree* tree, DerNode* node);
+void     InvalidateNode         (DerTree* tree, DerNode* node);
+
+void     FindCommonSubTrees     (DerTree* tree, CommonSubTrees* cse);
+void     DestructCommonSubTrees (CommonSubTrees* cse);
+size_t   CseName                (DerTree* tree, DerNode* node);
+void     PrintSharedFormula     (DerTree* tree, FILE* file);
+
+void     EnableStats            ();
+bool     IsStatsEnabled         ();
+double   StatsClock             ();
+void     StatsRecord            (DerTree* tree, StatsPhase phase, double start);
+void     FoldTreeStats          (DerTree* tree);
+void     PrintStatsJson         (DerTree* tree, FILE* file);
+bool     WriteStats             (DerTree* tree, const char* name);
+
+void          DestructCompact   (CompactTree* compact);
+void          BuildCompact      (DerTree* tree, CompactTree* compact);
+NodeType      CompactType       (unsigned char kind);
+int           CompactOp         (unsigned char kind);
+DerNode*      NodesFromCompact  (DerTree* tree, const CompactTree* compact);
+void          RelayoutTree      (DerTree* tree);
+unsigned int* CompactParents    (const CompactTree* compact);
+double        EvalCompact       (const CompactTree* compact, double* values, double x, double y);
+size_t        CompactBytes      (const CompactTree* compact);
+
+bool     SaveTreeFile           (DerTree* tree, const char* name);
+DerTree* LoadTreeFile           (const char* name);
+bool     LoadStoredResult       (DerTree* tree, StoreTask task, size_t order, StoreKey* key, DerTree** results, size_t num_results);
+void     SaveStoredResult       (const StoreKey* key, DerTree** results, size_t num_results);
+void     DestructStoreKey       (StoreKey* key);
+
+double   GradientCompact        (const CompactTree* compact, double* values, double* adjoints, double x, double y, double* gradient);
+void     GradientTrees          (DerTree* tree, DerTree** gradient);
+Hessian* CompileHessian         (DerTree* tree);
+void     DestructHessian        (Hessian* hessian);
+double   EvalHessian            (Hessian* hessian, double x, double y, double* gradient, double* matrix);
+
+void     SimplifyDag            (DerTree* tree);
+DerNode* SimplifyNodeDag        (DerTree* tree, DerNode* node, NodeMap* simplified);
+DerNode* SimplifyShared         (DerTree* tree, DerNode* node);
+void     SubstituteXDag         (DerTree* tree, double value);
+bool     FoldBinOP              (int op, double left, double right, double* result);
+bool     FoldUnOP               (int op, double right, double* result);
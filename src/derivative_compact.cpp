@@ -0,0 +1,328 @@
+#include "derivative.h"
+
+
+const size_t COMPACT_START_CAPACITY = 64;
+
+/////////////////////////////////
+//Compact trees
+/////////////////////////////////
+void          DestructCompact  (CompactTree* compact);
+void          BuildCompact     (DerTree* tree, CompactTree* compact);
+unsigned int  CompactEmit      (CompactTree* compact, DerNode* node, unsigned int left, unsigned int right);
+unsigned int  CompactAddConst  (CompactTree* compact, double value);
+NodeType      CompactType      (unsigned char kind);
+int           CompactOp        (unsigned char kind);
+DerNode*      NodesFromCompact (DerTree* tree, const CompactTree* compact);
+void          RelayoutTree     (DerTree* tree);
+unsigned int* CompactParents   (const CompactTree* compact);
+double        EvalCompact      (const CompactTree* compact, double* values, double x, double y);
+size_t        CompactBytes     (const CompactTree* compact);
+
+
+void DestructCompact(CompactTree* compact)
+{
+    assert(compact);
+
+    free(compact->kinds);
+    free(compact->values);
+    free(compact->left);
+    free(compact->right);
+    free(compact->consts);
+
+    *compact = {};
+}
+
+// Post-order on an explicit stack, the indices of finished children wait on indices.
+// A shared DAG node is written once and every parent gets the same index
+void BuildCompact(DerTree* tree, CompactTree* compact)
+{
+    assert(tree);
+    assert(compact);
+
+    compact->size       = 0;
+    compact->num_consts = 0;
+    compact->root       = COMPACT_NIL;
+
+    if (tree->root == nullptr || tree->root == tree->nil) return;
+
+    NodeMap   written = {};
+    WalkStack stack;
+    InitWalkStack(&stack);
+
+    unsigned int* indices          = nullptr;
+    size_t        num_indices      = 0;
+    size_t        indices_capacity = 0;
+
+    PushFrame(&stack, tree->root, nullptr, nullptr, 0);
+
+    while (stack.size > 0)
+    {
+        WalkFrame frame = stack.frames[--stack.size];
+        DerNode*  node  = frame.node;
+
+        unsigned int index = COMPACT_NIL;
+
+        if (frame.state == 0)
+        {
+            DerNode* known = tree->is_dag ? NodeMapGet(&written, node) : nullptr;
+
+            if (known == nullptr)
+            {
+                PushFrame(&stack, node, nullptr, nullptr, 1);
+                if (node->right != tree->nil) PushFrame(&stack, node->right, nullptr, nullptr, 0);
+                if (node->left  != tree->nil) PushFrame(&stack, node->left,  nullptr, nullptr, 0);
+
+                continue;
+            }
+
+            // The map keeps index + 1, a null value means not written
+            index = (unsigned int)((size_t)known - 1);
+        }
+        else
+        {
+            unsigned int right = (node->right != tree->nil) ? indices[--num_indices] : COMPACT_NIL;
+            unsigned int left  = (node->left  != tree->nil) ? indices[--num_indices] : COMPACT_NIL;
+
+            index = CompactEmit(compact, node, left, right);
+
+            if (tree->is_dag) NodeMapSet(&written, node, (DerNode*)((size_t)index + 1));
+        }
+
+        if (num_indices == indices_capacity)
+        {
+            indices_capacity = (indices_capacity == 0) ? COMPACT_START_CAPACITY : 2 * indices_capacity;
+
+            indices = (unsigned int*)realloc(indices, indices_capacity * sizeof(unsigned int));
+            assert(indices);
+        }
+
+        indices[num_indices++] = index;
+    }
+
+    compact->root = indices[0];
+
+    free(indices);
+    DestructWalkStack(&stack);
+    NodeMapDestruct(&written);
+}
+
+unsigned int CompactEmit(CompactTree* compact, DerNode* node, unsigned int left, unsigned int right)
+{
+    assert(compact);
+    assert(node);
+
+    if (compact->size == compact->capacity)
+    {
+        compact->capacity = (compact->capacity == 0) ? COMPACT_START_CAPACITY : 2 * compact->capacity;
+
+        compact->kinds  = (unsigned char*)realloc(compact->kinds,  compact->capacity * sizeof(unsigned char));
+        compact->values = (unsigned int*) realloc(compact->values, compact->capacity * sizeof(unsigned int));
+        compact->left   = (unsigned int*) realloc(compact->left,   compact->capacity * sizeof(unsigned int));
+        compact->right  = (unsigned int*) realloc(compact->right,  compact->capacity * sizeof(unsigned int));
+        assert(compact->kinds);
+        assert(compact->values);
+        assert(compact->left);
+        assert(compact->right);
+    }
+
+    assert(compact->size < COMPACT_NIL);
+
+    unsigned int  value = 0;
+    unsigned char kind  = (unsigned char)(node->type << 4);
+
+    if (node->type == TYPE_CONST || node->type == NODE_ERROR)
+    {
+        value = CompactAddConst(compact, node->value.number);
+    }
+    else if (node->type == TYPE_VAR)
+    {
+        const char* slot = strchr(VARIABLES, node->value.var);
+        assert(slot);
+
+        value = (unsigned int)(slot - VARIABLES);
+    }
+    else
+    {
+        kind = (unsigned char)(kind | node->value.op);
+    }
+
+    size_t index = compact->size++;
+
+    compact->kinds[index]  = kind;
+    compact->values[index] = value;
+    compact->left[index]   = left;
+    compact->right[index]  = right;
+
+    return (unsigned int)index;
+}
+
+unsigned int CompactAddConst(CompactTree* compact, double value)
+{
+    assert(compact);
+
+    if (compact->num_consts == compact->consts_capacity)
+    {
+        compact->consts_capacity = (compact->consts_capacity == 0) ? COMPACT_START_CAPACITY : 2 * compact->consts_capacity;
+
+        compact->consts = (double*)realloc(compact->consts, compact->consts_capacity * sizeof(double));
+        assert(compact->consts);
+    }
+
+    compact->consts[compact->num_consts] = value;
+
+    return (unsigned int)compact->num_consts++;
+}
+
+NodeType CompactType(unsigned char kind)
+{
+    return (NodeType)(kind >> 4);
+}
+
+int CompactOp(unsigned char kind)
+{
+    return kind & 0x0F;
+}
+
+// One scan, the children of a node are made before it. The nodes end up in the arena in the same order
+DerNode* NodesFromCompact(DerTree* tree, const CompactTree* compact)
+{
+    assert(tree);
+    assert(compact);
+
+    if (compact->root == COMPACT_NIL) return tree->nil;
+
+    DerNode** nodes = (DerNode**)calloc(compact->size, sizeof(DerNode*));
+    assert(nodes);
+
+    for (size_t i = 0; i < compact->size; ++i)
+    {
+        NodeType type  = CompactType(compact->kinds[i]);
+        Value    value = {};
+
+        if (type == TYPE_CONST || type == NODE_ERROR)
+        {
+            value.number = compact->consts[compact->values[i]];
+        }
+        else if (type == TYPE_VAR)
+        {
+            value.var = VARIABLES[compact->values[i]];
+        }
+        else
+        {
+            value.op = CompactOp(compact->kinds[i]);
+        }
+
+        DerNode* left  = (compact->left[i]  != COMPACT_NIL) ? nodes[compact->left[i]]  : tree->nil;
+        DerNode* right = (compact->right[i] != COMPACT_NIL) ? nodes[compact->right[i]] : tree->nil;
+
+        DerNode* node = ConstructNode(tree, type, value, left, right);
+        nodes[i]      = node;
+
+        if (!tree->is_dag)
+        {
+            node->parent = tree->nil;
+
+            if (left  != tree->nil) left->parent  = node;
+            if (right != tree->nil) right->parent = node;
+        }
+    }
+
+    DerNode* root = nodes[compact->root];
+
+    free(nodes);
+
+    return root;
+}
+
+// Rebuilds the nodes in depth-first order through a compact copy that is freed at once, so walks over
+// the tree go through the arena in order instead of jumping between blocks freed and reused by the rules.
+// The DAG table holds node pointers, a DAG keeps its nodes where they are
+void RelayoutTree(DerTree* tree)
+{
+    assert(tree);
+
+    if (tree->is_dag) return;
+
+    CompactTree compact = {};
+    BuildCompact(tree, &compact);
+
+    ArenaRecycle(&tree->arena);
+
+    tree->root = NodesFromCompact(tree, &compact);
+
+    DestructCompact(&compact);
+}
+
+// Parents are not stored, a shared DAG node gets the last of its parents. The caller frees the array
+unsigned int* CompactParents(const CompactTree* compact)
+{
+    assert(compact);
+
+    unsigned int* parents = (unsigned int*)calloc(compact->size + 1, sizeof(unsigned int));
+    assert(parents);
+
+    for (size_t i = 0; i < compact->size; ++i)
+    {
+        parents[i] = COMPACT_NIL;
+    }
+
+    for (size_t i = 0; i < compact->size; ++i)
+    {
+        if (compact->left[i]  != COMPACT_NIL) parents[compact->left[i]]  = (unsigned int)i;
+        if (compact->right[i] != COMPACT_NIL) parents[compact->right[i]] = (unsigned int)i;
+    }
+
+    return parents;
+}
+
+// values must hold compact->size numbers, the value of every node is left in it
+double EvalCompact(const CompactTree* compact, double* values, double x, double y)
+{
+    assert(compact);
+    assert(values);
+
+    if (compact->root == COMPACT_NIL) return NAN;
+
+    const double variables[] = {x, y};
+
+    const unsigned char* kinds  = compact->kinds;
+    const unsigned int*  left   = compact->left;
+    const unsigned int*  right  = compact->right;
+    const unsigned int*  pool   = compact->values;
+    const double*        consts = compact->consts;
+
+    // The children are read only by the operations that have them, a leaf keeps COMPACT_NIL there
+    for (size_t i = 0, size = compact->size; i < size; ++i)
+    {
+        switch (kinds[i])
+        {
+            case TYPE_CONST << 4 : values[i] = consts[pool[i]];    break;
+            case TYPE_VAR   << 4 : values[i] = variables[pool[i]]; break;
+
+            case TYPE_BIN_OP << 4 | OP_ADD : values[i] = values[left[i]] + values[right[i]];     break;
+            case TYPE_BIN_OP << 4 | OP_SUB : values[i] = values[left[i]] - values[right[i]];     break;
+            case TYPE_BIN_OP << 4 | OP_MUL : values[i] = values[left[i]] * values[right[i]];     break;
+            case TYPE_BIN_OP << 4 | OP_DIV : values[i] = values[left[i]] / values[right[i]];     break;
+            case TYPE_BIN_OP << 4 | OP_POW : values[i] = pow(values[left[i]], values[right[i]]); break;
+
+            case TYPE_UN_OP << 4 | OP_SIN  : values[i] = sin(values[right[i]]);     break;
+            case TYPE_UN_OP << 4 | OP_COS  : values[i] = cos(values[right[i]]);     break;
+            case TYPE_UN_OP << 4 | OP_TAN  : values[i] = tan(values[right[i]]);     break;
+            case TYPE_UN_OP << 4 | OP_CTG  : values[i] = 1 / tan(values[right[i]]); break;
+            case TYPE_UN_OP << 4 | OP_SQRT : values[i] = sqrt(values[right[i]]);    break;
+            case TYPE_UN_OP << 4 | OP_LN   : values[i] = log(values[right[i]]);     break;
+            case TYPE_UN_OP << 4 | OP_EXP  : values[i] = exp(values[right[i]]);     break;
+
+            default : values[i] = NAN; break;
+        }
+    }
+
+    return values[compact->root];
+}
+
+size_t CompactBytes(const CompactTree* compact)
+{
+    assert(compact);
+
+    return compact->size * (sizeof(unsigned char) + 3 * sizeof(unsigned int)) + compact->num_consts * sizeof(double);
+}
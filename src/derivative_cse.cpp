@@ -0,0 +1,246 @@
+#include "derivative.h"
+
+
+const size_t CSE_MIN_SUBTREE_SIZE = 10;
+const size_t CSE_START_CAPACITY   = 256;
+
+// pdflatex reads the source line by line, a huge formula is broken after an operator once its line is this long
+const size_t CSE_TEX_LINE_LEN = 100;
+
+/////////////////////////////////
+//Common subexpressions
+/////////////////////////////////
+void      FindCommonSubTrees    (DerTree* tree, CommonSubTrees* cse);
+void      CountSubTrees         (DerTree* tree, DerNode* node, CommonSubTrees* cse);
+void      CountUses             (DerTree* tree, DerNode* node, CommonSubTrees* cse);
+CseEntry* FindCseEntry          (DerTree* tree, CommonSubTrees* cse, DerNode* node, bool is_inserted);
+void      GrowCommonSubTrees    (CommonSubTrees* cse);
+void      DestructCommonSubTrees(CommonSubTrees* cse);
+size_t    CseName               (DerTree* tree, DerNode* node);
+void      PrintSharedFormula    (DerTree* tree, FILE* file);
+
+
+// Counts every class of equal subtrees, then how often each is printed when repeated ones are printed once
+void FindCommonSubTrees(DerTree* tree, CommonSubTrees* cse)
+{
+    assert(tree);
+    assert(cse);
+
+    CountSubTrees(tree, tree->root, cse);
+    CountUses    (tree, tree->root, cse);
+}
+
+void CountSubTrees(DerTree* tree, DerNode* node, CommonSubTrees* cse)
+{
+    assert(tree);
+    assert(node);
+    assert(cse);
+
+    WalkStack stack;
+    InitWalkStack(&stack);
+
+    PushFrame(&stack, node, nullptr, nullptr, 0);
+
+    while (stack.size > 0)
+    {
+        node = stack.frames[--stack.size].node;
+
+        if (node == tree->nil) continue;
+
+        // A shared DAG node counts once per parent, what is inside it only once
+        if (!tree->is_dag || NodeMapGet(&cse->visited, node) == nullptr)
+        {
+            if (tree->is_dag) NodeMapSet(&cse->visited, node, node);
+
+            PushFrame(&stack, node->right, nullptr, nullptr, 0);
+            PushFrame(&stack, node->left,  nullptr, nullptr, 0);
+        }
+
+        size_t size = 0;
+        SubTreeHash(tree, node, &size);
+
+        if (size < CSE_MIN_SUBTREE_SIZE) continue;
+
+        FindCseEntry(tree, cse, node, true)->count++;
+    }
+
+    DestructWalkStack(&stack);
+}
+
+// A repeated subtree is walked on its first use only, what it contains is printed once with it
+void CountUses(DerTree* tree, DerNode* node, CommonSubTrees* cse)
+{
+    assert(tree);
+    assert(node);
+    assert(cse);
+
+    WalkStack stack;
+    InitWalkStack(&stack);
+
+    PushFrame(&stack, node, nullptr, nullptr, 0);
+
+    while (stack.size > 0)
+    {
+        node = stack.frames[--stack.size].node;
+
+        if (node == tree->nil) continue;
+
+        CseEntry* entry = FindCseEntry(tree, cse, node, false);
+
+        if (entry != nullptr && entry->count > 1)
+        {
+            entry->uses++;
+            if (entry->uses > 1) continue;
+        }
+
+        PushFrame(&stack, node->right, nullptr, nullptr, 0);
+        PushFrame(&stack, node->left,  nullptr, nullptr, 0);
+    }
+
+    DestructWalkStack(&stack);
+}
+
+CseEntry* FindCseEntry(DerTree* tree, CommonSubTrees* cse, DerNode* node, bool is_inserted)
+{
+    assert(tree);
+    assert(cse);
+    assert(node);
+
+    size_t size = 0;
+    size_t hash = SubTreeHash(tree, node, &size);
+
+    if (size < CSE_MIN_SUBTREE_SIZE) return nullptr;
+
+    if (is_inserted && 2 * (cse->size + 1) > cse->capacity)
+    {
+        GrowCommonSubTrees(cse);
+    }
+
+    if (cse->capacity == 0) return nullptr;
+
+    size_t mask = cse->capacity - 1;
+    size_t i    = hash & mask;
+
+    for (; cse->entries[i].node != nullptr; i = (i + 1) & mask)
+    {
+        if (cse->entries[i].hash == hash && IsSameSubTree(tree, cse->entries[i].node, node))
+        {
+            return &cse->entries[i];
+        }
+    }
+
+    if (!is_inserted) return nullptr;
+
+    cse->entries[i].node = node;
+    cse->entries[i].hash = hash;
+    cse->size++;
+
+    return &cse->entries[i];
+}
+
+void GrowCommonSubTrees(CommonSubTrees* cse)
+{
+    assert(cse);
+
+    size_t    old_capacity = cse->capacity;
+    CseEntry* old_entries  = cse->entries;
+
+    cse->capacity = (old_capacity == 0) ? CSE_START_CAPACITY : 2 * old_capacity;
+    cse->entries  = (CseEntry*)calloc(cse->capacity, sizeof(CseEntry));
+    assert(cse->entries);
+
+    size_t mask = cse->capacity - 1;
+
+    for (size_t j = 0; j < old_capacity; ++j)
+    {
+        if (old_entries[j].node == nullptr) continue;
+
+        size_t i = old_entries[j].hash & mask;
+        while (cse->entries[i].node != nullptr)
+        {
+            i = (i + 1) & mask;
+        }
+
+        cse->entries[i] = old_entries[j];
+    }
+
+    free(old_entries);
+}
+
+void DestructCommonSubTrees(CommonSubTrees* cse)
+{
+    assert(cse);
+
+    free(cse->entries);
+    free(cse->names);
+    NodeMapDestruct(&cse->visited);
+
+    *cse = {};
+}
+
+// The number of the auxiliary variable printed instead of the node, 0 when the node is printed itself
+size_t CseName(DerTree* tree, DerNode* node)
+{
+    assert(tree);
+    assert(tree->cse);
+    assert(node);
+
+    CommonSubTrees* cse = tree->cse;
+
+    if (node == cse->current) return 0;
+
+    CseEntry* entry = FindCseEntry(tree, cse, node, false);
+
+    if (entry == nullptr || entry->uses < 2) return 0;
+
+    if (entry->name == 0)
+    {
+        if (cse->num_names == cse->names_capacity)
+        {
+            cse->names_capacity = (cse->names_capacity == 0) ? 16 : 2 * cse->names_capacity;
+
+            cse->names = (DerNode**)realloc(cse->names, cse->names_capacity * sizeof(DerNode*));
+            assert(cse->names);
+        }
+
+        cse->names[cse->num_names++] = entry->node;
+        entry->name = cse->num_names;
+    }
+
+    return entry->name;
+}
+
+// The formula in $...$ and then u_k = ... for every repeated subtree, a definition may name later ones
+void PrintSharedFormula(DerTree* tree, FILE* file)
+{
+    assert(tree);
+    assert(file);
+
+    CommonSubTrees cse = {};
+    FindCommonSubTrees(tree, &cse);
+
+    tree->cse = &cse;
+
+    StrBuf tex = {};
+
+    StrBufAppend(&tex, "$", 1);
+    EmitTex(tree, tree->root, CSE_TEX_LINE_LEN, &tex);
+    StrBufAppend(&tex, "$\n", 2);
+
+    for (size_t i = 0; i < cse.num_names; ++i)
+    {
+        cse.current = cse.names[i];
+
+        StrBufPrintf(&tex, "\n$u_{%zu} = ", i + 1);
+        EmitTex(tree, cse.current, CSE_TEX_LINE_LEN, &tex);
+        StrBufAppend(&tex, "$\n", 2);
+    }
+
+    tree->cse = nullptr;
+
+    fwrite(tex.data, sizeof(char), tex.size, file);
+
+    StrBufDestruct(&tex);
+
+    DestructCommonSubTrees(&cse);
+}
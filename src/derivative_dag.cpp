@@ -0,0 +1,255 @@
+#include "derivative.h"
+
+
+/////////////////////////////////
+//Passes over hash-consed trees
+/////////////////////////////////
+void     SimplifyDag          (DerTree* tree);
+DerNode* SimplifyShared       (DerTree* tree, DerNode* node);
+DerNode* SimplifyNodeDag      (DerTree* tree, DerNode* node, NodeMap* simplified);
+DerNode* SimplifyBinOPDag     (DerTree* tree, DerNode* node, DerNode* left, DerNode* right);
+DerNode* SimplifyUnOPDag      (DerTree* tree, DerNode* node, DerNode* right);
+void     SubstituteXDag       (DerTree* tree, double value);
+DerNode* SubstituteNodeDag    (DerTree* tree, DerNode* node, double value, NodeMap* substituted);
+bool     IsConstEqual         (DerNode* node, double value);
+
+
+#define CONST(NUM) ConstructNode(tree, TYPE_CONST, { .number = NUM }, tree->nil, tree->nil)
+
+void SimplifyDag(DerTree* tree)
+{
+    assert(tree);
+    assert(tree->is_dag);
+
+    tree->root = SimplifyShared(tree, tree->root);
+}
+
+DerNode* SimplifyShared(DerTree* tree, DerNode* node)
+{
+    assert(tree);
+    assert(node);
+    assert(tree->is_dag);
+
+    // Interned nodes never change, so what was simplified once stays simplified
+    if (tree->simplify_memo == nullptr)
+    {
+        tree->simplify_memo = (NodeMap*)calloc(1, sizeof(NodeMap));
+        assert(tree->simplify_memo);
+    }
+
+    return SimplifyNodeDag(tree, node, tree->simplify_memo);
+}
+
+// Children before their parent on an explicit stack, every finished node goes onto values
+DerNode* SimplifyNodeDag(DerTree* tree, DerNode* node, NodeMap* simplified)
+{
+    assert(tree);
+    assert(node);
+    assert(simplified);
+
+    if (node == tree->nil) return node;
+
+    WalkStack stack;
+    WalkStack values;
+    InitWalkStack(&stack);
+    InitWalkStack(&values);
+
+    PushFrame(&stack, node, nullptr, nullptr, 0);
+
+    while (stack.size > 0)
+    {
+        WalkFrame frame = stack.frames[--stack.size];
+        node            = frame.node;
+
+        if (frame.state == 0)
+        {
+            DerNode* result = NodeMapGet(simplified, node);
+
+            if (result != nullptr)
+            {
+                PushFrame(&values, result, nullptr, nullptr, 0);
+                continue;
+            }
+
+            PushFrame(&stack, node, nullptr, nullptr, 1);
+            if (node->right != tree->nil) PushFrame(&stack, node->right, nullptr, nullptr, 0);
+            if (node->left  != tree->nil) PushFrame(&stack, node->left,  nullptr, nullptr, 0);
+            continue;
+        }
+
+        DerNode* right = (node->right != tree->nil) ? values.frames[--values.size].node : tree->nil;
+        DerNode* left  = (node->left  != tree->nil) ? values.frames[--values.size].node : tree->nil;
+
+        DerNode* result = node;
+
+        if      (node->type == TYPE_BIN_OP) result = SimplifyBinOPDag(tree, node, left, right);
+        else if (node->type == TYPE_UN_OP)  result = SimplifyUnOPDag (tree, node, right);
+
+        NodeMapSet(simplified, node, result);
+        PushFrame(&values, result, nullptr, nullptr, 0);
+    }
+
+    DerNode* result = values.frames[0].node;
+
+    DestructWalkStack(&stack);
+    DestructWalkStack(&values);
+
+    return result;
+}
+
+DerNode* SimplifyBinOPDag(DerTree* tree, DerNode* node, DerNode* left, DerNode* right)
+{
+    assert(tree);
+    assert(node);
+
+    if (left->type == TYPE_CONST && right->type == TYPE_CONST)
+    {
+        double value = 0;
+
+        if (FoldBinOP(node->value.op, left->value.number, right->value.number, &value))
+        {
+            return CONST(value);
+        }
+
+        return ConstructNode(tree, NODE_ERROR, { .number = 0 }, tree->nil, tree->nil);
+    }
+
+    switch (node->value.op)
+    {
+        case OP_ADD :
+        {
+            if (IsConstEqual(right, ADD_NEUT)) return left;
+            if (IsConstEqual(left,  ADD_NEUT)) return right;
+            break;
+        }
+        case OP_SUB :
+        {
+            if (IsConstEqual(right, SUB_NEUT)) return left;
+            break;
+        }
+        case OP_MUL :
+        {
+            if (IsConstEqual(right, MUL_NULL) || IsConstEqual(left, MUL_NULL)) return CONST(MUL_NULL);
+            if (IsConstEqual(right, MUL_NEUT)) return left;
+            if (IsConstEqual(left,  MUL_NEUT)) return right;
+            break;
+        }
+        case OP_DIV :
+        {
+            if (IsConstEqual(left,  DIV_NULL)) return CONST(DIV_NULL);
+            if (IsConstEqual(right, DIV_NEUT)) return left;
+            break;
+        }
+        case OP_POW :
+        {
+            if (IsConstEqual(right, POW_NULL)) return CONST(POW_NEUT);
+            if (IsConstEqual(right, POW_NEUT)) return left;
+            if (IsConstEqual(left,  POW_NULL)) return CONST(POW_NULL);
+            if (IsConstEqual(left,  POW_NEUT)) return CONST(POW_NEUT);
+            break;
+        }
+        default :
+        {
+            printf("Error in calculating neutrals : unknown value\nline = %d", __LINE__);
+            break;
+        }
+    }
+
+    return ConstructNode(tree, TYPE_BIN_OP, node->value, left, right);
+}
+
+DerNode* SimplifyUnOPDag(DerTree* tree, DerNode* node, DerNode* right)
+{
+    assert(tree);
+    assert(node);
+
+    if (right->type == TYPE_CONST)
+    {
+        double value = 0;
+
+        if (FoldUnOP(node->value.op, right->value.number, &value))
+        {
+            return CONST(value);
+        }
+
+        return ConstructNode(tree, NODE_ERROR, { .number = 0 }, tree->nil, tree->nil);
+    }
+
+    return ConstructNode(tree, TYPE_UN_OP, node->value, tree->nil, right);
+}
+
+void SubstituteXDag(DerTree* tree, double value)
+{
+    assert(tree);
+    assert(tree->is_dag);
+
+    NodeMap substituted = {};
+    tree->root = SubstituteNodeDag(tree, tree->root, value, &substituted);
+    NodeMapDestruct(&substituted);
+}
+
+// Same walk as SimplifyNodeDag
+DerNode* SubstituteNodeDag(DerTree* tree, DerNode* node, double value, NodeMap* substituted)
+{
+    assert(tree);
+    assert(node);
+    assert(substituted);
+
+    if (node == tree->nil) return node;
+
+    WalkStack stack;
+    WalkStack values;
+    InitWalkStack(&stack);
+    InitWalkStack(&values);
+
+    PushFrame(&stack, node, nullptr, nullptr, 0);
+
+    while (stack.size > 0)
+    {
+        WalkFrame frame = stack.frames[--stack.size];
+        node            = frame.node;
+
+        if (frame.state == 0)
+        {
+            DerNode* result = nullptr;
+
+            if (node->type == TYPE_VAR) result = (node->value.var == 'x') ? CONST(value) : node;
+            else                        result = NodeMapGet(substituted, node);
+
+            if (result != nullptr)
+            {
+                PushFrame(&values, result, nullptr, nullptr, 0);
+                continue;
+            }
+
+            PushFrame(&stack, node, nullptr, nullptr, 1);
+            if (node->right != tree->nil) PushFrame(&stack, node->right, nullptr, nullptr, 0);
+            if (node->left  != tree->nil) PushFrame(&stack, node->left,  nullptr, nullptr, 0);
+            continue;
+        }
+
+        DerNode* right = (node->right != tree->nil) ? values.frames[--values.size].node : tree->nil;
+        DerNode* left  = (node->left  != tree->nil) ? values.frames[--values.size].node : tree->nil;
+
+        DerNode* result = ConstructNode(tree, node->type, node->value, left, right);
+        NodeMapSet(substituted, node, result);
+
+        PushFrame(&values, result, nullptr, nullptr, 0);
+    }
+
+    DerNode* result = values.frames[0].node;
+
+    DestructWalkStack(&stack);
+    DestructWalkStack(&values);
+
+    return result;
+}
+
+bool IsConstEqual(DerNode* node, double value)
+{
+    assert(node);
+
+    return node->type == TYPE_CONST && node->value.number == value;
+}
+
+#undef CONST
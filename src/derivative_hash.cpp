@@ -0,0 +1,207 @@
+#include "derivative.h"
+
+
+/////////////////////////////////
+//Structural hashes
+/////////////////////////////////
+size_t   SubTreeHash            (DerTree* tree, DerNode* node, size_t* size);
+void     SetNodeInfo            (DerTree* tree, DerNode* node);
+bool     IsFoldHazard           (DerNode* node, DerNode* left, DerNode* right);
+void     RefreshNodeInfo        (DerTree* tree, DerNode* node);
+void     InvalidateNode         (DerTree* tree, DerNode* node);
+bool     IsSameSubTree          (DerTree* tree, DerNode* first, DerNode* second);
+bool     IsSameNode             (DerTree* tree, DerNode* first, DerNode* second);
+
+
+size_t SubTreeHash(DerTree* tree, DerNode* node, size_t* size)
+{
+    assert(tree);
+    assert(node);
+    assert(size);
+
+    RefreshNodeInfo(tree, node);
+
+    *size = node->size;
+
+    return node->hash;
+}
+
+// From the node and its children, which must be known. A missing child of a node fresh from the parser is nil
+void SetNodeInfo(DerTree* tree, DerNode* node)
+{
+    assert(tree);
+    assert(node);
+
+    DerNode* left  = (node->left  != nullptr) ? node->left  : tree->nil;
+    DerNode* right = (node->right != nullptr) ? node->right : tree->nil;
+
+    size_t hash = HashNodeValue(node->type, node->value);
+    hash = hash * 0x9e3779b97f4a7c15ULL + left->hash;
+    hash = hash * 0x9e3779b97f4a7c15ULL + right->hash;
+    hash = hash ^ (hash >> 29);
+    hash = hash ^ (hash >> 32);
+
+    size_t size = 1 + (size_t)left->size + (size_t)right->size;
+
+    unsigned char info = (unsigned char)(left->info | right->info);
+
+    if (node->type == TYPE_VAR)  info |= (node->value.var == 'x') ? INFO_X : INFO_Y;
+    if (node->type == NODE_ERROR) info |= INFO_ERROR;
+
+    if (!(info & INFO_VARIABLES) && IsFoldHazard(node, left, right)) info |= INFO_ERROR;
+
+    node->hash     = (unsigned int)hash;
+    node->size     = (unsigned short)((size < MAX_INFO_SIZE) ? size : MAX_INFO_SIZE);
+    node->info     = info;
+    node->is_known = true;
+}
+
+// A constant operation that may fold into an error, its derivative is not a plain zero
+bool IsFoldHazard(DerNode* node, DerNode* left, DerNode* right)
+{
+    assert(node);
+    assert(left);
+    assert(right);
+
+    double value = 0;
+
+    if (node->type == TYPE_BIN_OP && node->value.op == OP_DIV)
+    {
+        if (right->type != TYPE_CONST) return true;
+
+        return !FoldBinOP(OP_DIV, 1, right->value.number, &value);
+    }
+
+    if (node->type == TYPE_UN_OP && (node->value.op == OP_CTG || node->value.op == OP_SQRT || node->value.op == OP_LN))
+    {
+        if (right->type != TYPE_CONST) return true;
+
+        return !FoldUnOP(node->value.op, right->value.number, &value);
+    }
+
+    return false;
+}
+
+// Only the nodes below that lost their info are walked, every other one is known with all its subtree
+void RefreshNodeInfo(DerTree* tree, DerNode* node)
+{
+    assert(tree);
+    assert(node);
+
+    if (node->is_known) return;
+
+    WalkStack stack;
+    InitWalkStack(&stack);
+
+    PushFrame(&stack, node, nullptr, nullptr, 0);
+
+    while (stack.size > 0)
+    {
+        WalkFrame frame = stack.frames[--stack.size];
+        node            = frame.node;
+
+        if (frame.state == 1)
+        {
+            SetNodeInfo(tree, node);
+            continue;
+        }
+
+        if (node->is_known) continue;
+
+        PushFrame(&stack, node, nullptr, nullptr, 1);
+        if (node->right != nullptr && !node->right->is_known) PushFrame(&stack, node->right, nullptr, nullptr, 0);
+        if (node->left  != nullptr && !node->left->is_known)  PushFrame(&stack, node->left,  nullptr, nullptr, 0);
+    }
+
+    DestructWalkStack(&stack);
+}
+
+// Called on a node that was changed in place, the climb stops at a node that is not known,
+// everything above it is not known either
+void InvalidateNode(DerTree* tree, DerNode* node)
+{
+    assert(tree);
+
+    while (node != nullptr && node != tree->nil && node->is_known)
+    {
+        node->is_known = false;
+        node           = node->parent;
+    }
+}
+
+// Pairs of nodes on an explicit stack, the walk stops at the first pair that differs
+bool IsSameSubTree(DerTree* tree, DerNode* first, DerNode* second)
+{
+    assert(tree);
+    assert(first);
+    assert(second);
+
+    if (first == second) return true;
+
+    // Interned nodes are equal only when they are the same node
+    if (tree->is_dag) return false;
+
+    bool is_same = true;
+
+    WalkStack stack;
+    InitWalkStack(&stack);
+
+    PushFrame(&stack, first, second, nullptr, 0);
+
+    while (stack.size > 0 && is_same)
+    {
+        WalkFrame frame = stack.frames[--stack.size];
+
+        first  = frame.node;
+        second = frame.link;
+
+        if (first == second) continue;
+
+        is_same = IsSameNode(tree, first, second);
+
+        if (is_same)
+        {
+            PushFrame(&stack, first->right, second->right, nullptr, 0);
+            PushFrame(&stack, first->left,  second->left,  nullptr, 0);
+        }
+    }
+
+    DestructWalkStack(&stack);
+
+    return is_same;
+}
+
+// Without the children
+bool IsSameNode(DerTree* tree, DerNode* first, DerNode* second)
+{
+    assert(tree);
+    assert(first);
+    assert(second);
+
+    if (first == tree->nil || second == tree->nil) return false;
+
+    RefreshNodeInfo(tree, first);
+    RefreshNodeInfo(tree, second);
+
+    // Different subtrees almost never hash the same, so only equal ones are walked
+    if (first->hash != second->hash || first->size != second->size) return false;
+
+    if (first->type != second->type) return false;
+
+    switch (first->type)
+    {
+        case TYPE_CONST :
+        case NODE_ERROR :
+        {
+            return first->value.number == second->value.number;
+        }
+        case TYPE_VAR :
+        {
+            return first->value.var == second->value.var;
+        }
+        default :
+        {
+            return first->value.op == second->value.op;
+        }
+    }
+}
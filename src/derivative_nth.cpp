@@ -0,0 +1,441 @@
+#include "derivative.h"
+
+
+// A part of a * x + b waiting in LinearSlope, what it adds to the slope is multiplied by scale
+struct LinearPart
+{
+    DerNode* node  = nullptr;
+    double   scale = 1;
+};
+
+struct LinearParts
+{
+    LinearPart* parts = nullptr;
+
+    size_t size     = 0;
+    size_t capacity = 0;
+};
+
+/////////////////////////////////
+//Derivatives of order n
+/////////////////////////////////
+void     TakeNthDerivative(DerTree* tree, size_t order);
+DerNode* NthDerivative    (DerTree* tree, DerTree* rest, DerNode* node, size_t order);
+int      EnterNth         (DerNode* node);
+DerNode* NthCombine       (DerTree* tree, int op, DerNode* left, DerNode* right);
+DerNode* NthCopy          (DerTree* dest, DerTree* src, DerNode* node, NodeMap* copies);
+DerNode* NthClosedForm    (DerTree* tree, DerNode* node, size_t order);
+bool     LinearSlope      (DerTree* tree, DerNode* node, double* slope);
+void     PushLinearPart   (LinearParts* parts, DerNode* node, double scale);
+double   FallingFactorial (double power, size_t order);
+
+
+// Frame states of NthDerivative, which children of a sum or of a product with a constant are needed
+enum NthState
+{
+    NTH_ENTER = 0,
+    NTH_TERM  = 1,
+    NTH_LEFT  = 2,
+    NTH_RIGHT = 4
+};
+
+#define cR    CopySubTree(tree, node->right)
+#define cL    CopySubTree(tree, node->left)
+
+#define MUL(left, right) ConstructNode(tree, TYPE_BIN_OP, { .op = OP_MUL  }, left, right)
+#define DIV(left, right) ConstructNode(tree, TYPE_BIN_OP, { .op = OP_DIV  }, left, right)
+#define POW(left, right) ConstructNode(tree, TYPE_BIN_OP, { .op = OP_POW  }, left, right)
+#define SIN(right)       ConstructNode(tree, TYPE_UN_OP,  { .op = OP_SIN  }, tree->nil, right)
+#define COS(right)       ConstructNode(tree, TYPE_UN_OP,  { .op = OP_COS  }, tree->nil, right)
+#define EXP(right)       ConstructNode(tree, TYPE_UN_OP,  { .op = OP_EXP  }, tree->nil, right)
+#define CONST(NUM)       ConstructNode(tree, TYPE_CONST,  { .number = NUM }, tree->nil, tree->nil)
+
+// The same as order calls of TakeDerivative. Sums and constant factors are taken apart, and sin, cos, exp, ln,
+// sqrt and powers of a * x + b get their n-th derivative at once. The other terms keep their places in a tree
+// of their own and go through TakeDerivative order times together, so they still cancel against each other
+void TakeNthDerivative(DerTree* tree, size_t order)
+{
+    assert(tree);
+
+    // The first derivative has nothing to save, and its output stays the same
+    if (order <= 1 || tree->root == tree->nil)
+    {
+        for (size_t i = 0; i < order; ++i)
+        {
+            TakeDerivative(tree);
+        }
+
+        return;
+    }
+
+    double start = StatsClock();
+
+    DerTree* rest = NewTree();
+    rest->is_dag  = tree->is_dag;
+
+    DerNode* result = NthDerivative(tree, rest, tree->root, order);
+
+    // Not a single closed form, the whole tree is what is left
+    if (result == nullptr)
+    {
+        Destruct(rest);
+        Delete(rest);
+
+        for (size_t i = 0; i < order; ++i)
+        {
+            TakeDerivative(tree);
+        }
+
+        return;
+    }
+
+    if (rest->root != nullptr)
+    {
+        SetParents(rest);
+
+        for (size_t i = 0; i < order; ++i)
+        {
+            TakeDerivative(rest);
+        }
+
+        NodeMap copies = {};
+        result = NthCombine(tree, OP_ADD, result, NthCopy(tree, rest, rest->root, &copies));
+        NodeMapDestruct(&copies);
+    }
+
+    Destruct(rest);
+    Delete(rest);
+
+    DestructNodes(tree, tree->root);
+
+    tree->root = result;
+    SetParents(tree);
+
+    Simplify(tree);
+    Canonicalize(tree);
+
+    StatsRecord(tree, PHASE_DERIVATIVE, start);
+}
+
+// Children before their parent on an explicit stack like Derivative, only sums and constant factors have children here.
+// Every frame leaves two results: node is the derivative of its closed forms and link is a copy of its other terms
+// in rest, nullptr when there are none
+DerNode* NthDerivative(DerTree* tree, DerTree* rest, DerNode* node, size_t order)
+{
+    assert(tree);
+    assert(rest);
+    assert(node);
+
+    NodeMap   copies = {};
+    WalkStack stack;
+    WalkStack values;
+    InitWalkStack(&stack);
+    InitWalkStack(&values);
+
+    PushFrame(&stack, node, nullptr, nullptr, NTH_ENTER);
+
+    while (stack.size > 0)
+    {
+        WalkFrame frame = stack.frames[--stack.size];
+        node            = frame.node;
+
+        if (frame.state == NTH_ENTER)
+        {
+            int state = EnterNth(node);
+
+            if (state == NTH_TERM)
+            {
+                RefreshNodeInfo(tree, node);
+
+                // Constants are left to TakeDerivative too, an undefined value has to stay undefined
+                DerNode* closed    = (node->info & INFO_VARIABLES) ? NthClosedForm(tree, node, order) : nullptr;
+                DerNode* remaining = (closed == nullptr) ? NthCopy(rest, tree, node, &copies) : nullptr;
+
+                PushFrame(&values, closed, remaining, nullptr, 0);
+                continue;
+            }
+
+            PushFrame(&stack, node, nullptr, nullptr, state);
+            if (state & NTH_RIGHT) PushFrame(&stack, node->right, nullptr, nullptr, NTH_ENTER);
+            if (state & NTH_LEFT)  PushFrame(&stack, node->left,  nullptr, nullptr, NTH_ENTER);
+
+            continue;
+        }
+
+        WalkFrame right = (frame.state & NTH_RIGHT) ? values.frames[--values.size] : WalkFrame{};
+        WalkFrame left  = (frame.state & NTH_LEFT)  ? values.frames[--values.size] : WalkFrame{};
+
+        int      op        = node->value.op;
+        DerNode* closed    = nullptr;
+        DerNode* remaining = nullptr;
+
+        // A constant factor goes to each side that has terms left under it
+        if (frame.state == NTH_LEFT)
+        {
+            if (left.node != nullptr) closed    = NthCombine(tree, op, left.node, cR);
+            if (left.link != nullptr) remaining = NthCombine(rest, op, left.link, NthCopy(rest, tree, node->right, &copies));
+        }
+        else if (frame.state == NTH_RIGHT)
+        {
+            if (right.node != nullptr) closed    = NthCombine(tree, op, cL, right.node);
+            if (right.link != nullptr) remaining = NthCombine(rest, op, NthCopy(rest, tree, node->left, &copies), right.link);
+        }
+        else
+        {
+            closed    = NthCombine(tree, op, left.node, right.node);
+            remaining = NthCombine(rest, op, left.link, right.link);
+        }
+
+        PushFrame(&values, closed, remaining, nullptr, 0);
+    }
+
+    rest->root = values.frames[0].link;
+
+    DerNode* result = values.frames[0].node;
+
+    DestructWalkStack(&stack);
+    DestructWalkStack(&values);
+    NodeMapDestruct(&copies);
+
+    return result;
+}
+
+// The derivative of a sum is the sum of the derivatives, and a constant factor stays where it is
+int EnterNth(DerNode* node)
+{
+    assert(node);
+
+    if (node->type != TYPE_BIN_OP) return NTH_TERM;
+
+    switch (node->value.op)
+    {
+        case OP_ADD :
+        case OP_SUB :
+        {
+            return NTH_LEFT | NTH_RIGHT;
+        }
+        case OP_MUL :
+        {
+            if (node->left->type  == TYPE_CONST) return NTH_RIGHT;
+            if (node->right->type == TYPE_CONST) return NTH_LEFT;
+
+            return NTH_TERM;
+        }
+        case OP_DIV :
+        {
+            return (node->right->type == TYPE_CONST) ? NTH_LEFT : NTH_TERM;
+        }
+        default :
+        {
+            return NTH_TERM;
+        }
+    }
+}
+
+// A nullptr side of a sum has no terms and drops out
+DerNode* NthCombine(DerTree* tree, int op, DerNode* left, DerNode* right)
+{
+    assert(tree);
+
+    if (right == nullptr) return left;
+
+    if (left == nullptr)
+    {
+        return (op == OP_ADD) ? right : ConstructNode(tree, TYPE_BIN_OP, { .op = OP_SUB }, CONST(0), right);
+    }
+
+    return ConstructNode(tree, TYPE_BIN_OP, { .op = op }, left, right);
+}
+
+// Between the tree and the one with the other terms. Shared nodes of a DAG are copied once
+DerNode* NthCopy(DerTree* dest, DerTree* src, DerNode* node, NodeMap* copies)
+{
+    assert(dest);
+    assert(src);
+    assert(node);
+    assert(copies);
+
+    return src->is_dag ? CopySharedNodes(dest, src, node, copies) : CopyNodes(dest, src, node);
+}
+
+// nullptr when there is no closed form
+DerNode* NthClosedForm(DerTree* tree, DerNode* node, size_t order)
+{
+    assert(tree);
+    assert(node);
+
+    double slope = 0;
+    double scale = 1;
+    double n     = (double)order;
+
+    if (node->info & INFO_ERROR) return nullptr;
+
+    if (node->type == TYPE_VAR)
+    {
+        return CONST((order == 1) ? 1.0 : 0.0);
+    }
+
+    // f(a * x + b) ^ (n) = a ^ n * f ^ (n) (a * x + b)
+    if (node->type == TYPE_UN_OP && LinearSlope(tree, node->right, &slope))
+    {
+        scale = pow(slope, n);
+
+        switch (node->value.op)
+        {
+            // sin ^ (n) (u) = sin(u + n * pi / 2), which goes round sin, cos, -sin, -cos
+            case OP_SIN :
+            case OP_COS :
+            {
+                size_t phase = (order + ((node->value.op == OP_COS) ? 1 : 0)) % 4;
+
+                if (phase >= 2) scale = -scale;
+
+                return MUL(CONST(scale), (phase % 2 == 0) ? SIN(cR) : COS(cR));
+            }
+            case OP_EXP :
+            {
+                return MUL(CONST(scale), EXP(cR));
+            }
+            // ln ^ (n) (u) = (-1) ^ (n - 1) * (n - 1)! / u ^ n
+            case OP_LN :
+            {
+                double factorial = FallingFactorial(n - 1, order - 1);
+
+                if (order % 2 == 0) factorial = -factorial;
+
+                return DIV(CONST(scale * factorial), POW(cR, CONST(n)));
+            }
+            case OP_SQRT :
+            {
+                return MUL(CONST(scale * FallingFactorial(0.5, order)), POW(cR, CONST(0.5 - n)));
+            }
+            default :
+            {
+                return nullptr;
+            }
+        }
+    }
+
+    if (node->type == TYPE_BIN_OP && node->value.op == OP_POW)
+    {
+        // (u ^ p) ^ (n) = p (p - 1) ... (p - n + 1) * u ^ (p - n), zero once a whole power runs out
+        if (node->right->type == TYPE_CONST && LinearSlope(tree, node->left, &slope))
+        {
+            double power     = node->right->value.number;
+            double factorial = FallingFactorial(power, order);
+
+            if (factorial == 0) return CONST(0);
+
+            return MUL(CONST(pow(slope, n) * factorial), POW(cL, CONST(power - n)));
+        }
+
+        // (c ^ u) ^ (n) = (a * ln c) ^ n * c ^ u
+        if (node->left->type == TYPE_CONST && node->left->value.number > 0 && LinearSlope(tree, node->right, &slope))
+        {
+            return MUL(CONST(pow(slope * log(node->left->value.number), n)), POW(cL, cR));
+        }
+    }
+
+    return nullptr;
+}
+
+// Whether node is a * x + b, with a in slope. A variable counts as x, the way Derivative takes it, and b is any
+// subtree without variables. Parts wait on an explicit stack with the constant they are multiplied by
+bool LinearSlope(DerTree* tree, DerNode* node, double* slope)
+{
+    assert(tree);
+    assert(node);
+    assert(slope);
+
+    LinearParts parts = {};
+    PushLinearPart(&parts, node, 1);
+
+    double sum       = 0;
+    bool   is_linear = true;
+
+    while (parts.size > 0 && is_linear)
+    {
+        LinearPart part = parts.parts[--parts.size];
+
+        node = part.node;
+
+        if (node->type == TYPE_BIN_OP && (node->value.op == OP_ADD || node->value.op == OP_SUB))
+        {
+            PushLinearPart(&parts, node->right, (node->value.op == OP_ADD) ? part.scale : -part.scale);
+            PushLinearPart(&parts, node->left,  part.scale);
+            continue;
+        }
+
+        RefreshNodeInfo(tree, node);
+
+        if (node->info & INFO_ERROR)
+        {
+            is_linear = false;
+        }
+        else if (!(node->info & INFO_VARIABLES))
+        {
+            continue;
+        }
+        else if (node->type == TYPE_VAR)
+        {
+            sum += part.scale;
+        }
+        else if (node->type != TYPE_BIN_OP)
+        {
+            is_linear = false;
+        }
+        else if (node->value.op == OP_MUL && node->left->type == TYPE_CONST)
+        {
+            PushLinearPart(&parts, node->right, part.scale * node->left->value.number);
+        }
+        else if (node->value.op == OP_MUL && node->right->type == TYPE_CONST)
+        {
+            PushLinearPart(&parts, node->left, part.scale * node->right->value.number);
+        }
+        else if (node->value.op == OP_DIV && node->right->type == TYPE_CONST)
+        {
+            PushLinearPart(&parts, node->left, part.scale / node->right->value.number);
+        }
+        else
+        {
+            is_linear = false;
+        }
+    }
+
+    free(parts.parts);
+
+    if (is_linear) *slope = sum;
+
+    return is_linear;
+}
+
+void PushLinearPart(LinearParts* parts, DerNode* node, double scale)
+{
+    assert(parts);
+    assert(node);
+
+    if (parts->size == parts->capacity)
+    {
+        parts->capacity = (parts->capacity == 0) ? 8 : 2 * parts->capacity;
+
+        parts->parts = (LinearPart*)realloc(parts->parts, parts->capacity * sizeof(LinearPart));
+        assert(parts->parts);
+    }
+
+    parts->parts[parts->size].node  = node;
+    parts->parts[parts->size].scale = scale;
+    parts->size++;
+}
+
+// power (power - 1) ... (power - order + 1), 1 for an order of 0
+double FallingFactorial(double power, size_t order)
+{
+    double result = 1;
+
+    for (size_t i = 0; i < order; ++i)
+    {
+        result *= power - (double)i;
+    }
+
+    return result;
+}
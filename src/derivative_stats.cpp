@@ -0,0 +1,205 @@
+#include <atomic>
+#include <time.h>
+
+#include "derivative.h"
+
+
+const size_t STATS_START_CAPACITY = 16;
+
+static const char* PHASE_NAMES[] = {"get_tree", "derivative", "simplify", "print", "dump", "store"};
+
+struct PhaseTotals
+{
+    std::atomic<size_t> calls{0};
+    std::atomic<size_t> ns{0};
+    std::atomic<size_t> max_ns{0};
+};
+
+// Shared by every thread, a tree adds its counts when it is destructed
+struct StatsTotals
+{
+    std::atomic<bool> is_enabled{false};
+
+    PhaseTotals phases[NUM_PHASES];
+
+    std::atomic<size_t> trees{0};
+    std::atomic<size_t> allocs{0};
+    std::atomic<size_t> frees{0};
+    std::atomic<size_t> peak_live{0};
+
+    std::atomic<size_t> simplify_passes{0};
+    std::atomic<size_t> simplify_visits{0};
+    std::atomic<size_t> simplify_rewrites{0};
+};
+
+static StatsTotals STATS_TOTALS;
+
+/////////////////////////////////
+//Statistics
+/////////////////////////////////
+void   EnableStats     ();
+bool   IsStatsEnabled  ();
+double StatsClock      ();
+void   StatsRecord     (DerTree* tree, StatsPhase phase, double start);
+void   FoldTreeStats   (DerTree* tree);
+void   AtomicMax       (std::atomic<size_t>* value, size_t candidate);
+void   PrintStatsJson  (DerTree* tree, FILE* file);
+void   PrintTreeJson   (DerTree* tree, FILE* file);
+bool   WriteStats      (DerTree* tree, const char* name);
+
+
+// Trees made after this carry their own TreeStats, the ones made before stay silent
+void EnableStats()
+{
+    STATS_TOTALS.is_enabled.store(true);
+}
+
+bool IsStatsEnabled()
+{
+    return STATS_TOTALS.is_enabled.load(std::memory_order_relaxed);
+}
+
+// Milliseconds of a monotonic clock
+double StatsClock()
+{
+    struct timespec now = {};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return 1000 * (double)now.tv_sec + (double)now.tv_nsec / 1e6;
+}
+
+void StatsRecord(DerTree* tree, StatsPhase phase, double start)
+{
+    assert(tree);
+
+    if (tree->stats == nullptr) return;
+
+    TreeStats* stats = tree->stats;
+    double     ms    = StatsClock() - start;
+
+    if (stats->size == stats->capacity)
+    {
+        stats->capacity = (stats->capacity == 0) ? STATS_START_CAPACITY : 2 * stats->capacity;
+
+        stats->events = (PhaseEvent*)realloc(stats->events, stats->capacity * sizeof(PhaseEvent));
+        assert(stats->events);
+    }
+
+    stats->events[stats->size].phase      = phase;
+    stats->events[stats->size].ms         = ms;
+    stats->events[stats->size].live_nodes = tree->arena.num_live;
+    stats->size++;
+
+    size_t ns = (size_t)(ms * 1e6);
+
+    STATS_TOTALS.phases[phase].calls.fetch_add(1,  std::memory_order_relaxed);
+    STATS_TOTALS.phases[phase].ns   .fetch_add(ns, std::memory_order_relaxed);
+    AtomicMax(&STATS_TOTALS.phases[phase].max_ns, ns);
+}
+
+// Called by Destruct, the events go away with the tree
+void FoldTreeStats(DerTree* tree)
+{
+    assert(tree);
+
+    if (tree->stats == nullptr) return;
+
+    STATS_TOTALS.trees .fetch_add(1,                     std::memory_order_relaxed);
+    STATS_TOTALS.allocs.fetch_add(tree->arena.num_allocs, std::memory_order_relaxed);
+    STATS_TOTALS.frees .fetch_add(tree->arena.num_frees,  std::memory_order_relaxed);
+    AtomicMax(&STATS_TOTALS.peak_live, tree->arena.peak_live);
+
+    STATS_TOTALS.simplify_passes  .fetch_add(tree->simplify_stats.passes,   std::memory_order_relaxed);
+    STATS_TOTALS.simplify_visits  .fetch_add(tree->simplify_stats.visits,   std::memory_order_relaxed);
+    STATS_TOTALS.simplify_rewrites.fetch_add(tree->simplify_stats.rewrites, std::memory_order_relaxed);
+
+    free(tree->stats->events);
+    free(tree->stats);
+    tree->stats = nullptr;
+}
+
+void AtomicMax(std::atomic<size_t>* value, size_t candidate)
+{
+    assert(value);
+
+    size_t current = value->load(std::memory_order_relaxed);
+
+    while (current < candidate && !value->compare_exchange_weak(current, candidate, std::memory_order_relaxed));
+}
+
+// The totals of the destructed trees, and the tree itself with every phase in order when it is given
+void PrintStatsJson(DerTree* tree, FILE* file)
+{
+    assert(file);
+
+    fprintf(file, "{\n  \"phases\": {");
+
+    for (size_t i = 0; i < NUM_PHASES; ++i)
+    {
+        PhaseTotals* phase = &STATS_TOTALS.phases[i];
+
+        fprintf(file, "%s\n    \"%s\": {\"calls\": %zu, \"total_ms\": %.3lf, \"max_ms\": %.3lf}", (i == 0) ? "" : ",",
+                PHASE_NAMES[i], phase->calls.load(), (double)phase->ns.load() / 1e6, (double)phase->max_ns.load() / 1e6);
+    }
+
+    fprintf(file, "\n  },\n");
+
+    fprintf(file, "  \"trees\": %zu,\n", STATS_TOTALS.trees.load());
+    fprintf(file, "  \"nodes\": {\"allocs\": %zu, \"frees\": %zu, \"peak_live\": %zu},\n",
+            STATS_TOTALS.allocs.load(), STATS_TOTALS.frees.load(), STATS_TOTALS.peak_live.load());
+    fprintf(file, "  \"simplify\": {\"passes\": %zu, \"visits\": %zu, \"rewrites\": %zu}",
+            STATS_TOTALS.simplify_passes.load(), STATS_TOTALS.simplify_visits.load(), STATS_TOTALS.simplify_rewrites.load());
+
+    if (tree != nullptr && tree->stats != nullptr)
+    {
+        fprintf(file, ",\n  \"tree\": ");
+        PrintTreeJson(tree, file);
+    }
+
+    fprintf(file, "\n}\n");
+}
+
+void PrintTreeJson(DerTree* tree, FILE* file)
+{
+    assert(tree);
+    assert(tree->stats);
+    assert(file);
+
+    fprintf(file, "{\n    \"nodes\": {\"allocs\": %zu, \"frees\": %zu, \"live\": %zu, \"peak_live\": %zu},\n",
+            tree->arena.num_allocs, tree->arena.num_frees, tree->arena.num_live, tree->arena.peak_live);
+    fprintf(file, "    \"simplify\": {\"passes\": %zu, \"visits\": %zu, \"rewrites\": %zu},\n",
+            tree->simplify_stats.passes, tree->simplify_stats.visits, tree->simplify_stats.rewrites);
+
+    fprintf(file, "    \"events\": [");
+
+    for (size_t i = 0; i < tree->stats->size; ++i)
+    {
+        PhaseEvent* event = &tree->stats->events[i];
+
+        fprintf(file, "%s\n      {\"phase\": \"%s\", \"ms\": %.3lf, \"live_nodes\": %zu}", (i == 0) ? "" : ",",
+                PHASE_NAMES[event->phase], event->ms, event->live_nodes);
+    }
+
+    fprintf(file, "\n    ]\n  }");
+}
+
+// "-" writes to stdout
+bool WriteStats(DerTree* tree, const char* name)
+{
+    assert(name);
+
+    bool  is_stdout = strcmp(name, "-") == 0;
+    FILE* file      = is_stdout ? stdout : fopen(name, "w");
+
+    if (file == nullptr)
+    {
+        fprintf(stderr, "Can't write %s\n", name);
+        return false;
+    }
+
+    PrintStatsJson(tree, file);
+
+    if (!is_stdout) fclose(file);
+
+    return true;
+}
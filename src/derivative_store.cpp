@@ -0,0 +1,471 @@
+#include <unistd.h>
+#include <sys/stat.h>
+#include <atomic>
+
+#include "derivative.h"
+#include "render.h"
+
+
+const char*        STORE_DIR     = "cache";
+const unsigned int STORE_MAGIC   = 0x54524544;
+const unsigned int STORE_VERSION = 1;
+const size_t       STORE_ALIGN   = 8;
+
+// Start of a file, num_trees sections follow it. A file of another version or byte order fails the magic check
+struct StoreHeader
+{
+    unsigned int magic;
+    unsigned int version;
+    unsigned int task;
+    unsigned int order;
+    unsigned int num_trees;
+    unsigned int reserved;
+};
+
+// Start of a tree, then consts, values, left, right and kinds of its CompactTree, the whole padded to 8 bytes
+struct StoreSection
+{
+    unsigned int size;
+    unsigned int num_consts;
+    unsigned int root;
+    unsigned int is_dag;
+};
+
+// Temporary files of writers in other threads and processes never share a name
+static std::atomic<size_t> NUM_STORE_FILES{0};
+
+/////////////////////////////////
+//Binary trees and stored results
+/////////////////////////////////
+bool     SaveTreeFile    (DerTree* tree, const char* name);
+DerTree* LoadTreeFile    (const char* name);
+bool     LoadStoredResult(DerTree* tree, StoreTask task, size_t order, StoreKey* key, DerTree** results, size_t num_results);
+void     SaveStoredResult(const StoreKey* key, DerTree** results, size_t num_results);
+void     DestructStoreKey(StoreKey* key);
+void     OrderOperands   (DerTree* tree);
+void     PackHeader      (StrBuf* buf, StoreTask task, size_t order, size_t num_trees);
+void     PackTree        (StrBuf* buf, DerTree* tree);
+bool     UnpackHeader    (const char** cursor, const char* end, StoreHeader* header);
+bool     UnpackCompact   (const char** cursor, const char* end, CompactTree* view, bool* is_dag);
+bool     IsValidCompact  (const CompactTree* compact);
+DerTree* TreeFromCompact (const CompactTree* view, bool is_dag);
+char*    ReadStoreFile   (const char* name, size_t* size);
+bool     WriteStoreFile  (const char* name, const StrBuf* buf);
+
+
+// One tree in a file of its own, SaveTreeFile and LoadTreeFile keep DAGs shared
+bool SaveTreeFile(DerTree* tree, const char* name)
+{
+    assert(tree);
+    assert(name);
+
+    StrBuf buf = {};
+
+    PackHeader(&buf, STORE_TREE, 0, 1);
+    PackTree  (&buf, tree);
+
+    bool is_written = WriteStoreFile(name, &buf);
+
+    StrBufDestruct(&buf);
+
+    return is_written;
+}
+
+// The file is read at once and its arrays are used where they lie, nullptr when it is missing or broken
+DerTree* LoadTreeFile(const char* name)
+{
+    assert(name);
+
+    size_t size = 0;
+    char*  data = ReadStoreFile(name, &size);
+
+    if (data == nullptr) return nullptr;
+
+    const char* cursor = data;
+    const char* end    = data + size;
+
+    StoreHeader header = {};
+    CompactTree view   = {};
+    bool        is_dag = false;
+
+    DerTree* tree = nullptr;
+
+    if (UnpackHeader(&cursor, end, &header) && header.task == STORE_TREE && header.num_trees == 1 &&
+        UnpackCompact(&cursor, end, &view, &is_dag))
+    {
+        tree = TreeFromCompact(&view, is_dag);
+    }
+
+    free(data);
+
+    return tree;
+}
+
+// The key is tree with the operands of + and * in order, in the binary format, so x + 2 and 2 + x find the same
+// file. The whole key is kept in the file and compared, a clash of hashes is a miss. key is filled on a miss too,
+// for SaveStoredResult, and is destructed by the caller either way
+bool LoadStoredResult(DerTree* tree, StoreTask task, size_t order, StoreKey* key, DerTree** results, size_t num_results)
+{
+    assert(tree);
+    assert(key);
+    assert(results);
+
+    double start = StatsClock();
+
+    DerTree* canonical = CopyTree(tree);
+    OrderOperands(canonical);
+
+    key->task  = task;
+    key->order = order;
+
+    PackTree(&key->input, canonical);
+
+    Destruct(canonical);
+    Delete(canonical);
+
+    size_t hash = HashText(key->input.data, key->input.size);
+
+    hash = hash * 0x9e3779b97f4a7c15ULL + task;
+    hash = hash * 0x9e3779b97f4a7c15ULL + order;
+    hash = hash * 0x9e3779b97f4a7c15ULL + STORE_VERSION;
+
+    snprintf(key->name, STORE_PATH_LEN, "%s/expr_%016zx_%u_%zu.bin", STORE_DIR, hash ^ (hash >> 29),
+             (unsigned int)task, order);
+
+    size_t size = 0;
+    char*  data = ReadStoreFile(key->name, &size);
+
+    if (data == nullptr) return false;
+
+    const char* cursor = data;
+    const char* end    = data + size;
+
+    StoreHeader header   = {};
+    bool        is_found = UnpackHeader(&cursor, end, &header) && header.task == (unsigned int)task &&
+                           header.order == order && header.num_trees == num_results + 1 &&
+                           (size_t)(end - cursor) >= key->input.size &&
+                           memcmp(cursor, key->input.data, key->input.size) == 0;
+
+    if (is_found) cursor += key->input.size;
+
+    // Every tree is checked before any is built, a broken file builds nothing
+    CompactTree* views = (CompactTree*)calloc(num_results + 1, sizeof(CompactTree));
+    bool*        dags  = (bool*)       calloc(num_results + 1, sizeof(bool));
+    assert(views);
+    assert(dags);
+
+    for (size_t i = 0; i < num_results && is_found; ++i)
+    {
+        is_found = UnpackCompact(&cursor, end, &views[i], &dags[i]);
+    }
+
+    for (size_t i = 0; i < num_results && is_found; ++i)
+    {
+        results[i] = TreeFromCompact(&views[i], dags[i]);
+    }
+
+    free(views);
+    free(dags);
+    free(data);
+
+    StatsRecord(tree, PHASE_STORE, start);
+
+    return is_found;
+}
+
+// Nothing is reported when the folder is missing or not writable, the result is computed again next time
+void SaveStoredResult(const StoreKey* key, DerTree** results, size_t num_results)
+{
+    assert(key);
+    assert(results);
+
+    if (key->input.data == nullptr) return;
+
+    StrBuf buf = {};
+
+    PackHeader  (&buf, key->task, key->order, num_results + 1);
+    StrBufAppend(&buf, key->input.data, key->input.size);
+
+    for (size_t i = 0; i < num_results; ++i)
+    {
+        PackTree(&buf, results[i]);
+    }
+
+    mkdir(STORE_DIR, 0755);
+    WriteStoreFile(key->name, &buf);
+
+    StrBufDestruct(&buf);
+}
+
+void DestructStoreKey(StoreKey* key)
+{
+    assert(key);
+
+    StrBufDestruct(&key->input);
+
+    *key = {};
+}
+
+// Swapping the operands of + and * is exact in floating point, so both orders have the same results.
+// Canonicalize would collect and fold terms too, x - x and ln(x) - ln(x) are 0 there but not in their Taylor series
+void OrderOperands(DerTree* tree)
+{
+    assert(tree);
+
+    if (tree->root == tree->nil) return;
+
+    NodeMap   visited = {};
+    WalkStack stack;
+    InitWalkStack(&stack);
+
+    PushFrame(&stack, tree->root, nullptr, nullptr, 0);
+
+    // Children are put in order before their parent compares them
+    while (stack.size > 0)
+    {
+        WalkFrame frame = stack.frames[--stack.size];
+        DerNode*  node  = frame.node;
+
+        if (frame.state == 0)
+        {
+            if (tree->is_dag)
+            {
+                if (NodeMapGet(&visited, node) != nullptr) continue;
+
+                NodeMapSet(&visited, node, node);
+            }
+
+            PushFrame(&stack, node, nullptr, nullptr, 1);
+            if (node->right != tree->nil) PushFrame(&stack, node->right, nullptr, nullptr, 0);
+            if (node->left  != tree->nil) PushFrame(&stack, node->left,  nullptr, nullptr, 0);
+
+            continue;
+        }
+
+        bool is_commutative = node->type == TYPE_BIN_OP && (node->value.op == OP_ADD || node->value.op == OP_MUL);
+
+        if (!is_commutative) continue;
+
+        RefreshNodeInfo(tree, node->left);
+        RefreshNodeInfo(tree, node->right);
+
+        if (CompareSubTrees(node->left, node->right) > 0)
+        {
+            DerNode* left = node->left;
+            node->left    = node->right;
+            node->right   = left;
+
+            // The hash depends on the order of the children
+            InvalidateNode(tree, node);
+        }
+    }
+
+    DestructWalkStack(&stack);
+    NodeMapDestruct(&visited);
+}
+
+void PackHeader(StrBuf* buf, StoreTask task, size_t order, size_t num_trees)
+{
+    assert(buf);
+
+    StoreHeader header = {};
+    header.magic       = STORE_MAGIC;
+    header.version     = STORE_VERSION;
+    header.task        = (unsigned int)task;
+    header.order       = (unsigned int)order;
+    header.num_trees   = (unsigned int)num_trees;
+
+    StrBufAppend(buf, (const char*)&header, sizeof(header));
+}
+
+// Sections and arrays start at multiples of 8 from the start of the file, so the constants can be read in place
+void PackTree(StrBuf* buf, DerTree* tree)
+{
+    assert(buf);
+    assert(tree);
+
+    CompactTree compact = {};
+    BuildCompact(tree, &compact);
+
+    StoreSection section = {};
+    section.size         = (unsigned int)compact.size;
+    section.num_consts   = (unsigned int)compact.num_consts;
+    section.root         = compact.root;
+    section.is_dag       = tree->is_dag;
+
+    StrBufAppend(buf, (const char*)&section, sizeof(section));
+
+    // An empty tree or one without constants has no arrays to write
+    if (compact.num_consts > 0) StrBufAppend(buf, (const char*)compact.consts, compact.num_consts * sizeof(double));
+
+    if (compact.size > 0)
+    {
+        StrBufAppend(buf, (const char*)compact.values, compact.size * sizeof(unsigned int));
+        StrBufAppend(buf, (const char*)compact.left,   compact.size * sizeof(unsigned int));
+        StrBufAppend(buf, (const char*)compact.right,  compact.size * sizeof(unsigned int));
+        StrBufAppend(buf, (const char*)compact.kinds,  compact.size * sizeof(unsigned char));
+    }
+
+    const char padding[STORE_ALIGN] = {};
+    StrBufAppend(buf, padding, (STORE_ALIGN - buf->size % STORE_ALIGN) % STORE_ALIGN);
+
+    DestructCompact(&compact);
+}
+
+bool UnpackHeader(const char** cursor, const char* end, StoreHeader* header)
+{
+    assert(cursor);
+    assert(end);
+    assert(header);
+
+    if ((size_t)(end - *cursor) < sizeof(StoreHeader)) return false;
+
+    memcpy(header, *cursor, sizeof(StoreHeader));
+    *cursor += sizeof(StoreHeader);
+
+    return header->magic == STORE_MAGIC && header->version == STORE_VERSION;
+}
+
+// view points into the read file and is valid while it is, nothing is copied
+bool UnpackCompact(const char** cursor, const char* end, CompactTree* view, bool* is_dag)
+{
+    assert(cursor);
+    assert(end);
+    assert(view);
+    assert(is_dag);
+
+    if ((size_t)(end - *cursor) < sizeof(StoreSection)) return false;
+
+    StoreSection section = {};
+    memcpy(&section, *cursor, sizeof(StoreSection));
+
+    size_t tree_size = sizeof(StoreSection) + section.num_consts * sizeof(double) +
+                       (size_t)section.size * (3 * sizeof(unsigned int) + sizeof(unsigned char));
+
+    tree_size = (tree_size + STORE_ALIGN - 1) / STORE_ALIGN * STORE_ALIGN;
+
+    if ((size_t)(end - *cursor) < tree_size) return false;
+
+    const char* data = *cursor + sizeof(StoreSection);
+
+    view->consts = (double*)data;
+    data += section.num_consts * sizeof(double);
+
+    view->values = (unsigned int*)data;
+    data += section.size * sizeof(unsigned int);
+
+    view->left = (unsigned int*)data;
+    data += section.size * sizeof(unsigned int);
+
+    view->right = (unsigned int*)data;
+    data += section.size * sizeof(unsigned int);
+
+    view->kinds = (unsigned char*)data;
+
+    view->size       = section.size;
+    view->num_consts = section.num_consts;
+    view->root       = section.root;
+
+    *is_dag  = (section.is_dag != 0);
+    *cursor += tree_size;
+
+    return IsValidCompact(view);
+}
+
+// A file written by SaveTreeFile passes, a broken one could send NodesFromCompact out of its arrays
+bool IsValidCompact(const CompactTree* compact)
+{
+    assert(compact);
+
+    if (compact->size == 0) return compact->root == COMPACT_NIL;
+
+    if (compact->root >= compact->size) return false;
+
+    for (size_t i = 0; i < compact->size; ++i)
+    {
+        NodeType type  = CompactType(compact->kinds[i]);
+        int      op    = CompactOp  (compact->kinds[i]);
+        size_t   left  = compact->left[i];
+        size_t   right = compact->right[i];
+
+        bool has_left  = (left  != COMPACT_NIL);
+        bool has_right = (right != COMPACT_NIL);
+
+        if ((has_left && left >= i) || (has_right && right >= i)) return false;
+
+        bool is_valid = false;
+
+        switch (type)
+        {
+            case TYPE_CONST  :
+            case NODE_ERROR  : is_valid = (op == 0) && compact->values[i] < compact->num_consts && !has_left && !has_right; break;
+            case TYPE_VAR    : is_valid = (op == 0) && compact->values[i] < NUM_VARIABLES      && !has_left && !has_right; break;
+            case TYPE_BIN_OP : is_valid = (op < NUM_BINARY_OP) && has_left  && has_right;                                  break;
+            case TYPE_UN_OP  : is_valid = (op < NUM_UNARY_OP)  && !has_left && has_right;                                  break;
+            default          : is_valid = false;                                                                           break;
+        }
+
+        if (!is_valid) return false;
+    }
+
+    return true;
+}
+
+DerTree* TreeFromCompact(const CompactTree* view, bool is_dag)
+{
+    assert(view);
+
+    DerTree* tree = NewTree();
+
+    tree->is_dag = is_dag;
+    tree->root   = NodesFromCompact(tree, view);
+
+    return tree;
+}
+
+// One fread into memory from malloc, which is aligned for the constants. The caller frees it
+char* ReadStoreFile(const char* name, size_t* size)
+{
+    assert(name);
+    assert(size);
+
+    FILE* file = fopen(name, "rb");
+    if (file == nullptr) return nullptr;
+
+    struct stat info = {};
+    char*       data = nullptr;
+
+    if (fstat(fileno(file), &info) == 0 && info.st_size > 0)
+    {
+        data = (char*)malloc((size_t)info.st_size);
+        assert(data);
+
+        *size = fread(data, sizeof(char), (size_t)info.st_size, file);
+    }
+
+    fclose(file);
+
+    return data;
+}
+
+// Written under another name and renamed, a reader never sees half of a file
+bool WriteStoreFile(const char* name, const StrBuf* buf)
+{
+    assert(name);
+    assert(buf);
+
+    char temp[STORE_PATH_LEN + 32] = "";
+    snprintf(temp, sizeof(temp), "%s.%ld.%zu", name, (long)getpid(), NUM_STORE_FILES++);
+
+    FILE* file = fopen(temp, "wb");
+    if (file == nullptr) return false;
+
+    bool is_written = fwrite(buf->data, sizeof(char), buf->size, file) == buf->size;
+    is_written      = (fclose(file) == 0) && is_written;
+
+    if (is_written && rename(temp, name) == 0) return true;
+
+    remove(temp);
+
+    return false;
+}
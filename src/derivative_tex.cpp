@@ -0,0 +1,258 @@
+#include <math.h>
+
+#include "derivative.h"
+
+
+// How tightly a node binds, a child that binds less than its parent wants is put in parentheses
+enum TexPrecedence
+{
+    TEX_SIGNED   = 0,
+    TEX_SUM      = 1,
+    TEX_PRODUCT  = 2,
+    TEX_FUNCTION = 3,
+    TEX_POWER    = 4,
+    TEX_FRACTION = 5,
+    TEX_ATOM     = 6
+};
+
+// Steps of a frame of EmitTex in the low bits, the flag and the name of a named subtree are set when it is pushed
+enum TexState
+{
+    TEX_OPEN   = 0,
+    TEX_VALUE  = 1,
+    TEX_CLOSE  = 2,
+    TEX_STEP   = 3,
+
+    TEX_PARENS     = 4,
+    TEX_NAME_SHIFT = 3
+};
+
+// What is written around and between the children and the least precedence each child takes without parentheses
+struct TexOperator
+{
+    const char* open;
+    const char* middle;
+    const char* close;
+
+    TexPrecedence precedence;
+    TexPrecedence left_min;
+    TexPrecedence right_min;
+};
+
+// a + b - c needs nothing, a - (b + c), a + (-1) and (a + b) \cdot c do. Powers and fractions are grouped by their braces
+static const TexOperator TEX_BINARY_OP[] =
+{
+    {"",        " + ",      "",  TEX_SUM,      TEX_SIGNED,  TEX_SUM    },
+    {"",        " - ",      "",  TEX_SUM,      TEX_SIGNED,  TEX_PRODUCT},
+    {"",        " \\cdot ", "",  TEX_PRODUCT,  TEX_PRODUCT, TEX_PRODUCT},
+    {"\\frac{", "}{",       "}", TEX_FRACTION, TEX_SIGNED,  TEX_SIGNED },
+    {"",        "^{",       "}", TEX_POWER,    TEX_ATOM,    TEX_SIGNED }
+};
+
+// ctg is \cot in LaTeX, sqrt takes its argument in braces
+static const TexOperator TEX_UNARY_OP[] =
+{
+    {"\\sin ",  "", "",  TEX_FUNCTION, TEX_SIGNED, TEX_FRACTION},
+    {"\\cos ",  "", "",  TEX_FUNCTION, TEX_SIGNED, TEX_FRACTION},
+    {"\\tan ",  "", "",  TEX_FUNCTION, TEX_SIGNED, TEX_FRACTION},
+    {"\\cot ",  "", "",  TEX_FUNCTION, TEX_SIGNED, TEX_FRACTION},
+    {"\\sqrt{", "", "}", TEX_ATOM,     TEX_SIGNED, TEX_SIGNED  },
+    {"\\ln ",   "", "",  TEX_FUNCTION, TEX_SIGNED, TEX_FRACTION},
+    {"\\exp ",  "", "",  TEX_FUNCTION, TEX_SIGNED, TEX_FRACTION}
+};
+
+/////////////////////////////////
+//LaTeX output
+/////////////////////////////////
+void               PrintFormula   (DerTree* tree, FILE* file);
+void               EmitTex        (DerTree* tree, DerNode* node, size_t line_len, StrBuf* tex);
+const TexOperator* GetTexOperator (DerNode* node);
+TexPrecedence      GetPrecedence  (DerNode* node, size_t name);
+void               PushTexChild   (WalkStack* stack, DerTree* tree, DerNode* child, TexPrecedence min);
+bool               IsJuxtaposed   (DerNode* node);
+void               EmitTexLeaf    (DerNode* node, StrBuf* tex);
+void               EmitTexText    (StrBuf* tex, const char* text);
+
+
+// Batch mode writes one formula per line, so it is never broken here
+void PrintFormula(DerTree* tree, FILE* file)
+{
+    assert(tree);
+    assert(file);
+
+    StrBuf tex = {};
+
+    EmitTex(tree, tree->root, 0, &tex);
+
+    fwrite(tex.data, sizeof(char), tex.size, file);
+
+    StrBufDestruct(&tex);
+}
+
+// Explicit stack, a frame opens its parentheses and the operation, writes what goes between the children and closes.
+// Named subtrees of tree->cse are written as u_k. A line longer than line_len is ended after an operator, 0 is no limit
+void EmitTex(DerTree* tree, DerNode* node, size_t line_len, StrBuf* tex)
+{
+    assert(tree);
+    assert(node);
+    assert(tex);
+
+    if (node == tree->nil) return;
+
+    size_t line_start = tex->size;
+
+    WalkStack stack;
+    InitWalkStack(&stack);
+
+    PushTexChild(&stack, tree, node, TEX_SIGNED);
+
+    while (stack.size > 0)
+    {
+        WalkFrame* frame = &stack.frames[stack.size - 1];
+
+        node = frame->node;
+
+        int  step      = frame->state & TEX_STEP;
+        bool is_parens = frame->state & TEX_PARENS;
+
+        if (step == TEX_OPEN)
+        {
+            if (is_parens) EmitTexText(tex, "(");
+
+            size_t name = (size_t)frame->state >> TEX_NAME_SHIFT;
+
+            if (name != 0)
+            {
+                StrBufPrintf(tex, "u_{%zu}", name);
+            }
+            else if (node->type != TYPE_BIN_OP && node->type != TYPE_UN_OP)
+            {
+                EmitTexLeaf(node, tex);
+            }
+            else
+            {
+                const TexOperator* op = GetTexOperator(node);
+
+                EmitTexText(tex, op->open);
+
+                frame->state = (frame->state & ~TEX_STEP) | TEX_VALUE;
+                if (node->left != tree->nil) PushTexChild(&stack, tree, node->left, op->left_min);
+
+                continue;
+            }
+
+            if (is_parens) EmitTexText(tex, ")");
+            stack.size--;
+        }
+        else if (step == TEX_VALUE)
+        {
+            const TexOperator* op = GetTexOperator(node);
+
+            if (IsJuxtaposed(node)) EmitTexText(tex, " ");
+            else                    EmitTexText(tex, op->middle);
+
+            // After + - \cdot the line can end, inside braces of \frac and ^ it can't
+            if (op->close[0] == '\0' && op->middle[0] != '\0' &&
+                line_len > 0 && tex->size - line_start > line_len)
+            {
+                EmitTexText(tex, "\n");
+                line_start = tex->size;
+            }
+
+            frame->state = (frame->state & ~TEX_STEP) | TEX_CLOSE;
+            PushTexChild(&stack, tree, node->right, op->right_min);
+        }
+        else
+        {
+            EmitTexText(tex, GetTexOperator(node)->close);
+
+            if (is_parens) EmitTexText(tex, ")");
+            stack.size--;
+        }
+    }
+
+    DestructWalkStack(&stack);
+}
+
+const TexOperator* GetTexOperator(DerNode* node)
+{
+    assert(node);
+    assert(node->type == TYPE_BIN_OP || node->type == TYPE_UN_OP);
+
+    return (node->type == TYPE_BIN_OP) ? &TEX_BINARY_OP[node->value.op] : &TEX_UNARY_OP[node->value.op];
+}
+
+TexPrecedence GetPrecedence(DerNode* node, size_t name)
+{
+    assert(node);
+
+    if (name != 0) return TEX_ATOM;
+
+    switch (node->type)
+    {
+        case TYPE_BIN_OP :
+        case TYPE_UN_OP  : return GetTexOperator(node)->precedence;
+        case TYPE_CONST  : return (node->value.number < 0) ? TEX_SIGNED : TEX_ATOM;
+        default          : return TEX_ATOM;
+    }
+}
+
+// The name is asked for when the child is pushed, right before it is written, so names go in the order of the text
+void PushTexChild(WalkStack* stack, DerTree* tree, DerNode* child, TexPrecedence min)
+{
+    assert(stack);
+    assert(tree);
+    assert(child);
+
+    size_t name  = (tree->cse != nullptr) ? CseName(tree, child) : 0;
+    int    state = (int)(name << TEX_NAME_SHIFT) | TEX_OPEN;
+
+    if (GetPrecedence(child, name) < min) state |= TEX_PARENS;
+
+    PushFrame(stack, child, nullptr, nullptr, state);
+}
+
+// 2 x, 3 \sin x and 4 x^{2} read better without \cdot, 2 \cdot 3 and 2 \cdot 3^{x} need it
+bool IsJuxtaposed(DerNode* node)
+{
+    assert(node);
+
+    if (node->type != TYPE_BIN_OP || node->value.op != OP_MUL) return false;
+
+    DerNode* left  = node->left;
+    DerNode* right = node->right;
+
+    if (left->type != TYPE_CONST || !(left->value.number >= 0)) return false;
+
+    if (right->type == TYPE_VAR || right->type == TYPE_UN_OP) return true;
+
+    return right->type == TYPE_BIN_OP && right->value.op == OP_POW && right->left->type != TYPE_CONST;
+}
+
+void EmitTexLeaf(DerNode* node, StrBuf* tex)
+{
+    assert(node);
+    assert(tex);
+
+    if (node->type == TYPE_VAR)
+    {
+        StrBufAppend(tex, &node->value.var, 1);
+    }
+    else if (node->type == TYPE_CONST && !isnan(node->value.number))
+    {
+        if      (isinf(node->value.number)) EmitTexText(tex, (node->value.number > 0) ? "\\infty" : "-\\infty");
+        else                                StrBufPrintf(tex, "%lg", node->value.number);
+    }
+    else
+    {
+        EmitTexText(tex, "\\mathrm{NaN}");
+    }
+}
+
+void EmitTexText(StrBuf* tex, const char* text)
+{
+    assert(tex);
+    assert(text);
+
+    StrBufAppend(tex, text, strlen(text));
+}
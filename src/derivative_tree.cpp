@@ -1,23 +1,52 @@
+#include <stdarg.h>
+#include <atomic>
+
 #include "derivative.h"
 #include "expression_loader.h"
+#include "render.h"
+
+
+const char*  STANDARD_INPUT = "src/derivative.txt";
+
+// Every dump and every formula gets files of its own, the renders of earlier ones may still be reading theirs
+static const char* TECH_FILE_FORMAT = "tech/tech%zu.tex";
+static const char* TECH_PDF_FORMAT  = "tech/tech%zu.pdf";
 
+const char*  DOT_FILE_FORMAT = "log/DerTree%zu.txt";
+const char*  JPG_FILE_FORMAT = "log/Dump%zu.jpg";
+const size_t DUMP_TEXT_LEN   = 32;
 
-const size_t MAX_INPUT_SIZE = 512;
-const char*  STANDARD_INPUT = "src\\derivative.txt";
+const size_t STR_BUF_START_CAPACITY = 256;
 
-static const char* TECH_FILE = "tech\\tech.tex";
+// Formulas are printed by batch workers and renders at the same time, every one needs a name of its own
+static std::atomic<size_t> NUM_TECH_FILES{0};
 
-const size_t DOT_CMD_SIZE = 64;
-const size_t JPG_CMD_SIZE = 32;
-const char*  STANDARD_DOT_TXT_FILE_NAME = "log\\DerTree.txt";
-const char*  DUMP_FILE_NAME = "log\\numsjpg.txt";
-const size_t NUM_STR_LEN = 5;
-const size_t NOTATION = 10;
+// Numbers the dumps of this run from 0, the pictures of an earlier run are written over
+static std::atomic<size_t> NUM_DUMPS{0};
 
 
 DerTree* NewTree                   ();
 DerTree* CopyTree                  (DerTree* tree);
 DerNode* NewNode                   (DerTree* tree);
+DerNode* CopyNodes                 (DerTree* dest, DerTree* src, DerNode* node);
+DerNode* CopySharedNodes           (DerTree* dest, DerTree* src, DerNode* node, NodeMap* copies);
+DerNode* ArenaAlloc                (NodeArena* arena);
+void     ArenaFree                 (NodeArena* arena, DerNode* node);
+void     ArenaRelease              (NodeArena* arena);
+void     ArenaRecycle              (NodeArena* arena);
+void     FreeBlocks                (NodeBlock* block);
+DerNode* InternNode                (DerTree* tree, NodeType type, Value value, DerNode* left, DerNode* right);
+size_t   HashPointer               (const void* ptr);
+size_t   HashNodeValue             (NodeType type, Value value);
+size_t   HashNodeKey               (NodeType type, Value value, DerNode* left, DerNode* right);
+bool     IsSameNodeKey             (DerNode* node, NodeType type, Value value, DerNode* left, DerNode* right);
+void     GrowNodeTable             (NodeTable* table);
+void     MakeDag                   (DerTree* tree);
+size_t   CountNodes                (DerTree* tree);
+size_t   CountNodesRecursively     (DerTree* tree, DerNode* node, NodeMap* visited);
+DerNode* NodeMapGet                (NodeMap* map, DerNode* key);
+void     NodeMapSet                (NodeMap* map, DerNode* key, DerNode* value);
+void     NodeMapDestruct           (NodeMap* map);
 void     Destruct                  (DerTree* tree);
 void     DestructNodes             (DerTree* tree, DerNode* node);
 void     DestructNode              (DerTree* tree, DerNode* node);
@@ -27,15 +56,17 @@ void     KillFatherAndBrother      (DerTree* tree, DerNode* node);
 void     Delete                    (DerTree* tree);
 DerTree* GetTree                   (const int argc, char* argv[]);
 void     SetNils                   (DerTree* tree, DerNode* node);
-DerNode* ConstructNode             (NodeType type,  ElemT value, DerNode* left, DerNode* right);
+void     GrowWalkStack             (WalkStack* stack);
+DerNode* ConstructNode             (DerTree* tree, NodeType type, Value value, DerNode* left, DerNode* right);
 void     TreeDump                  (DerTree* tree);
-void     PrintNodes                (DerTree* tree, DerNode* node, FILE* dump_file);
-void     PrintNodesHard            (DerTree* tree, DerNode* node, FILE* dump_file);
-void     GetNames                  (char* dot_cmd, char* jpg_cmd);
-size_t   GetJPGNumber              ();
+void     TreeDumpWith              (DerTree* tree, const DumpOptions* options);
+void     DumpNodes                 (DerTree* tree, const DumpOptions* options, StrBuf* dump);
+void     DumpNodeLabel             (DerNode* node, const DumpOptions* options, StrBuf* dump);
+void     StrBufPrintf              (StrBuf* buf, const char* format, ...);
+void     StrBufAppend              (StrBuf* buf, const char* text, size_t size);
+void     StrBufReserve             (StrBuf* buf, size_t size);
+void     StrBufDestruct            (StrBuf* buf);
 void     PrintExpression           (DerTree* tree);
-void     PrintExpressionRecursively(DerTree* tree, DerNode* node, FILE* tech_file);
-void     PrintTexBinOP             (FILE* file, DerNode* node);
 
 
 
@@ -52,8 +83,17 @@ DerTree* NewTree()
     tree->nil->right  = tree->nil;
     tree->nil->type   = TYPE_NIL;
 
+    // Hash, size and info of nil are 0, so a missing child adds nothing
+    tree->nil->is_known = true;
+
     tree->root = tree->nil;
 
+    if (IsStatsEnabled())
+    {
+        tree->stats = (TreeStats*)calloc(1, sizeof(TreeStats));
+        assert(tree->stats);
+    }
+
     return tree;
 }
 
@@ -61,8 +101,7 @@ DerNode* NewNode(DerTree* tree)
 {
     assert(tree);
 
-    DerNode* node = (DerNode*)calloc(1, sizeof(DerNode));
-    assert(node);
+    DerNode* node = ArenaAlloc(&tree->arena);
 
     node->left   = tree->nil;
     node->right  = tree->nil;
@@ -72,11 +111,135 @@ DerNode* NewNode(DerTree* tree)
     return node; 
 }
 
+DerNode* ArenaAlloc(NodeArena* arena)
+{
+    assert(arena);
+
+    arena->num_allocs++;
+    arena->num_live++;
+    if (arena->num_live > arena->peak_live) arena->peak_live = arena->num_live;
+
+    DerNode* node = arena->free_list;
+
+    if (node != nullptr)
+    {
+        arena->free_list = node->left;
+        arena->num_reused++;
+    }
+    else
+    {
+        if (arena->blocks == nullptr || arena->used == NODE_BLOCK_SIZE)
+        {
+            NodeBlock* block = arena->spare;
+
+            if (block != nullptr)
+            {
+                arena->spare = block->next;
+            }
+            else
+            {
+                block = (NodeBlock*)malloc(sizeof(NodeBlock));
+                assert(block);
+                arena->num_blocks++;
+            }
+
+            block->next    = arena->blocks;
+            arena->blocks  = block;
+            arena->used    = 0;
+        }
+
+        node = &arena->blocks->nodes[arena->used++];
+    }
+
+    node->value.number = 0;
+    node->type         = TYPE_NIL;
+    node->left         = nullptr;
+    node->right        = nullptr;
+    node->parent       = nullptr;
+    node->is_known     = false;
+
+    return node;
+}
+
+void ArenaFree(NodeArena* arena, DerNode* node)
+{
+    assert(arena);
+    assert(node);
+
+    node->right    = nullptr;
+    node->parent   = nullptr;
+    node->is_known = false;
+    node->value.number = 0;
+
+    node->left       = arena->free_list;
+    arena->free_list = node;
+    arena->num_frees++;
+    arena->num_live--;
+}
+
+void ArenaRelease(NodeArena* arena)
+{
+    assert(arena);
+
+    FreeBlocks(arena->blocks);
+    FreeBlocks(arena->spare);
+
+    arena->blocks    = nullptr;
+    arena->spare     = nullptr;
+    arena->used      = 0;
+    arena->free_list = nullptr;
+    arena->num_live  = 0;
+}
+
+// Drops every node but keeps the blocks, so the next tree built in this arena does not malloc them again
+void ArenaRecycle(NodeArena* arena)
+{
+    assert(arena);
+
+    while (arena->blocks != nullptr)
+    {
+        NodeBlock* block = arena->blocks;
+
+        arena->blocks = block->next;
+        block->next   = arena->spare;
+        arena->spare  = block;
+    }
+
+    arena->used      = 0;
+    arena->free_list = nullptr;
+    arena->num_live  = 0;
+}
+
+void FreeBlocks(NodeBlock* block)
+{
+    while (block != nullptr)
+    {
+        NodeBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+}
+
 void Destruct(DerTree* tree)
 {
     assert(tree);
 
-    DestructNodes(tree, tree->root);
+    FoldTreeStats(tree);
+
+    ArenaRelease(&tree->arena);
+    tree->root = nullptr;
+
+    if (tree->simplify_memo != nullptr)
+    {
+        NodeMapDestruct(tree->simplify_memo);
+        free(tree->simplify_memo);
+        tree->simplify_memo = nullptr;
+    }
+
+    free(tree->table.nodes);
+    tree->table.nodes    = nullptr;
+    tree->table.size     = 0;
+    tree->table.capacity = 0;
 
     free(tree->nil);
     tree->nil = nullptr;
@@ -89,10 +252,27 @@ void DestructNodes(DerTree* tree, DerNode* node)
 
     if (node == tree->nil) return;
 
-    DestructNodes(tree, node->left);
-    DestructNodes(tree, node->right);
+    // Shared nodes may still be referenced elsewhere, they die with the arena
+    if (tree->is_dag) return;
 
-    DestructNode(tree, node);
+    // Rotating the left child up leaves a node without one, which goes with its right child next.
+    // No stack, so left-deep sums of any length are fine
+    while (node != tree->nil)
+    {
+        DerNode* left = node->left;
+
+        if (left != tree->nil)
+        {
+            node->left  = left->right;
+            left->right = node;
+            node        = left;
+            continue;
+        }
+
+        DerNode* right = node->right;
+        DestructNode(tree, node);
+        node = right;
+    }
 }
 
 void DestructNode(DerTree* tree, DerNode* node)
@@ -100,28 +280,277 @@ void DestructNode(DerTree* tree, DerNode* node)
     assert(tree);
     assert(node);
 
-    if (node == tree->nil) return;
-
-    node->right  = nullptr;
-    node->left   = nullptr;
-    node->parent = nullptr;
-
-    node->value.number = 0;
+    // Same as in DestructNodes, an interned node may have other parents
+    if (node == tree->nil || tree->is_dag) return;
 
-    free(node);
+    ArenaFree(&tree->arena, node);
 }
 
 DerTree* CopyTree(DerTree* tree)
 {
-    DerTree* new_tree = (DerTree*)calloc(1, sizeof(DerTree));
-    assert(new_tree);
+    assert(tree);
+
+    DerTree* new_tree = NewTree();
 
-    new_tree->root = CopySubTree(tree, tree->root);
-    new_tree->nil  = tree->nil;
+    if (tree->is_dag)
+    {
+        new_tree->is_dag = true;
+
+        NodeMap copies = {};
+        new_tree->root = CopySharedNodes(new_tree, tree, tree->root, &copies);
+        NodeMapDestruct(&copies);
+    }
+    else
+    {
+        new_tree->root = CopyNodes(new_tree, tree, tree->root);
+    }
 
     return new_tree;
 }
 
+// Children before their parent, so a DAG copy interns them first. Finished copies go onto copies
+DerNode* CopyNodes(DerTree* dest, DerTree* src, DerNode* node)
+{
+    assert(dest);
+    assert(src);
+    assert(node);
+
+    if (node == src->nil)
+    {
+        return dest->nil;
+    }
+
+    WalkStack stack;
+    WalkStack copies;
+    InitWalkStack(&stack);
+    InitWalkStack(&copies);
+
+    PushFrame(&stack, node, nullptr, nullptr, 0);
+
+    while (stack.size > 0)
+    {
+        WalkFrame frame = stack.frames[--stack.size];
+        node            = frame.node;
+
+        if (frame.state == 0)
+        {
+            PushFrame(&stack, node, nullptr, nullptr, 1);
+            if (node->right != src->nil) PushFrame(&stack, node->right, nullptr, nullptr, 0);
+            if (node->left  != src->nil) PushFrame(&stack, node->left,  nullptr, nullptr, 0);
+            continue;
+        }
+
+        DerNode* right = (node->right != src->nil) ? copies.frames[--copies.size].node : dest->nil;
+        DerNode* left  = (node->left  != src->nil) ? copies.frames[--copies.size].node : dest->nil;
+
+        DerNode* copy = ConstructNode(dest, node->type, node->value, left, right);
+
+        if (!dest->is_dag)
+        {
+            if (left  != dest->nil) left->parent  = copy;
+            if (right != dest->nil) right->parent = copy;
+
+            copy->parent = dest->nil;
+        }
+
+        PushFrame(&copies, copy, nullptr, nullptr, 0);
+    }
+
+    DerNode* copy = copies.frames[0].node;
+
+    DestructWalkStack(&stack);
+    DestructWalkStack(&copies);
+
+    return copy;
+}
+
+// Same walk as CopyNodes, a node met again is taken from the map, it is finished by then
+DerNode* CopySharedNodes(DerTree* dest, DerTree* src, DerNode* node, NodeMap* copies)
+{
+    assert(dest);
+    assert(src);
+    assert(node);
+    assert(copies);
+
+    if (node == src->nil)
+    {
+        return dest->nil;
+    }
+
+    WalkStack stack;
+    WalkStack values;
+    InitWalkStack(&stack);
+    InitWalkStack(&values);
+
+    PushFrame(&stack, node, nullptr, nullptr, 0);
+
+    while (stack.size > 0)
+    {
+        WalkFrame frame = stack.frames[--stack.size];
+        node            = frame.node;
+
+        if (frame.state == 0)
+        {
+            DerNode* copy = NodeMapGet(copies, node);
+
+            if (copy != nullptr)
+            {
+                PushFrame(&values, copy, nullptr, nullptr, 0);
+                continue;
+            }
+
+            PushFrame(&stack, node, nullptr, nullptr, 1);
+            if (node->right != src->nil) PushFrame(&stack, node->right, nullptr, nullptr, 0);
+            if (node->left  != src->nil) PushFrame(&stack, node->left,  nullptr, nullptr, 0);
+            continue;
+        }
+
+        DerNode* right = (node->right != src->nil) ? values.frames[--values.size].node : dest->nil;
+        DerNode* left  = (node->left  != src->nil) ? values.frames[--values.size].node : dest->nil;
+
+        DerNode* copy = ConstructNode(dest, node->type, node->value, left, right);
+        NodeMapSet(copies, node, copy);
+
+        PushFrame(&values, copy, nullptr, nullptr, 0);
+    }
+
+    DerNode* copy = values.frames[0].node;
+
+    DestructWalkStack(&stack);
+    DestructWalkStack(&values);
+
+    return copy;
+}
+
+void MakeDag(DerTree* tree)
+{
+    assert(tree);
+
+    if (tree->is_dag) return;
+
+    // The old nodes stay in the arena until Destruct, interning allocates new ones
+    tree->is_dag = true;
+    tree->root   = CopyNodes(tree, tree, tree->root);
+}
+
+size_t CountNodes(DerTree* tree)
+{
+    assert(tree);
+
+    NodeMap visited = {};
+    size_t  count   = CountNodesRecursively(tree, tree->root, &visited);
+    NodeMapDestruct(&visited);
+
+    return count;
+}
+
+size_t CountNodesRecursively(DerTree* tree, DerNode* node, NodeMap* visited)
+{
+    assert(tree);
+    assert(node);
+    assert(visited);
+
+    size_t count = 0;
+
+    WalkStack stack;
+    InitWalkStack(&stack);
+
+    PushFrame(&stack, node, nullptr, nullptr, 0);
+
+    while (stack.size > 0)
+    {
+        node = stack.frames[--stack.size].node;
+
+        if (node == tree->nil || NodeMapGet(visited, node) != nullptr) continue;
+
+        NodeMapSet(visited, node, node);
+        count++;
+
+        PushFrame(&stack, node->right, nullptr, nullptr, 0);
+        PushFrame(&stack, node->left,  nullptr, nullptr, 0);
+    }
+
+    DestructWalkStack(&stack);
+
+    return count;
+}
+
+size_t HashPointer(const void* ptr)
+{
+    size_t key = (size_t)ptr;
+
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+
+    return key;
+}
+
+DerNode* NodeMapGet(NodeMap* map, DerNode* key)
+{
+    assert(map);
+
+    if (map->capacity == 0) return nullptr;
+
+    size_t mask = map->capacity - 1;
+
+    for (size_t i = HashPointer(key) & mask; map->keys[i] != nullptr; i = (i + 1) & mask)
+    {
+        if (map->keys[i] == key) return map->values[i];
+    }
+
+    return nullptr;
+}
+
+void NodeMapSet(NodeMap* map, DerNode* key, DerNode* value)
+{
+    assert(map);
+    assert(key);
+
+    if (2 * (map->size + 1) > map->capacity)
+    {
+        NodeMap grown  = {};
+        grown.capacity = (map->capacity == 0) ? 64 : 2 * map->capacity;
+        grown.keys     = (DerNode**)calloc(grown.capacity, sizeof(DerNode*));
+        grown.values   = (DerNode**)calloc(grown.capacity, sizeof(DerNode*));
+        assert(grown.keys);
+        assert(grown.values);
+
+        for (size_t i = 0; i < map->capacity; ++i)
+        {
+            if (map->keys[i] != nullptr) NodeMapSet(&grown, map->keys[i], map->values[i]);
+        }
+
+        NodeMapDestruct(map);
+        *map = grown;
+    }
+
+    size_t mask = map->capacity - 1;
+    size_t i    = HashPointer(key) & mask;
+
+    while (map->keys[i] != nullptr && map->keys[i] != key)
+    {
+        i = (i + 1) & mask;
+    }
+
+    if (map->keys[i] == nullptr) map->size++;
+
+    map->keys[i]   = key;
+    map->values[i] = value;
+}
+
+void NodeMapDestruct(NodeMap* map)
+{
+    assert(map);
+
+    free(map->keys);
+    free(map->values);
+
+    map->keys     = nullptr;
+    map->values   = nullptr;
+    map->size     = 0;
+    map->capacity = 0;
+}
 
 void KillChildren(DerTree* tree, DerNode* node)
 {
@@ -132,6 +561,8 @@ void KillChildren(DerTree* tree, DerNode* node)
     DestructNodes(tree, node->left);
     node->left  = tree->nil;
     node->right = tree->nil;
+
+    InvalidateNode(tree, node);
 }
 
 void KillYourselfAndChildren(DerTree* tree, DerNode* node, ElemT new_value)
@@ -177,6 +608,8 @@ void KillFatherAndBrother(DerTree* tree, DerNode* node)
         tree->root = node;
     }
 
+    InvalidateNode(tree, node->parent);
+
     DestructNodes(tree, father);
 
 }
@@ -188,54 +621,102 @@ void Delete(DerTree* tree)
     free(tree);
 }
 
+// Parses the first expression of the input, it may span several lines
 DerTree* GetTree(const int argc, char* argv[])
 {
-    FILE* input = nullptr;
+    const char* name        = (argc - 1 > 0) ? argv[1] : STANDARD_INPUT;
+    double      parse_start = StatsClock();
 
-    if (argc - 1 > 0)
-    {
-        input = fopen(argv[1], "r");
-        assert(input);
-    }
-    else
+    InputFile input = {};
+    if (!MapInput(name, &input))
     {
-        input = fopen(STANDARD_INPUT, "r");
-        assert(input);
+        printf("Can't read %s\n", name);
+        return nullptr;
     }
 
-    DerTree* tree = NewTree();
+    const char* end   = input.data + input.size;
+    const char* start = SkipBlanks(input.data, end);
 
-    char* buffer = (char*)calloc(MAX_INPUT_SIZE, sizeof(char));
-    assert(buffer);
+    DerTree* tree = NewTree();
+    tree->root    = GetAnswer(tree, start, FindExpressionEnd(start, end));
 
-    fgets(buffer, MAX_INPUT_SIZE, input);
+    UnmapInput(&input);
 
-    tree->root = GetAnswer(buffer);
+    if (tree->root == nullptr)
+    {
+        Destruct(tree);
+        Delete(tree);
+        return nullptr;
+    }
 
     SetNils(tree, tree->root);
 
-    free(buffer);
-    fclose(input);
+    StatsRecord(tree, PHASE_GET_TREE, parse_start);
 
     return tree;
 }
 
 void SetNils(DerTree* tree, DerNode* node)
 {
-    if (node == tree->nil) return;
+    assert(tree);
+    assert(node);
+
+    WalkStack stack;
+    InitWalkStack(&stack);
+
+    PushFrame(&stack, node, nullptr, nullptr, 0);
+
+    while (stack.size > 0)
+    {
+        node = stack.frames[--stack.size].node;
+
+        if (node == tree->nil) continue;
+
+        if (node->parent == nullptr) node->parent = tree->nil;
+        if (node->right  == nullptr) node->right  = tree->nil;
+        if (node->left   == nullptr) node->left   = tree->nil;
+
+        if (node->right != tree->nil) PushFrame(&stack, node->right, nullptr, nullptr, 0);
+        if (node->left  != tree->nil) PushFrame(&stack, node->left,  nullptr, nullptr, 0);
+    }
+
+    DestructWalkStack(&stack);
+}
+
+void GrowWalkStack(WalkStack* stack)
+{
+    assert(stack);
+
+    size_t     capacity = 2 * stack->capacity;
+    WalkFrame* frames   = nullptr;
+
+    if (stack->frames == stack->local)
+    {
+        frames = (WalkFrame*)malloc(capacity * sizeof(WalkFrame));
+        assert(frames);
 
-    if (node->parent == nullptr) node->parent = tree->nil;
-    if (node->right  == nullptr) node->right  = tree->nil;
-    if (node->left   == nullptr) node->left   = tree->nil;
+        memcpy(frames, stack->local, stack->size * sizeof(WalkFrame));
+    }
+    else
+    {
+        frames = (WalkFrame*)realloc(stack->frames, capacity * sizeof(WalkFrame));
+        assert(frames);
+    }
 
-    SetNils(tree, node->right);
-    SetNils(tree, node->left);
+    stack->frames   = frames;
+    stack->capacity = capacity;
 }
 
-DerNode* ConstructNode(NodeType type, Value value, DerNode* left, DerNode* right)
+DerNode* ConstructNode(DerTree* tree, NodeType type, Value value, DerNode* left, DerNode* right)
 {
-    DerNode* node = (DerNode*)calloc(1, sizeof(DerNode));
-    assert(node);
+    assert(tree);
+
+    if (tree->is_dag)
+    {
+        return InternNode(tree, type, value, left, right);
+    }
+
+    DerNode* node = ArenaAlloc(&tree->arena);
 
     node->type  = type;
     node->value = value;
@@ -256,293 +737,391 @@ DerNode* ConstructNode(NodeType type, Value value, DerNode* left, DerNode* right
     return node;
 }
 
-void TreeDump(DerTree* tree)
+DerNode* InternNode(DerTree* tree, NodeType type, Value value, DerNode* left, DerNode* right)
 {
     assert(tree);
 
-    FILE* dump_file = fopen(STANDARD_DOT_TXT_FILE_NAME, "w");
+    if (left  == nullptr) left  = tree->nil;
+    if (right == nullptr) right = tree->nil;
 
-    fprintf(dump_file, "digraph G{\n");
-    fprintf(dump_file, "node [shape=\"circle\"]\n");
+    NodeTable* table = &tree->table;
 
-    PrintNodesHard(tree, tree->root, dump_file);
+    if (2 * (table->size + 1) > table->capacity)
+    {
+        GrowNodeTable(table);
+    }
 
-    fprintf(dump_file, "}");
+    size_t mask = table->capacity - 1;
+    size_t i    = HashNodeKey(type, value, left, right) & mask;
 
-    fclose(dump_file);
+    for (; table->nodes[i] != nullptr; i = (i + 1) & mask)
+    {
+        if (IsSameNodeKey(table->nodes[i], type, value, left, right)) return table->nodes[i];
+    }
 
-    char dot_cmd[DOT_CMD_SIZE] = "";
-    snprintf(dot_cmd, DOT_CMD_SIZE, "dot -Tjpg %s -o log\\Dump", STANDARD_DOT_TXT_FILE_NAME);
-    char jpg_cmd[JPG_CMD_SIZE] = "start log\\Dump";
-    
-    GetNames(dot_cmd, jpg_cmd);
+    DerNode* node = ArenaAlloc(&tree->arena);
+
+    node->type   = type;
+    node->value  = value;
+    node->left   = left;
+    node->right  = right;
+    node->parent = tree->nil;
 
-    system(dot_cmd);
-    system(jpg_cmd);
+    // Interned nodes never change, their info is set once
+    SetNodeInfo(tree, node);
+
+    table->nodes[i] = node;
+    table->size++;
+
+    return node;
 }
 
-void PrintNodes(DerTree* tree, DerNode* node, FILE* dump_file)
+size_t HashNodeValue(NodeType type, Value value)
 {
-    assert(tree);
-    assert(dump_file);
+    size_t key = (size_t)type;
 
-    if (node->type == NODE_ERROR || node->type == TYPE_NIL)
-    {
-        fprintf(dump_file, "\"%p\"[style=\"filled\", fillcolor=\"#EF4C3A\", label=\"%lg\"]",
-                node, node->value.number);
-    }
-    else if (node->type == TYPE_CONST)
+    switch (type)
     {
-        fprintf(dump_file, "\"%p\"[style=\"filled\", fillcolor=\"#9BC3F7\", label=\"%lg\"]",
-                node, node->value.number);
-    }
-    else if (node->type == TYPE_VAR)
-    { 
-        fprintf(dump_file, "\"%p\"[style=\"filled\", fillcolor=\"#C6F7DD\", label=\"%c\"]",
-                node, node->value.var);
-    }
-    else if (node->type == TYPE_BIN_OP)
-    {
-        fprintf(dump_file, "\"%p\"[style=\"filled\", fillcolor=\"#F6F7C6\", label=\"%s\"]",
-                node, BINARY_OP[node->value.op]);
-    }
-    else if (node->type == TYPE_UN_OP)
-    {
-        fprintf(dump_file, "\"%p\"[style=\"filled\", fillcolor=\"#F6F796\", label=\"%s\"]",
-                node, UNARY_OP[node->value.op]);
+        case TYPE_CONST :
+        case NODE_ERROR :
+        {
+            size_t bits = 0;
+            memcpy(&bits, &value.number, sizeof(value.number));
+            key = key * 31 + bits;
+            break;
+        }
+        case TYPE_VAR :
+        {
+            key = key * 31 + (size_t)value.var;
+            break;
+        }
+        default :
+        {
+            key = key * 31 + (size_t)value.op;
+            break;
+        }
     }
 
-    if (node->left != tree->nil && node->left)
-    {
-        fprintf(dump_file, "\"%p\":sw->\"%p\";\n", node, node->left);
-        PrintNodes(tree, node->left, dump_file);
-    }
-    
-    if (node->right != tree->nil && node->right)
-    {
-        fprintf(dump_file, "\"%p\":se->\"%p\";\n", node, node->right);
-        PrintNodes(tree, node->right, dump_file);
-    }
+    return key;
 }
 
-void PrintNodesHard(DerTree* tree, DerNode* node, FILE* dump_file)
+size_t HashNodeKey(NodeType type, Value value, DerNode* left, DerNode* right)
 {
-    assert(tree);
-    assert(dump_file);
+    size_t key = HashNodeValue(type, value);
 
-    if (node->type == NODE_ERROR || node->type == TYPE_NIL)
-    {
-        fprintf(dump_file, "\"%p\"[shape=\"record\", style=\"filled\", fillcolor=\"#EF4C3A\", label=\"%lg|p: %p|%p|{l: %p|r: %p}\"]",
-                node, node->value.number, node->parent, node, node->left, node->right);
-    }
-    else if (node->type == TYPE_CONST)
-    {
-        fprintf(dump_file, "\"%p\"[shape=\"record\", style=\"filled\", fillcolor=\"#9BC3F7\", label=\"%lg|p: %p|%p|{l: %p|r: %p}\"]",
-                node, node->value.number, node->parent, node, node->left, node->right);
-    }
-    else if (node->type == TYPE_VAR)
-    { 
-        fprintf(dump_file, "\"%p\"[shape=\"record\", style=\"filled\", fillcolor=\"#C6F7DD\", label=\"%c|p: %p|%p|{l: %p|r: %p}\"]",
-                node, node->value.var, node->parent, node, node->left, node->right);
-    }
-    else if (node->type == TYPE_BIN_OP)
-    {
-        fprintf(dump_file, "\"%p\"[shape=\"record\", style=\"filled\", fillcolor=\"#F6F7C6\", label=\"%s|p: %p|%p|{l: %p|r: %p}\"]",
-                node, BINARY_OP[node->value.op], node->parent, node, node->left, node->right);
-    }
-    else
-    {
-        fprintf(dump_file, "\"%p\"[shape=\"record\", style=\"filled\", fillcolor=\"#F6F796\", label=\"%s|p: %p|%p|{l: %p|r: %p}\"]",
-                node, UNARY_OP[node->value.op], node->parent, node, node->left, node->right);
-    }
+    key = key * 0x9e3779b97f4a7c15ULL + (size_t)left;
+    key = key * 0x9e3779b97f4a7c15ULL + (size_t)right;
 
-    if (node->left != tree->nil && node->left)
-    {
-        fprintf(dump_file, "\"%p\":sw->\"%p\";\n", node, node->left);
-        PrintNodesHard(tree, node->left, dump_file);
-    }
-    
-    if (node->right != tree->nil && node->right)
+    return key ^ (key >> 29);
+}
+
+bool IsSameNodeKey(DerNode* node, NodeType type, Value value, DerNode* left, DerNode* right)
+{
+    assert(node);
+
+    if (node->type != type || node->left != left || node->right != right) return false;
+
+    switch (type)
     {
-        fprintf(dump_file, "\"%p\":se->\"%p\";\n", node, node->right);
-        PrintNodesHard(tree, node->right, dump_file);
+        case TYPE_CONST :
+        case NODE_ERROR :
+        {
+            return memcmp(&node->value.number, &value.number, sizeof(value.number)) == 0;
+        }
+        case TYPE_VAR :
+        {
+            return node->value.var == value.var;
+        }
+        default :
+        {
+            return node->value.op == value.op;
+        }
     }
 }
 
-void GetNames(char* dot_cmd, char* jpg_cmd)
+void GrowNodeTable(NodeTable* table)
 {
-    assert(dot_cmd);
-    assert(jpg_cmd);
+    assert(table);
 
-    size_t num = GetJPGNumber();
+    size_t    old_capacity = table->capacity;
+    DerNode** old_nodes    = table->nodes;
 
-    char num_str[NUM_STR_LEN] = "";
-    itoa(num, num_str, NOTATION);
-    char extension[] = ".jpg";
+    table->capacity = (old_capacity == 0) ? 256 : 2 * old_capacity;
+    table->nodes    = (DerNode**)calloc(table->capacity, sizeof(DerNode*));
+    assert(table->nodes);
 
+    size_t mask = table->capacity - 1;
 
-    strcat(dot_cmd, num_str);
-    strcat(dot_cmd, extension);
-    
-    strcat(jpg_cmd, num_str);
-    strcat(jpg_cmd, extension);
-}
+    for (size_t j = 0; j < old_capacity; ++j)
+    {
+        DerNode* node = old_nodes[j];
+        if (node == nullptr) continue;
 
-size_t GetJPGNumber()
-{
-    FILE* numjpgs = fopen(DUMP_FILE_NAME, "r");
+        size_t i = HashNodeKey(node->type, node->value, node->left, node->right) & mask;
+        while (table->nodes[i] != nullptr)
+        {
+            i = (i + 1) & mask;
+        }
 
-    size_t num = 0;
-    
-    if (numjpgs != nullptr)
-    {
-        fscanf(numjpgs, "%llu", &num);
+        table->nodes[i] = node;
     }
 
-    fclose(numjpgs);
+    free(old_nodes);
+}
 
-    numjpgs = fopen(DUMP_FILE_NAME, "w");
-    fprintf(numjpgs, "%llu", num + 1);
-    fclose(numjpgs);
-    
-    return num;
+void TreeDump(DerTree* tree)
+{
+    assert(tree);
+
+    DumpOptions options = {};
+    TreeDumpWith(tree, &options);
 }
 
-void PrintExpression(DerTree* tree)
+void TreeDumpWith(DerTree* tree, const DumpOptions* options)
 {
-    FILE* tech_file = fopen(TECH_FILE, "w");
-    assert(tech_file);
+    assert(tree);
+    assert(options);
 
-    fprintf(tech_file, "\\documentclass[32pt]{article}\n"
-                       "\\begin{document}             \n$");
+    double start = StatsClock();
 
-    PrintExpressionRecursively(tree, tree->root, tech_file);
+    size_t num = NUM_DUMPS++;
 
-    fprintf(tech_file,"$\n\\end{document}\n");
+    char dot_name[RENDER_PATH_LEN] = "";
+    char jpg_name[RENDER_PATH_LEN] = "";
+    snprintf(dot_name, RENDER_PATH_LEN, DOT_FILE_FORMAT, num);
+    snprintf(jpg_name, RENDER_PATH_LEN, JPG_FILE_FORMAT, num);
 
-    fclose(tech_file);
-    system("tech");
-}
+    StrBuf dump = {};
 
-bool IsMul(DerNode* node)
-{
-    return node->type == TYPE_BIN_OP && node->value.op == OP_MUL;
-}
+    StrBufPrintf(&dump, "digraph G{\n");
+    StrBufPrintf(&dump, "node [shape=\"circle\", style=\"filled\"]\n");
 
-bool IsSum(DerNode* node)
-{
-    return node->type == TYPE_BIN_OP && 
-    (node->value.op == OP_ADD || node->value.op == OP_SUB);
-}
+    DumpNodes(tree, options, &dump);
 
-bool IsDiv(DerNode* node)
-{
-    return node->type == TYPE_BIN_OP && node->value.op == OP_DIV;
-}
+    StrBufPrintf(&dump, "}");
 
-bool IsPow(DerNode* node)
-{
-    return node->type == TYPE_BIN_OP && node->value.op == OP_POW;
-}
+    FILE* dump_file = fopen(dot_name, "w");
+    assert(dump_file);
 
-bool IsList(DerTree* tree, DerNode* node)
-{
-    return node->right == tree->nil && node->left == tree->nil;
-}
+    fwrite(dump.data, sizeof(char), dump.size, dump_file);
+    fclose(dump_file);
 
-bool IsUnOP(DerNode* node)
-{
-    return node->type == TYPE_UN_OP;
-}
+    StrBufDestruct(&dump);
 
-bool BracketNeeded(DerTree* tree, DerNode* node)
-{
-    return (!IsList(tree, node) && (IsMul(node->parent) && IsSum(node))) ||
-           (IsPow(node->parent) && node->parent->left == node && !IsList(tree, node)) ;
+    // dot runs in the background, the picture opens when it is ready
+    QueueRender(RENDER_DOT, dot_name, jpg_name);
+
+    StatsRecord(tree, PHASE_DUMP, start);
 }
 
-void PrintExpressionRecursively(DerTree* tree, DerNode* node, FILE* tech_file)
+// A shared DAG node is written once. A node at max_depth or, below the root, with more than collapse_size
+// nodes under it is written as one box with its size instead of its subtree
+void DumpNodes(DerTree* tree, const DumpOptions* options, StrBuf* dump)
 {
-    if (node == tree->nil) return;
+    assert(tree);
+    assert(options);
+    assert(dump);
 
-    if (BracketNeeded(tree, node))
-    {
-        fprintf(tech_file, "{(");    
-    }
-    else
-    {
-        fprintf(tech_file, "{");
-    }
+    if (tree->root == nullptr || tree->root == tree->nil) return;
 
-    PrintExpressionRecursively(tree, node->left, tech_file);
-    
-    if (node->type == TYPE_CONST)
-    {
-        fprintf(tech_file, "%lg", node->value.number);
-    }
-    else if (node->type == TYPE_VAR)
-    { 
-        fprintf(tech_file, "%c", node->value.var);
-    }
-    else if (node->type == TYPE_BIN_OP)
-    {
-        PrintTexBinOP(tech_file, node);
-    }
-    else
-    {
-        fprintf(tech_file, "\\%s ", UNARY_OP[node->value.op]);
-    }
-    PrintExpressionRecursively(tree, node->right, tech_file);
+    RefreshNodeInfo(tree, tree->root);
 
-    if (BracketNeeded(tree, node))
-    {
-        fprintf(tech_file, "})");    
-    }
-    else
+    NodeMap   visited = {};
+    WalkStack stack;
+    InitWalkStack(&stack);
+
+    PushFrame(&stack, tree->root, nullptr, nullptr, 0);
+
+    while (stack.size > 0)
     {
-        fprintf(tech_file, "}");
+        WalkFrame frame = stack.frames[--stack.size];
+        DerNode*  node  = frame.node;
+        size_t    depth = (size_t)frame.state;
+
+        if (NodeMapGet(&visited, node) != nullptr) continue;
+        NodeMapSet(&visited, node, node);
+
+        bool has_children = (node->left != tree->nil && node->left) || (node->right != tree->nil && node->right);
+
+        if (has_children && ((options->max_depth     != 0 && depth >= options->max_depth) ||
+                             (options->collapse_size != 0 && depth > 0 && node->size > options->collapse_size)))
+        {
+            StrBufPrintf(dump, "\"%p\"[shape=\"box\", fillcolor=\"#D0D0D0\", label=\"%s ... %u nodes\"]\n", node,
+                         (node->type == TYPE_BIN_OP) ? BINARY_OP[node->value.op] : UNARY_OP[node->value.op], node->size);
+            continue;
+        }
+
+        DumpNodeLabel(node, options, dump);
+
+        // Pushed right first, so the left subtree is written first
+        if (node->right != tree->nil && node->right)
+        {
+            StrBufPrintf(dump, "\"%p\":se->\"%p\";\n", node, node->right);
+            PushFrame(&stack, node->right, nullptr, nullptr, (int)depth + 1);
+        }
+
+        if (node->left != tree->nil && node->left)
+        {
+            StrBufPrintf(dump, "\"%p\":sw->\"%p\";\n", node, node->left);
+            PushFrame(&stack, node->left, nullptr, nullptr, (int)depth + 1);
+        }
     }
+
+    DestructWalkStack(&stack);
+    NodeMapDestruct(&visited);
 }
 
-void PrintTexBinOP(FILE* file, DerNode* node)
+// A compact label is the value alone, a full one is a record with the parent and the children
+void DumpNodeLabel(DerNode* node, const DumpOptions* options, StrBuf* dump)
 {
-    assert(file);
     assert(node);
+    assert(options);
+    assert(dump);
+
+    const char* color = "#F6F796";
+    char        text[DUMP_TEXT_LEN] = "";
 
-    switch (node->value.op)
+    switch (node->type)
     {
-        case OP_ADD :
+        case NODE_ERROR :
+        case TYPE_NIL :
         {
-            fprintf(file, " + ");
+            color = "#EF4C3A";
+            snprintf(text, DUMP_TEXT_LEN, "%lg", node->value.number);
             break;
         }
-        case OP_SUB :
+        case TYPE_CONST :
         {
-            fprintf(file, " - ");
+            color = "#9BC3F7";
+            snprintf(text, DUMP_TEXT_LEN, "%lg", node->value.number);
             break;
         }
-        case OP_MUL :
+        case TYPE_VAR :
         {
-            if (node->left->type != TYPE_CONST)
-            {
-                fprintf(file, " \\cdot ");
-            }
+            color = "#C6F7DD";
+            snprintf(text, DUMP_TEXT_LEN, "%c", node->value.var);
             break;
         }
-        case OP_DIV :
+        case TYPE_BIN_OP :
         {
-            fprintf(file, " \\over ");
+            color = "#F6F7C6";
+            snprintf(text, DUMP_TEXT_LEN, "%s", BINARY_OP[node->value.op]);
             break;
         }
-        case OP_POW :
+        default :
         {
-            fprintf(file, " ^ ");
+            snprintf(text, DUMP_TEXT_LEN, "%s", UNARY_OP[node->value.op]);
             break;
         }
-        default :
+    }
+
+    if (options->is_compact)
+    {
+        StrBufPrintf(dump, "\"%p\"[fillcolor=\"%s\", label=\"%s\"]\n", node, color, text);
+        return;
+    }
+
+    StrBufPrintf(dump, "\"%p\"[shape=\"record\", fillcolor=\"%s\", label=\"%s|p: %p|%p|{l: %p|r: %p}\"]\n",
+                 node, color, text, node->parent, node, node->left, node->right);
+}
+
+// Grows by doubling, data always ends with a zero
+void StrBufPrintf(StrBuf* buf, const char* format, ...)
+{
+    assert(buf);
+    assert(format);
+
+    va_list args;
+
+    while (true)
+    {
+        size_t space = buf->capacity - buf->size;
+
+        va_start(args, format);
+        int length = vsnprintf(buf->data + buf->size, space, format, args);
+        va_end(args);
+
+        assert(length >= 0);
+
+        if ((size_t)length < space)
         {
-            printf("Tex error : unknown binary command\nline = %d", __LINE__);
-            break;
+            buf->size += (size_t)length;
+            return;
         }
+
+        StrBufReserve(buf, (size_t)length + 1);
+    }
+}
+
+void StrBufAppend(StrBuf* buf, const char* text, size_t size)
+{
+    assert(buf);
+    assert(text);
+
+    StrBufReserve(buf, size + 1);
+
+    memcpy(buf->data + buf->size, text, size);
+
+    buf->size += size;
+    buf->data[buf->size] = '\0';
+}
+
+// Room for size more chars
+void StrBufReserve(StrBuf* buf, size_t size)
+{
+    assert(buf);
+
+    if (buf->size + size <= buf->capacity) return;
+
+    size_t capacity = (buf->capacity == 0) ? STR_BUF_START_CAPACITY : buf->capacity;
+
+    while (capacity < buf->size + size)
+    {
+        capacity *= 2;
     }
-}
\ No newline at end of file
+
+    buf->data = (char*)realloc(buf->data, capacity);
+    assert(buf->data);
+
+    buf->capacity = capacity;
+}
+
+void StrBufDestruct(StrBuf* buf)
+{
+    assert(buf);
+
+    free(buf->data);
+
+    *buf = {};
+}
+
+void PrintExpression(DerTree* tree)
+{
+    assert(tree);
+
+    double start = StatsClock();
+
+    size_t num = NUM_TECH_FILES++;
+
+    char tex_name[RENDER_PATH_LEN] = "";
+    char pdf_name[RENDER_PATH_LEN] = "";
+    snprintf(tex_name, RENDER_PATH_LEN, TECH_FILE_FORMAT, num);
+    snprintf(pdf_name, RENDER_PATH_LEN, TECH_PDF_FORMAT,  num);
+
+    FILE* tech_file = fopen(tex_name, "w");
+    assert(tech_file);
+
+    fprintf(tech_file, "\\documentclass[32pt]{article}\n"
+                       "\\begin{document}             \n");
+
+    PrintSharedFormula(tree, tech_file);
+
+    fprintf(tech_file,"\n\\end{document}\n");
+
+    fclose(tech_file);
+
+    // pdflatex runs in the background, the pdf opens when it is ready
+    QueueRender(RENDER_TEX, tex_name, pdf_name);
+
+    StatsRecord(tree, PHASE_PRINT, start);
+}
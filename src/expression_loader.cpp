@@ -1,35 +1,149 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "derivative.h"
 #include "expression_loader.h"
 
-void IgnoreSpaces(Buffer* buffer)
+
+// A line ending after one of these leaves the expression open, so it goes on with the next line
+static const char* CONTINUATION = "+-*/^(";
+
+// Inside brackets a line starting with one of these goes on with the line before
+static const char* CONTINUATION_START = "+-*/^)";
+
+bool MapInput(const char* name, InputFile* input)
 {
-    assert(buffer);
-    
-    while (*buffer->str == ' ')
+    assert(name);
+    assert(input);
+
+    int fd = open(name, O_RDONLY);
+    if (fd == -1) return false;
+
+    struct stat info = {};
+    if (fstat(fd, &info) == -1)
     {
-        buffer->str++;
+        close(fd);
+        return false;
     }
+
+    input->size = (size_t)info.st_size;
+    input->data = "";
+
+    if (input->size > 0)
+    {
+        void* data = mmap(nullptr, input->size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (data == MAP_FAILED)
+        {
+            close(fd);
+            return false;
+        }
+
+        madvise(data, input->size, MADV_SEQUENTIAL);
+        input->data = (const char*)data;
+    }
+
+    close(fd);
+
+    return true;
+}
+
+void UnmapInput(InputFile* input)
+{
+    assert(input);
+
+    if (input->size > 0) munmap((void*)input->data, input->size);
+
+    input->data = nullptr;
+    input->size = 0;
+}
+
+const char* SkipBlanks(const char* str, const char* end)
+{
+    assert(str);
+    assert(end);
+
+    while (str < end && isspace(*str)) str++;
+
+    return str;
 }
 
-DerNode* GetAnswer(char* str)
+// An expression ends at a line break unless the line ends with an operator or, inside brackets, the next line
+// goes on with one or with ')'. A blank line always ends it, so one unclosed bracket can't take the lines after it
+const char* FindExpressionEnd(const char* str, const char* end)
 {
     assert(str);
+    assert(end);
+
+    long depth = 0;
+    char last  = '\0';
+
+    for (; str < end; ++str)
+    {
+        if (*str == '\n' && last != '\0')
+        {
+            const char* next = str + 1;
+            while (next < end && *next != '\n' && isspace(*next)) next++;
+
+            if (next == end || *next == '\n') return str;
+
+            bool is_continued = strchr(CONTINUATION, last) != nullptr ||
+                                (depth > 0 && strchr(CONTINUATION_START, *next) != nullptr);
+
+            if (!is_continued) return str;
+        }
+
+        if      (*str == '(') depth++;
+        else if (*str == ')') depth--;
+
+        if (!isspace(*str)) last = *str;
+    }
+
+    return end;
+}
+
+bool IsBinOP(Buffer* buffer, int op)
+{
+    assert(buffer);
+
+    return buffer->lexer.token.type == TOKEN_BIN_OP && buffer->lexer.token.value.op == op;
+}
+
+// Only the first error is reported, everything after it is its consequence
+void SetError(Buffer* buffer, BUF_STATUS status)
+{
+    assert(buffer);
+
+    if (buffer->status != BUFFER_IS_OK) return;
+
+    buffer->status = status;
+    SyntaxError(buffer);
+}
+
+DerNode* GetAnswer(DerTree* tree, const char* str, const char* end)
+{
+    assert(tree);
+    assert(str);
+    assert(end);
  
     Buffer buffer       = {};
-    buffer.str          = str;
     buffer.original_str = str;
+    buffer.tree         = tree;
     buffer.status       = BUFFER_IS_OK;
 
+    InitLexer(&buffer.lexer, str, end);
+
     DerNode* root = GetExpression(&buffer);
-    IgnoreSpaces(&buffer);
 
-    if (*buffer.str != '\0' && *buffer.str != '\n') 
+    if (buffer.lexer.token.type != TOKEN_END) 
     {
-        buffer.status = ENDING_ERR;
-        SyntaxError(&buffer);
-        return nullptr;
+        SetError(&buffer, ENDING_ERR);
     }
 
+    if (buffer.status != BUFFER_IS_OK) return nullptr;
+
     return root;
 }
 
@@ -39,17 +153,14 @@ DerNode* GetExpression(Buffer* buffer)
  
     DerNode* result = GetTerm(buffer);
 
-    while (*buffer->str == '+' || *buffer->str == '-')
+    while (IsBinOP(buffer, OP_ADD) || IsBinOP(buffer, OP_SUB))
     {
-        bool is_plus = (*buffer->str == '+');
-        buffer->str++;
+        int op = buffer->lexer.token.value.op;
+        NextToken(&buffer->lexer);
 
         DerNode* value = GetTerm(buffer);
 
-        if (is_plus) result = ConstructNode(TYPE_BIN_OP, { .op = OP_ADD }, result, value);
-        else         result = ConstructNode(TYPE_BIN_OP, { .op = OP_SUB }, result, value);
-
-        IgnoreSpaces(buffer);
+        result = ConstructNode(buffer->tree, TYPE_BIN_OP, { .op = op }, result, value);
     }
 
     return result;
@@ -60,17 +171,15 @@ DerNode* GetTerm(Buffer* buffer)
     assert(buffer);
  
     DerNode* result = GetPower(buffer);
-    IgnoreSpaces(buffer);
     
-    while (*buffer->str == '*' || *buffer->str == '/')
+    while (IsBinOP(buffer, OP_MUL) || IsBinOP(buffer, OP_DIV))
     {
-        bool is_mul = (*buffer->str == '*');
-        buffer->str++;
+        int op = buffer->lexer.token.value.op;
+        NextToken(&buffer->lexer);
 
         DerNode* value = GetPower(buffer);
-        if (is_mul) result = ConstructNode(TYPE_BIN_OP, { .op = OP_MUL }, result, value);
-        else        result = ConstructNode(TYPE_BIN_OP, { .op = OP_DIV }, result, value);
-        IgnoreSpaces(buffer);
+
+        result = ConstructNode(buffer->tree, TYPE_BIN_OP, { .op = op }, result, value);
     }
 
     return result;
@@ -81,14 +190,12 @@ DerNode* GetPower(Buffer* buffer)
     assert(buffer);
  
     DerNode* result = GetUnaryFunction(buffer);
-    IgnoreSpaces(buffer);
     
-    while (*buffer->str == '^')
+    while (IsBinOP(buffer, OP_POW))
     {
-        buffer->str++;
+        NextToken(&buffer->lexer);
 
-        result = ConstructNode(TYPE_BIN_OP, { .op = OP_POW }, result, GetUnaryFunction(buffer));
-        IgnoreSpaces(buffer);
+        result = ConstructNode(buffer->tree, TYPE_BIN_OP, { .op = OP_POW }, result, GetUnaryFunction(buffer));
     }
 
     return result;
@@ -98,124 +205,148 @@ DerNode* GetUnaryFunction(Buffer* buffer)
 {
     assert(buffer);
 
-    IgnoreSpaces(buffer);
-
-    if (*buffer->str != '(' && isalpha(*buffer->str) && !strspn(buffer->str, VARIABLES))
-    {
-        for (int i = 0; i < NUM_UNARY_OP; ++i)
-        {
-            if (strncmp(buffer->str, UNARY_OP[i], strlen(UNARY_OP[i])) == 0)
-            {
-                buffer->str += strlen(UNARY_OP[i]);
-                return ConstructNode(TYPE_UN_OP, { .op = i}, nullptr, GetPrimaryExression(buffer));    
-            }
-        }
-    }
-    else
+    if (buffer->lexer.token.type != TOKEN_FUNCTION)
     {
         return GetPrimaryExression(buffer);
     }
+
+    int op = buffer->lexer.token.value.op;
+    NextToken(&buffer->lexer);
+
+    return ConstructNode(buffer->tree, TYPE_UN_OP, { .op = op }, nullptr, GetPrimaryExression(buffer));
 }
 
 DerNode* GetPrimaryExression(Buffer* buffer)
 {
     assert(buffer);
 
-    IgnoreSpaces(buffer);
-    if (*buffer->str == '(')
+    if (buffer->lexer.token.type != TOKEN_OPEN)
     {
-        buffer->str++;
-        DerNode* result = GetExpression(buffer);
-        IgnoreSpaces(buffer);
-
-        if (*buffer->str != ')')
-        {
-            buffer->status = BRACKET_ERR;
-            SyntaxError(buffer);
-            return nullptr;
-        }
+        return GetNumberOrVar(buffer);
+    }
 
-        buffer->str++;
-        IgnoreSpaces(buffer);
+    NextToken(&buffer->lexer);
+    DerNode* result = GetExpression(buffer);
 
-        return result;
-    }
-    else
+    if (buffer->lexer.token.type != TOKEN_CLOSE)
     {
-        return GetNumberOrVar(buffer);
+        SetError(buffer, BRACKET_ERR);
+        return nullptr;
     }
+
+    NextToken(&buffer->lexer);
+
+    return result;
 }
 
 DerNode* GetNumberOrVar(Buffer* buffer)
 {
     assert(buffer);
-    
-    double value = 0;
-    size_t start = 0;
-    size_t end   = 0;
 
-    if (!sscanf(buffer->str, "%lln%lf%lln", &start, &value, &end))
+    Token* token = &buffer->lexer.token;
+
+    if (token->type == TOKEN_VARIABLE)
     {
-        if (strspn(buffer->str, VARIABLES))
-        {
-            char variable = *buffer->str;
-            buffer->str++;
-            return ConstructNode(TYPE_VAR, { .var = variable }, nullptr, nullptr);
-        }
-        buffer->status = GET_NUMBER_ERR;
-        SyntaxError(buffer);
+        char variable = token->value.var;
+        NextToken(&buffer->lexer);
+        return ConstructNode(buffer->tree, TYPE_VAR, { .var = variable }, nullptr, nullptr);
+    }
+
+    // A sign right before a number belongs to it, as in 2 * -3
+    double sign = 1;
+
+    if (IsBinOP(buffer, OP_ADD) || IsBinOP(buffer, OP_SUB))
+    {
+        sign = IsBinOP(buffer, OP_SUB) ? -1 : 1;
+        NextToken(&buffer->lexer);
+    }
+
+    if (token->type != TOKEN_NUMBER)
+    {
+        bool is_name = token->type == TOKEN_UNKNOWN && isalpha(*token->start);
+
+        SetError(buffer, is_name ? FUNCTION_ERR : GET_NUMBER_ERR);
         return nullptr;
     }
 
-    buffer->str += end - start;
-    return ConstructNode(TYPE_CONST, { .number = value }, nullptr, nullptr);
+    double value = sign * token->value.number;
+    NextToken(&buffer->lexer);
+
+    return ConstructNode(buffer->tree, TYPE_CONST, { .number = value }, nullptr, nullptr);
 }
 
-void PrintError(Buffer* buffer)
+void PrintError(Buffer* buffer, StrBuf* message)
 {
     assert(buffer);
+    assert(message);
     
     switch (buffer->status)
     {
         case BUFFER_IS_OK :
         {
-            printf("Error was called, but not detected\n");
+            StrBufPrintf(message, "Error was called, but not detected\n");
             break;
         }
         case GET_NUMBER_ERR :
         {
-            printf("Empty number\n");
+            StrBufPrintf(message, "Empty number\n");
             break;
         }
         case ENDING_ERR :
         {
-            printf("Unknown symbol in the end\n");
+            StrBufPrintf(message, "Unknown symbol in the end\n");
             break;
         }
         case BRACKET_ERR :
         {
-            printf("missed ')'\n");
+            StrBufPrintf(message, "missed ')'\n");
+            break;
+        }
+        case FUNCTION_ERR :
+        {
+            StrBufPrintf(message, "Unknown function\n");
             break;
         }
         default :
         {
-            printf("Unknown error\n");
+            StrBufPrintf(message, "Unknown error\n");
             break;
         }
     }
 }
 
+// Goes to stderr in one write, so batch results on stdout stay one per line and workers don't mix their messages
 void SyntaxError(Buffer* buffer)
 {
     assert(buffer);
-    
-    printf("Syntax error : ");
-    PrintError(buffer);
-    printf("%s\n", buffer->original_str);
 
-    for (int i = 0; i < buffer->str - buffer->original_str; ++i)
+    const Token* token = &buffer->lexer.token;
+
+    StrBuf message = {};
+
+    StrBufPrintf(&message, "Syntax error at line %zu, column %zu : ", token->line, token->column);
+    PrintError(buffer, &message);
+
+    // Expressions may span lines, only the line with the token is shown
+    const char* line_start = token->start - (token->column - 1);
+    const char* line_end   = token->start;
+
+    while (line_end < buffer->lexer.end && *line_end != '\n') line_end++;
+
+    StrBufPrintf(&message, "%.*s\n", (int)(line_end - line_start), line_start);
+
+    for (size_t i = 1; i < token->column; ++i)
+    {
+        StrBufPrintf(&message, " ");
+    }
+
+    for (size_t i = 0; i < token->length || i == 0; ++i)
     {
-        printf(" ");
+        StrBufPrintf(&message, "^");
     }
-    printf("^\n");
+    StrBufPrintf(&message, "\n");
+
+    fwrite(message.data, sizeof(char), message.size, stderr);
+
+    StrBufDestruct(&message);
 }
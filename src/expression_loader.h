@@ -1,3 +1,5 @@
+#pragma once
+
 #include <assert.h>
 #include <math.h>
 #include <stdio.h>
@@ -5,28 +7,51 @@
 #include <string.h>
 #include <ctype.h>
 
+#include "lexer.h"
+
 enum BUF_STATUS
 {
     BUFFER_IS_OK   = 0,
     GET_NUMBER_ERR = 1,
     ENDING_ERR     = 2,
     BRACKET_ERR    = 3,
+    FUNCTION_ERR   = 4
 };
 
 struct Buffer
 {
-    char* str = nullptr;
-    char* original_str = nullptr;
+    Lexer       lexer;
+    const char* original_str = nullptr;
+
+    DerTree* tree = nullptr;
 
     BUF_STATUS status = BUFFER_IS_OK;
 };
 
-DerNode* GetAnswer          (char* str);
-DerNode* GetNumberOrVar     (Buffer* buffer);
-DerNode* GetExpression      (Buffer* buffer);
-DerNode* GetPrimaryExression(Buffer* buffer);
-DerNode* GetTerm            (Buffer* buffer);
-DerNode* GetUnaryFunction   (Buffer* buffer);
-DerNode* GetPower           (Buffer* buffer);
-void     PrintError         (Buffer* buffer);
-void     SyntaxError        (Buffer* buffer);
+// The whole file is mapped, expressions are parsed in place and are not null-terminated
+struct InputFile
+{
+    const char* data = nullptr;
+    size_t      size = 0;
+};
+
+struct ExprSpan
+{
+    const char* start = nullptr;
+    const char* end   = nullptr;
+};
+
+bool        MapInput           (const char* name, InputFile* input);
+void        UnmapInput         (InputFile* input);
+const char* SkipBlanks         (const char* str, const char* end);
+const char* FindExpressionEnd  (const char* str, const char* end);
+
+DerNode*    GetAnswer          (DerTree* tree, const char* str, const char* end);
+DerNode*    GetNumberOrVar     (Buffer* buffer);
+DerNode*    GetExpression      (Buffer* buffer);
+DerNode*    GetPrimaryExression(Buffer* buffer);
+DerNode*    GetTerm            (Buffer* buffer);
+DerNode*    GetUnaryFunction   (Buffer* buffer);
+DerNode*    GetPower           (Buffer* buffer);
+void        PrintError         (Buffer* buffer, StrBuf* message);
+void        SyntaxError        (Buffer* buffer);
@@ -0,0 +1,653 @@
+#include "derivative.h"
+
+
+/////////////////////////////////
+//Reverse mode
+/////////////////////////////////
+double   GradientCompact (const CompactTree* compact, double* values, double* adjoints, double x, double y, double* gradient);
+void     GradientTrees   (DerTree* tree, DerTree** gradient);
+void     AdjointSweep    (DerTree* tree, const CompactTree* compact, DerNode** roots);
+void     PropagateAdjoint(DerTree* tree, const CompactTree* compact, DerNode** primals, DerNode** adjoints, size_t index);
+void     AddAdjoint      (DerTree* tree, DerNode** adjoint, DerNode* term, bool is_negative);
+DerNode* ScaleAdjoint    (DerTree* tree, DerNode* adjoint, DerNode* factor);
+
+/////////////////////////////////
+//Forward over reverse
+/////////////////////////////////
+Hessian* CompileHessian  (DerTree* tree);
+void     DestructHessian (Hessian* hessian);
+double   EvalHessian     (Hessian* hessian, double x, double y, double* gradient, double* matrix);
+void     TangentSweep    (Hessian* hessian, size_t variable);
+void     HessianSweep    (Hessian* hessian, double* gradient, double* row);
+
+
+#define ADD(left, right) ConstructNode(tree, TYPE_BIN_OP, { .op = OP_ADD  }, left, right)
+#define SUB(left, right) ConstructNode(tree, TYPE_BIN_OP, { .op = OP_SUB  }, left, right)
+#define MUL(left, right) ConstructNode(tree, TYPE_BIN_OP, { .op = OP_MUL  }, left, right)
+#define DIV(left, right) ConstructNode(tree, TYPE_BIN_OP, { .op = OP_DIV  }, left, right)
+#define POW(left, right) ConstructNode(tree, TYPE_BIN_OP, { .op = OP_POW  }, left, right)
+#define SIN(right)       ConstructNode(tree, TYPE_UN_OP,  { .op = OP_SIN  }, tree->nil, right)
+#define COS(right)       ConstructNode(tree, TYPE_UN_OP,  { .op = OP_COS  }, tree->nil, right)
+#define LN(right)        ConstructNode(tree, TYPE_UN_OP,  { .op = OP_LN   }, tree->nil, right)
+#define CONST(NUM)       ConstructNode(tree, TYPE_CONST,  { .number = NUM }, tree->nil, tree->nil)
+
+// values and adjoints must hold compact->size numbers. The forward sweep is EvalCompact, the backward one goes
+// from the root down the same arrays, so the cost does not depend on the number of variables.
+// gradient gets df/dx and df/dy, the value of f is returned
+double GradientCompact(const CompactTree* compact, double* values, double* adjoints, double x, double y, double* gradient)
+{
+    assert(compact);
+    assert(values);
+    assert(adjoints);
+    assert(gradient);
+
+    for (size_t i = 0; i < NUM_VARIABLES; ++i)
+    {
+        gradient[i] = 0;
+    }
+
+    if (compact->root == COMPACT_NIL) return NAN;
+
+    double value = EvalCompact(compact, values, x, y);
+
+    const unsigned char* kinds = compact->kinds;
+    const unsigned int*  left  = compact->left;
+    const unsigned int*  right = compact->right;
+    const unsigned int*  pool  = compact->values;
+
+    for (size_t i = 0; i < compact->size; ++i)
+    {
+        adjoints[i] = 0;
+    }
+
+    adjoints[compact->root] = 1;
+
+    // A node comes after its children, so its adjoint is complete before they are reached
+    for (size_t i = compact->root + 1; i-- > 0; )
+    {
+        double adjoint = adjoints[i];
+
+        // Nothing above depends on the node, and its partials may be infinite
+        if (adjoint == 0) continue;
+
+        switch (kinds[i])
+        {
+            case TYPE_VAR << 4 : gradient[pool[i]] += adjoint; break;
+
+            case TYPE_BIN_OP << 4 | OP_ADD :
+            {
+                adjoints[left[i]]  += adjoint;
+                adjoints[right[i]] += adjoint;
+                break;
+            }
+            case TYPE_BIN_OP << 4 | OP_SUB :
+            {
+                adjoints[left[i]]  += adjoint;
+                adjoints[right[i]] -= adjoint;
+                break;
+            }
+            case TYPE_BIN_OP << 4 | OP_MUL :
+            {
+                adjoints[left[i]]  += adjoint * values[right[i]];
+                adjoints[right[i]] += adjoint * values[left[i]];
+                break;
+            }
+            case TYPE_BIN_OP << 4 | OP_DIV :
+            {
+                adjoints[left[i]]  += adjoint / values[right[i]];
+                adjoints[right[i]] -= adjoint * values[i] / values[right[i]];
+                break;
+            }
+            case TYPE_BIN_OP << 4 | OP_POW :
+            {
+                double base  = values[left[i]];
+                double power = values[right[i]];
+
+                // x ^ 0 at x = 0 would give 0 * inf
+                if (power != 0) adjoints[left[i]] += adjoint * power * pow(base, power - 1);
+
+                // x ^ 2 at a negative x has no logarithm, and the constant power nothing to pass it to
+                if (base > 0) adjoints[right[i]] += adjoint * values[i] * log(base);
+                break;
+            }
+
+            case TYPE_UN_OP << 4 | OP_SIN  : adjoints[right[i]] += adjoint * cos(values[right[i]]);          break;
+            case TYPE_UN_OP << 4 | OP_COS  : adjoints[right[i]] -= adjoint * sin(values[right[i]]);          break;
+            case TYPE_UN_OP << 4 | OP_TAN  : adjoints[right[i]] += adjoint / pow(cos(values[right[i]]), 2); break;
+            case TYPE_UN_OP << 4 | OP_CTG  : adjoints[right[i]] -= adjoint / pow(sin(values[right[i]]), 2); break;
+            case TYPE_UN_OP << 4 | OP_SQRT : adjoints[right[i]] += adjoint / (2 * values[i]);                break;
+            case TYPE_UN_OP << 4 | OP_LN   : adjoints[right[i]] += adjoint / values[right[i]];               break;
+            case TYPE_UN_OP << 4 | OP_EXP  : adjoints[right[i]] += adjoint * values[i];                      break;
+
+            default : break;
+        }
+    }
+
+    return value;
+}
+
+// gradient gets NUM_VARIABLES new trees, the partial derivatives by x and by y, simplified like the ones of
+// TakeDerivative. The caller destructs them. A DAG gets DAGs back
+void GradientTrees(DerTree* tree, DerTree** gradient)
+{
+    assert(tree);
+    assert(gradient);
+
+    CompactTree compact = {};
+    BuildCompact(tree, &compact);
+
+    // The adjoints of every variable are built once in a DAG, a subtree used by several of them is one node
+    DerTree* work = NewTree();
+    work->is_dag  = true;
+
+    DerNode* roots[NUM_VARIABLES] = {};
+
+    AdjointSweep(work, &compact, roots);
+
+    for (size_t i = 0; i < NUM_VARIABLES; ++i)
+    {
+        DerTree* partial = NewTree();
+        partial->is_dag  = tree->is_dag;
+
+        if (roots[i] == nullptr)
+        {
+            partial->root = ConstructNode(partial, TYPE_CONST, { .number = 0 }, partial->nil, partial->nil);
+        }
+        else if (tree->is_dag)
+        {
+            NodeMap copies = {};
+            partial->root  = CopySharedNodes(partial, work, roots[i], &copies);
+            NodeMapDestruct(&copies);
+        }
+        else
+        {
+            partial->root = CopyNodes(partial, work, roots[i]);
+        }
+
+        SetParents(partial);
+        Simplify(partial);
+        Canonicalize(partial);
+
+        gradient[i] = partial;
+    }
+
+    DestructCompact(&compact);
+    Destruct(work);
+    Delete(work);
+}
+
+// One sweep forward to make the nodes again in tree, one sweep back from the root.
+// roots gets the adjoints of x and y, nullptr when f does not depend on one
+void AdjointSweep(DerTree* tree, const CompactTree* compact, DerNode** roots)
+{
+    assert(tree);
+    assert(tree->is_dag);
+    assert(compact);
+    assert(roots);
+
+    if (compact->root == COMPACT_NIL) return;
+
+    DerNode** primals  = (DerNode**)calloc(compact->size, sizeof(DerNode*));
+    DerNode** adjoints = (DerNode**)calloc(compact->size, sizeof(DerNode*));
+    assert(primals);
+    assert(adjoints);
+
+    for (size_t i = 0; i < compact->size; ++i)
+    {
+        NodeType type  = CompactType(compact->kinds[i]);
+        Value    value = {};
+
+        if      (type == TYPE_CONST || type == NODE_ERROR) value.number = compact->consts[compact->values[i]];
+        else if (type == TYPE_VAR)                         value.var    = VARIABLES[compact->values[i]];
+        else                                               value.op     = CompactOp(compact->kinds[i]);
+
+        DerNode* left  = (compact->left[i]  != COMPACT_NIL) ? primals[compact->left[i]]  : tree->nil;
+        DerNode* right = (compact->right[i] != COMPACT_NIL) ? primals[compact->right[i]] : tree->nil;
+
+        primals[i] = ConstructNode(tree, type, value, left, right);
+    }
+
+    adjoints[compact->root] = CONST(1);
+
+    for (size_t i = compact->root + 1; i-- > 0; )
+    {
+        if (adjoints[i] == nullptr) continue;
+
+        if (CompactType(compact->kinds[i]) == TYPE_VAR)
+        {
+            AddAdjoint(tree, &roots[compact->values[i]], adjoints[i], false);
+        }
+        else
+        {
+            PropagateAdjoint(tree, compact, primals, adjoints, i);
+        }
+    }
+
+    free(primals);
+    free(adjoints);
+}
+
+// Adds the terms of a node to the adjoints of its children, a child without variables gets none.
+// The interned nodes carry their info, see InternNode
+void PropagateAdjoint(DerTree* tree, const CompactTree* compact, DerNode** primals, DerNode** adjoints, size_t index)
+{
+    assert(tree);
+    assert(compact);
+    assert(primals);
+    assert(adjoints);
+
+    unsigned int left  = compact->left[index];
+    unsigned int right = compact->right[index];
+
+    bool is_left  = (left  != COMPACT_NIL) && (primals[left]->info  & INFO_VARIABLES);
+    bool is_right = (right != COMPACT_NIL) && (primals[right]->info & INFO_VARIABLES);
+
+    DerNode* adjoint = adjoints[index];
+    DerNode* node    = primals[index];
+    DerNode* R       = (right != COMPACT_NIL) ? primals[right] : tree->nil;
+
+    switch (compact->kinds[index])
+    {
+        case TYPE_BIN_OP << 4 | OP_ADD :
+        {
+            if (is_left)  AddAdjoint(tree, &adjoints[left],  adjoint, false);
+            if (is_right) AddAdjoint(tree, &adjoints[right], adjoint, false);
+            break;
+        }
+        case TYPE_BIN_OP << 4 | OP_SUB :
+        {
+            if (is_left)  AddAdjoint(tree, &adjoints[left],  adjoint, false);
+            if (is_right) AddAdjoint(tree, &adjoints[right], adjoint, true);
+            break;
+        }
+        case TYPE_BIN_OP << 4 | OP_MUL :
+        {
+            if (is_left)  AddAdjoint(tree, &adjoints[left],  ScaleAdjoint(tree, adjoint, primals[right]), false);
+            if (is_right) AddAdjoint(tree, &adjoints[right], ScaleAdjoint(tree, adjoint, primals[left]),  false);
+            break;
+        }
+        case TYPE_BIN_OP << 4 | OP_DIV :
+        {
+            if (is_left)  AddAdjoint(tree, &adjoints[left],  DIV(adjoint, primals[right]), false);
+            if (is_right) AddAdjoint(tree, &adjoints[right], ScaleAdjoint(tree, adjoint, DIV(node, primals[right])), true);
+            break;
+        }
+        case TYPE_BIN_OP << 4 | OP_POW :
+        {
+            DerNode* base  = primals[left];
+            DerNode* power = primals[right];
+
+            if (is_left)
+            {
+                DerNode* partial = MUL(power, POW(base, SUB(power, CONST(1))));
+                AddAdjoint(tree, &adjoints[left], ScaleAdjoint(tree, adjoint, partial), false);
+            }
+
+            if (is_right) AddAdjoint(tree, &adjoints[right], ScaleAdjoint(tree, adjoint, MUL(node, LN(base))), false);
+            break;
+        }
+        case TYPE_UN_OP << 4 | OP_SIN :
+        {
+            if (is_right) AddAdjoint(tree, &adjoints[right], ScaleAdjoint(tree, adjoint, COS(R)), false);
+            break;
+        }
+        case TYPE_UN_OP << 4 | OP_COS :
+        {
+            if (is_right) AddAdjoint(tree, &adjoints[right], ScaleAdjoint(tree, adjoint, SIN(R)), true);
+            break;
+        }
+        case TYPE_UN_OP << 4 | OP_TAN :
+        {
+            if (is_right) AddAdjoint(tree, &adjoints[right], DIV(adjoint, POW(COS(R), CONST(2))), false);
+            break;
+        }
+        case TYPE_UN_OP << 4 | OP_CTG :
+        {
+            if (is_right) AddAdjoint(tree, &adjoints[right], DIV(adjoint, POW(SIN(R), CONST(2))), true);
+            break;
+        }
+        case TYPE_UN_OP << 4 | OP_SQRT :
+        {
+            if (is_right) AddAdjoint(tree, &adjoints[right], DIV(adjoint, MUL(CONST(2), node)), false);
+            break;
+        }
+        case TYPE_UN_OP << 4 | OP_LN :
+        {
+            if (is_right) AddAdjoint(tree, &adjoints[right], DIV(adjoint, R), false);
+            break;
+        }
+        case TYPE_UN_OP << 4 | OP_EXP :
+        {
+            if (is_right) AddAdjoint(tree, &adjoints[right], ScaleAdjoint(tree, adjoint, node), false);
+            break;
+        }
+        default :
+        {
+            break;
+        }
+    }
+}
+
+// Adjoints of a shared node come from each of its parents and are summed
+void AddAdjoint(DerTree* tree, DerNode** adjoint, DerNode* term, bool is_negative)
+{
+    assert(tree);
+    assert(adjoint);
+    assert(term);
+
+    if (*adjoint == nullptr)
+    {
+        *adjoint = is_negative ? MUL(CONST(-1), term) : term;
+    }
+    else
+    {
+        *adjoint = is_negative ? SUB(*adjoint, term) : ADD(*adjoint, term);
+    }
+}
+
+// The adjoint of the root is 1, most products with it would only be simplified away later
+DerNode* ScaleAdjoint(DerTree* tree, DerNode* adjoint, DerNode* factor)
+{
+    assert(tree);
+    assert(adjoint);
+    assert(factor);
+
+    if (adjoint->type == TYPE_CONST && adjoint->value.number == 1) return factor;
+
+    return MUL(adjoint, factor);
+}
+
+Hessian* CompileHessian(DerTree* tree)
+{
+    assert(tree);
+
+    Hessian* hessian = (Hessian*)calloc(1, sizeof(Hessian));
+    assert(hessian);
+
+    BuildCompact(tree, &hessian->compact);
+
+    size_t size = hessian->compact.size + 1;
+
+    hessian->values       = (double*)calloc(size, sizeof(double));
+    hessian->dots         = (double*)calloc(size, sizeof(double));
+    hessian->adjoints     = (double*)calloc(size, sizeof(double));
+    hessian->adjoint_dots = (double*)calloc(size, sizeof(double));
+    assert(hessian->values);
+    assert(hessian->dots);
+    assert(hessian->adjoints);
+    assert(hessian->adjoint_dots);
+
+    return hessian;
+}
+
+void DestructHessian(Hessian* hessian)
+{
+    assert(hessian);
+
+    DestructCompact(&hessian->compact);
+
+    free(hessian->values);
+    free(hessian->dots);
+    free(hessian->adjoints);
+    free(hessian->adjoint_dots);
+
+    free(hessian);
+}
+
+// matrix gets NUM_VARIABLES rows of NUM_VARIABLES second derivatives, gradient the first ones, the value
+// of f is returned. One value sweep, then a tangent sweep and a backward sweep along every variable
+double EvalHessian(Hessian* hessian, double x, double y, double* gradient, double* matrix)
+{
+    assert(hessian);
+    assert(gradient);
+    assert(matrix);
+
+    for (size_t i = 0; i < NUM_VARIABLES * NUM_VARIABLES; ++i)
+    {
+        matrix[i] = 0;
+    }
+
+    for (size_t i = 0; i < NUM_VARIABLES; ++i)
+    {
+        gradient[i] = 0;
+    }
+
+    if (hessian->compact.root == COMPACT_NIL) return NAN;
+
+    double value = EvalCompact(&hessian->compact, hessian->values, x, y);
+
+    for (size_t i = 0; i < NUM_VARIABLES; ++i)
+    {
+        TangentSweep(hessian, i);
+
+        // The gradient is the same along every variable, the last sweep leaves it
+        for (size_t j = 0; j < NUM_VARIABLES; ++j)
+        {
+            gradient[j] = 0;
+        }
+
+        HessianSweep(hessian, gradient, matrix + i * NUM_VARIABLES);
+    }
+
+    return value;
+}
+
+// Derivatives of every node along one variable, the values are already there
+void TangentSweep(Hessian* hessian, size_t variable)
+{
+    assert(hessian);
+
+    const CompactTree*   compact = &hessian->compact;
+    const unsigned char* kinds   = compact->kinds;
+    const unsigned int*  left    = compact->left;
+    const unsigned int*  right   = compact->right;
+    const unsigned int*  pool    = compact->values;
+    const double*        values  = hessian->values;
+    double*              dots    = hessian->dots;
+
+    for (size_t i = 0, size = compact->size; i < size; ++i)
+    {
+        switch (kinds[i])
+        {
+            case TYPE_VAR << 4 : dots[i] = (pool[i] == variable) ? 1 : 0; break;
+
+            case TYPE_BIN_OP << 4 | OP_ADD : dots[i] = dots[left[i]] + dots[right[i]]; break;
+            case TYPE_BIN_OP << 4 | OP_SUB : dots[i] = dots[left[i]] - dots[right[i]]; break;
+
+            case TYPE_BIN_OP << 4 | OP_MUL :
+            {
+                dots[i] = dots[left[i]] * values[right[i]] + values[left[i]] * dots[right[i]];
+                break;
+            }
+            case TYPE_BIN_OP << 4 | OP_DIV :
+            {
+                dots[i] = (dots[left[i]] - values[i] * dots[right[i]]) / values[right[i]];
+                break;
+            }
+            case TYPE_BIN_OP << 4 | OP_POW :
+            {
+                double base  = values[left[i]];
+                double power = values[right[i]];
+
+                // x ^ 0 at x = 0 would give 0 * inf
+                dots[i] = (power != 0 && dots[left[i]] != 0) ? power * pow(base, power - 1) * dots[left[i]] : 0;
+
+                // A constant power has no tangent, a negative base would give no logarithm
+                if (dots[right[i]] != 0) dots[i] += values[i] * log(base) * dots[right[i]];
+                break;
+            }
+
+            case TYPE_UN_OP << 4 | OP_SIN  : dots[i] =  cos(values[right[i]]) * dots[right[i]];         break;
+            case TYPE_UN_OP << 4 | OP_COS  : dots[i] = -sin(values[right[i]]) * dots[right[i]];         break;
+            case TYPE_UN_OP << 4 | OP_TAN  : dots[i] =  (1 + values[i] * values[i]) * dots[right[i]];  break;
+            case TYPE_UN_OP << 4 | OP_CTG  : dots[i] = -(1 + values[i] * values[i]) * dots[right[i]];  break;
+            case TYPE_UN_OP << 4 | OP_SQRT : dots[i] =  dots[right[i]] / (2 * values[i]);              break;
+            case TYPE_UN_OP << 4 | OP_LN   : dots[i] =  dots[right[i]] / values[right[i]];             break;
+            case TYPE_UN_OP << 4 | OP_EXP  : dots[i] =  values[i] * dots[right[i]];                    break;
+
+            default : dots[i] = 0; break;
+        }
+    }
+}
+
+// The backward sweep of GradientCompact with every adjoint carrying its derivative along the tangent.
+// A child gets adjoint * partial and the derivative of that product, row gets the derivatives of the gradient
+void HessianSweep(Hessian* hessian, double* gradient, double* row)
+{
+    assert(hessian);
+    assert(gradient);
+    assert(row);
+
+    const CompactTree*   compact      = &hessian->compact;
+    const unsigned char* kinds        = compact->kinds;
+    const unsigned int*  left         = compact->left;
+    const unsigned int*  right        = compact->right;
+    const unsigned int*  pool         = compact->values;
+    const double*        values       = hessian->values;
+    const double*        dots         = hessian->dots;
+    double*              adjoints     = hessian->adjoints;
+    double*              adjoint_dots = hessian->adjoint_dots;
+
+    for (size_t i = 0; i < compact->size; ++i)
+    {
+        adjoints[i]     = 0;
+        adjoint_dots[i] = 0;
+    }
+
+    adjoints[compact->root] = 1;
+
+    for (size_t i = compact->root + 1; i-- > 0; )
+    {
+        double adjoint = adjoints[i];
+        double dot     = adjoint_dots[i];
+
+        if (adjoint == 0 && dot == 0) continue;
+
+        // The partial by the child and its derivative along the tangent
+        double partial     = 0;
+        double partial_dot = 0;
+
+        switch (kinds[i])
+        {
+            case TYPE_VAR << 4 :
+            {
+                gradient[pool[i]] += adjoint;
+                row[pool[i]]      += dot;
+                continue;
+            }
+            case TYPE_BIN_OP << 4 | OP_ADD :
+            {
+                adjoints[left[i]]      += adjoint;
+                adjoint_dots[left[i]]  += dot;
+                adjoints[right[i]]     += adjoint;
+                adjoint_dots[right[i]] += dot;
+                continue;
+            }
+            case TYPE_BIN_OP << 4 | OP_SUB :
+            {
+                adjoints[left[i]]      += adjoint;
+                adjoint_dots[left[i]]  += dot;
+                adjoints[right[i]]     -= adjoint;
+                adjoint_dots[right[i]] -= dot;
+                continue;
+            }
+            case TYPE_BIN_OP << 4 | OP_MUL :
+            {
+                adjoints[left[i]]      += adjoint * values[right[i]];
+                adjoint_dots[left[i]]  += dot * values[right[i]] + adjoint * dots[right[i]];
+                adjoints[right[i]]     += adjoint * values[left[i]];
+                adjoint_dots[right[i]] += dot * values[left[i]] + adjoint * dots[left[i]];
+                continue;
+            }
+            case TYPE_BIN_OP << 4 | OP_DIV :
+            {
+                double divisor = values[right[i]];
+                double ratio   = values[i] / divisor;
+
+                adjoints[left[i]]      += adjoint / divisor;
+                adjoint_dots[left[i]]  += (dot - adjoint * dots[right[i]] / divisor) / divisor;
+                adjoints[right[i]]     -= adjoint * ratio;
+                adjoint_dots[right[i]] -= dot * ratio + adjoint * (dots[i] - ratio * dots[right[i]]) / divisor;
+                continue;
+            }
+            case TYPE_BIN_OP << 4 | OP_POW :
+            {
+                double base  = values[left[i]];
+                double power = values[right[i]];
+
+                // d/dt (power * base ^ (power - 1))
+                double lower = pow(base, power - 1);
+
+                partial     = 0;
+                partial_dot = 0;
+
+                // At a zero base the powers below are infinite, so a term with a zero factor is skipped, not multiplied
+                if (power != 0) partial = power * lower;
+                if (dots[right[i]] != 0) partial_dot += dots[right[i]] * lower;
+                if (power != 0 && power != 1 && dots[left[i]] != 0) partial_dot += power * (power - 1) * pow(base, power - 2) * dots[left[i]];
+                if (power != 0 && dots[right[i]] != 0) partial_dot += power * lower * log(base) * dots[right[i]];
+
+                adjoints[left[i]]     += adjoint * partial;
+                adjoint_dots[left[i]] += dot * partial + adjoint * partial_dot;
+
+                if (base > 0)
+                {
+                    partial     = values[i] * log(base);
+                    partial_dot = dots[i] * log(base) + values[i] * dots[left[i]] / base;
+
+                    adjoints[right[i]]     += adjoint * partial;
+                    adjoint_dots[right[i]] += dot * partial + adjoint * partial_dot;
+                }
+                continue;
+            }
+
+            case TYPE_UN_OP << 4 | OP_SIN :
+            {
+                partial     =  cos(values[right[i]]);
+                partial_dot = -values[i] * dots[right[i]];
+                break;
+            }
+            case TYPE_UN_OP << 4 | OP_COS :
+            {
+                partial     = -sin(values[right[i]]);
+                partial_dot = -values[i] * dots[right[i]];
+                break;
+            }
+            case TYPE_UN_OP << 4 | OP_TAN :
+            {
+                partial     = 1 + values[i] * values[i];
+                partial_dot = 2 * values[i] * dots[i];
+                break;
+            }
+            case TYPE_UN_OP << 4 | OP_CTG :
+            {
+                partial     = -(1 + values[i] * values[i]);
+                partial_dot = -2 * values[i] * dots[i];
+                break;
+            }
+            case TYPE_UN_OP << 4 | OP_SQRT :
+            {
+                partial     =  1 / (2 * values[i]);
+                partial_dot = -dots[i] / (2 * values[i] * values[i]);
+                break;
+            }
+            case TYPE_UN_OP << 4 | OP_LN :
+            {
+                partial     =  1 / values[right[i]];
+                partial_dot = -dots[right[i]] / (values[right[i]] * values[right[i]]);
+                break;
+            }
+            case TYPE_UN_OP << 4 | OP_EXP :
+            {
+                partial     = values[i];
+                partial_dot = dots[i];
+                break;
+            }
+
+            default : continue;
+        }
+
+        adjoints[right[i]]     += adjoint * partial;
+        adjoint_dots[right[i]] += dot * partial + adjoint * partial_dot;
+    }
+}
@@ -0,0 +1,258 @@
+#include "lexer.h"
+
+
+const size_t MAX_NUMBER_LEN     = 64;
+const size_t MAX_EXACT_DIGITS   = 15;
+const int    MAX_EXACT_EXPONENT = 22;
+
+const size_t FUNCTION_TABLE_SIZE = 16;
+
+// Every power of ten up to 1e22 is exact in a double
+static const double POWERS_OF_TEN[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                                       1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                                       1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+// (name[0] + name[1]) % 16 is different for every name in UNARY_OP, FindFunction compares the name anyway
+static const int FUNCTION_TABLE[FUNCTION_TABLE_SIZE] = {-1, -1, OP_COS, -1, OP_SQRT, OP_TAN, -1, OP_CTG,
+                                                        -1, -1, OP_LN,  -1, OP_SIN,  OP_EXP, -1, -1};
+
+/////////////////////////////////
+//Lexer
+/////////////////////////////////
+void        InitLexer     (Lexer* lexer, const char* str, const char* end);
+void        NextToken     (Lexer* lexer);
+void        SkipSpaces    (Lexer* lexer);
+int         FindFunction  (const char* name, size_t length);
+int         FindBinOP     (char symbol);
+const char* ScanNumber    (const char* str, const char* end, double* value);
+
+
+void InitLexer(Lexer* lexer, const char* str, const char* end)
+{
+    assert(lexer);
+    assert(str);
+    assert(end);
+
+    lexer->str        = str;
+    lexer->end        = end;
+    lexer->line_start = str;
+    lexer->line       = 1;
+
+    NextToken(lexer);
+}
+
+void NextToken(Lexer* lexer)
+{
+    assert(lexer);
+
+    Token* token = &lexer->token;
+
+    // The end is reported right after the last token, not on the blank lines behind it
+    token->start  = lexer->str;
+    token->line   = lexer->line;
+    token->column = (size_t)(lexer->str - lexer->line_start) + 1;
+
+    SkipSpaces(lexer);
+
+    if (lexer->str == lexer->end)
+    {
+        token->type   = TOKEN_END;
+        token->length = 0;
+        return;
+    }
+
+    token->start        = lexer->str;
+    token->length       = 1;
+    token->line         = lexer->line;
+    token->column       = (size_t)(lexer->str - lexer->line_start) + 1;
+    token->value.number = 0;
+
+    char symbol = *lexer->str;
+
+    if (isdigit(symbol) || symbol == '.')
+    {
+        const char* number_end = ScanNumber(lexer->str, lexer->end, &token->value.number);
+
+        token->type   = (number_end != lexer->str) ? TOKEN_NUMBER : TOKEN_UNKNOWN;
+        token->length = (number_end != lexer->str) ? (size_t)(number_end - lexer->str) : 1;
+    }
+    else if (isalpha(symbol))
+    {
+        const char* name_end = lexer->str;
+        while (name_end < lexer->end && isalpha(*name_end)) name_end++;
+
+        token->length = (size_t)(name_end - lexer->str);
+
+        int op = FindFunction(lexer->str, token->length);
+
+        if (op != -1)
+        {
+            token->type     = TOKEN_FUNCTION;
+            token->value.op = op;
+        }
+        else if (token->length == 1 && strchr(VARIABLES, symbol) != nullptr)
+        {
+            token->type      = TOKEN_VARIABLE;
+            token->value.var = symbol;
+        }
+        else
+        {
+            token->type = TOKEN_UNKNOWN;
+        }
+    }
+    else if (symbol == '(')
+    {
+        token->type = TOKEN_OPEN;
+    }
+    else if (symbol == ')')
+    {
+        token->type = TOKEN_CLOSE;
+    }
+    else if (FindBinOP(symbol) != -1)
+    {
+        token->type     = TOKEN_BIN_OP;
+        token->value.op = FindBinOP(symbol);
+    }
+    else
+    {
+        token->type = TOKEN_UNKNOWN;
+    }
+
+    lexer->str += token->length;
+}
+
+void SkipSpaces(Lexer* lexer)
+{
+    assert(lexer);
+
+    while (lexer->str < lexer->end && isspace(*lexer->str))
+    {
+        if (*lexer->str == '\n')
+        {
+            lexer->line++;
+            lexer->line_start = lexer->str + 1;
+        }
+
+        lexer->str++;
+    }
+}
+
+int FindFunction(const char* name, size_t length)
+{
+    assert(name);
+
+    if (length < 2) return -1;
+
+    int op = FUNCTION_TABLE[(size_t)(unsigned char)(name[0] + name[1]) % FUNCTION_TABLE_SIZE];
+
+    if (op == -1 || strlen(UNARY_OP[op]) != length || strncmp(UNARY_OP[op], name, length) != 0) return -1;
+
+    return op;
+}
+
+int FindBinOP(char symbol)
+{
+    switch (symbol)
+    {
+        case '+' : return OP_ADD;
+        case '-' : return OP_SUB;
+        case '*' : return OP_MUL;
+        case '/' : return OP_DIV;
+        case '^' : return OP_POW;
+        default  : return -1;
+    }
+}
+
+// Reads digits [. digits] [e [sign] digits] and returns the end, or str when there is no number
+const char* ScanNumber(const char* str, const char* end, double* value)
+{
+    assert(str);
+    assert(end);
+    assert(value);
+
+    const char* cur = str;
+
+    unsigned long long mantissa   = 0;
+    size_t             num_digits = 0;
+    int                exponent   = 0;
+    bool               has_digits = false;
+
+    for (bool is_fraction = false; cur < end; ++cur)
+    {
+        if (*cur == '.' && !is_fraction)
+        {
+            is_fraction = true;
+            continue;
+        }
+
+        if (!isdigit(*cur)) break;
+
+        has_digits = true;
+
+        // Leading zeros do not count, digits past the 19th only matter for the slow path
+        if (num_digits > 0 || *cur != '0')
+        {
+            if (num_digits < 19) mantissa = 10 * mantissa + (unsigned long long)(*cur - '0');
+            else                 exponent++;
+
+            num_digits++;
+        }
+
+        if (is_fraction) exponent--;
+    }
+
+    if (!has_digits) return str;
+
+    if (cur < end && (*cur == 'e' || *cur == 'E'))
+    {
+        const char* exp_cur  = cur + 1;
+        bool        negative = false;
+
+        if (exp_cur < end && (*exp_cur == '+' || *exp_cur == '-'))
+        {
+            negative = (*exp_cur == '-');
+            exp_cur++;
+        }
+
+        if (exp_cur < end && isdigit(*exp_cur))
+        {
+            int exp_value = 0;
+
+            for (; exp_cur < end && isdigit(*exp_cur); ++exp_cur)
+            {
+                if (exp_value < 100000) exp_value = 10 * exp_value + (*exp_cur - '0');
+            }
+
+            exponent += negative ? -exp_value : exp_value;
+            cur       = exp_cur;
+        }
+    }
+
+    // Both factors are exact, so one multiplication or division rounds correctly
+    if (num_digits <= MAX_EXACT_DIGITS && exponent >= -MAX_EXACT_EXPONENT && exponent <= MAX_EXACT_EXPONENT)
+    {
+        *value = (exponent < 0) ? (double)mantissa / POWERS_OF_TEN[-exponent]
+                                : (double)mantissa * POWERS_OF_TEN[ exponent];
+        return cur;
+    }
+
+    size_t len = (size_t)(cur - str);
+
+    if (len < MAX_NUMBER_LEN)
+    {
+        char number[MAX_NUMBER_LEN] = "";
+        memcpy(number, str, len);
+
+        *value = strtod(number, nullptr);
+    }
+    else
+    {
+        char* number = strndup(str, len);
+        assert(number);
+
+        *value = strtod(number, nullptr);
+        free(number);
+    }
+
+    return cur;
+}
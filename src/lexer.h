@@ -0,0 +1,45 @@
+#pragma once
+
+#include "derivative.h"
+
+enum TokenType
+{
+    TOKEN_END      = 0,
+    TOKEN_NUMBER   = 1,
+    TOKEN_VARIABLE = 2,
+    TOKEN_FUNCTION = 3,
+    TOKEN_BIN_OP   = 4,
+    TOKEN_OPEN     = 5,
+    TOKEN_CLOSE    = 6,
+    TOKEN_UNKNOWN  = 7
+};
+
+struct Token
+{
+    TokenType type = TOKEN_END;
+
+    // number for TOKEN_NUMBER, var for TOKEN_VARIABLE, op for TOKEN_FUNCTION and TOKEN_BIN_OP
+    union Value value;
+
+    const char* start  = nullptr;
+    size_t      length = 0;
+
+    size_t line   = 0;
+    size_t column = 0;
+};
+
+struct Lexer
+{
+    const char* str = nullptr;
+    const char* end = nullptr;
+
+    const char* line_start = nullptr;
+    size_t      line       = 1;
+
+    Token token;
+};
+
+void        InitLexer     (Lexer* lexer, const char* str, const char* end);
+void        NextToken     (Lexer* lexer);
+int         FindFunction  (const char* name, size_t length);
+const char* ScanNumber    (const char* str, const char* end, double* value);
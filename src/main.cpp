@@ -0,0 +1,43 @@
+#include "derivative.h"
+#include "batch_mode.h"
+#include "render.h"
+
+
+int main(const int argc, char* argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "--batch") == 0)
+    {
+        return RunBatch(argc, argv);
+    }
+
+    // derivative --stats file [input] writes the phase timings and node counts as JSON, - for stdout
+    const char* stats = nullptr;
+
+    if (argc > 2 && strcmp(argv[1], "--stats") == 0)
+    {
+        stats = argv[2];
+        EnableStats();
+    }
+
+    int shift = (stats != nullptr) ? 2 : 0;
+
+    DerTree* tree = GetTree(argc - shift, argv + shift);
+    if (tree == nullptr) return 1;
+
+    Taylor(tree, 8);
+    // TaylorAD(tree, 8);
+    // TakeDerivative(tree);
+    // PrintExpression(tree);
+
+    // TreeDump(tree);
+
+    if (stats != nullptr) WriteStats(tree, stats);
+
+    Destruct(tree);
+    Delete(tree);
+
+    // The pictures and the pdf are still being made
+    WaitRenders();
+
+    return 0;
+}
@@ -0,0 +1,443 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "render.h"
+
+
+extern char** environ;
+
+const size_t RENDER_MAX_RUNNING    = 2;
+const size_t RENDER_START_CAPACITY = 16;
+const size_t RENDER_COPY_SIZE      = 1 << 16;
+
+const char* RENDER_CACHED_FORMAT = "%.*srender_%016zx%s";
+
+const char* RENDER_VIEWER = "xdg-open";
+const char* RENDER_NULL   = "/dev/null";
+
+/////////////////////////////////
+//Rendering in the background
+/////////////////////////////////
+void   SetRenderLimit  (size_t max_running);
+bool   QueueRender     (RenderKind kind, const char* source, const char* output);
+void   WaitRenders     ();
+void   PushRenderJob   (RenderQueue* queue, const RenderJob* job);
+bool   IsRendered      (RenderQueue* queue, size_t hash);
+bool   IsRendering     (RenderQueue* queue, size_t hash);
+void   SetCachedName   (RenderJob* job);
+void*  RenderWorkerMain(void* arg);
+bool   RunRenderJob    (RenderJob* job);
+bool   LinkOutput      (const char* from, const char* to);
+bool   SpawnTool       (char* const argv[]);
+char*  ReadSource      (const char* source, size_t* size);
+size_t HashText        (const char* text, size_t size);
+
+
+// One queue for the whole program, TreeDump and PrintExpression only hand their files over to it
+static RenderQueue RENDER_QUEUE = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+// Takes effect when the workers are started next, by the first job after WaitRenders
+void SetRenderLimit(size_t max_running)
+{
+    assert(max_running > 0);
+
+    pthread_mutex_lock(&RENDER_QUEUE.lock);
+    RENDER_QUEUE.max_running = max_running;
+    pthread_mutex_unlock(&RENDER_QUEUE.lock);
+}
+
+// source must be written and closed, the tools read it later. A source with the text of one rendered before,
+// in this run or an earlier one, gets the output of that one linked instead. False when source can't be read
+bool QueueRender(RenderKind kind, const char* source, const char* output)
+{
+    assert(source);
+    assert(output);
+    assert(strlen(source) < RENDER_PATH_LEN);
+    assert(strlen(output) < RENDER_PATH_LEN);
+
+    size_t size = 0;
+    char*  text = ReadSource(source, &size);
+
+    if (text == nullptr)
+    {
+        printf("Render error : can't read %s\nline = %d\n", source, __LINE__);
+        return false;
+    }
+
+    RenderJob job = {};
+    job.kind      = kind;
+    job.hash      = HashText(text, size) ^ (size_t)kind;
+    strcpy(job.source, source);
+    strcpy(job.output, output);
+    SetCachedName(&job);
+
+    free(text);
+
+    RenderQueue* queue = &RENDER_QUEUE;
+
+    pthread_mutex_lock(&queue->lock);
+
+    // One queued in this run may still be rendering, the worker waits for it before linking
+    bool is_queued = IsRendered(queue, job.hash);
+    job.is_cached  = job.cached[0] != '\0' && (is_queued || access(job.cached, F_OK) == 0);
+
+    PushRenderJob(queue, &job);
+
+    if (queue->workers == nullptr)
+    {
+        if (queue->max_running == 0) queue->max_running = RENDER_MAX_RUNNING;
+
+        queue->num_workers = queue->max_running;
+        queue->workers     = (pthread_t*)calloc(queue->num_workers, sizeof(pthread_t));
+        queue->rendering   = (size_t*)   calloc(queue->num_workers, sizeof(size_t));
+        assert(queue->workers);
+        assert(queue->rendering);
+
+        for (size_t i = 0; i < queue->num_workers; ++i)
+        {
+            pthread_create(&queue->workers[i], nullptr, RenderWorkerMain, queue);
+        }
+    }
+
+    pthread_cond_signal(&queue->has_jobs);
+    pthread_mutex_unlock(&queue->lock);
+
+    return true;
+}
+
+// Every queued job is finished and the workers are gone. The texts rendered so far are still remembered
+void WaitRenders()
+{
+    RenderQueue* queue = &RENDER_QUEUE;
+
+    pthread_mutex_lock(&queue->lock);
+
+    pthread_t* workers     = queue->workers;
+    size_t     num_workers = queue->num_workers;
+
+    if (workers == nullptr)
+    {
+        pthread_mutex_unlock(&queue->lock);
+        return;
+    }
+
+    queue->is_stopping = true;
+    pthread_cond_broadcast(&queue->has_jobs);
+
+    pthread_mutex_unlock(&queue->lock);
+
+    for (size_t i = 0; i < num_workers; ++i)
+    {
+        pthread_join(workers[i], nullptr);
+    }
+
+    pthread_mutex_lock(&queue->lock);
+
+    free(queue->workers);
+    free(queue->rendering);
+    queue->workers       = nullptr;
+    queue->rendering     = nullptr;
+    queue->num_workers   = 0;
+    queue->num_rendering = 0;
+    queue->is_stopping   = false;
+
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Under the lock. The jobs already taken free the front of the array before it grows
+void PushRenderJob(RenderQueue* queue, const RenderJob* job)
+{
+    assert(queue);
+    assert(job);
+
+    if (queue->end == queue->capacity)
+    {
+        size_t num_waiting = queue->end - queue->begin;
+
+        if (num_waiting > 0) memmove(queue->jobs, queue->jobs + queue->begin, num_waiting * sizeof(RenderJob));
+
+        queue->begin = 0;
+        queue->end   = num_waiting;
+
+        if (num_waiting == queue->capacity)
+        {
+            queue->capacity = (queue->capacity == 0) ? RENDER_START_CAPACITY : 2 * queue->capacity;
+
+            queue->jobs = (RenderJob*)realloc(queue->jobs, queue->capacity * sizeof(RenderJob));
+            assert(queue->jobs);
+        }
+    }
+
+    queue->jobs[queue->end++] = *job;
+}
+
+// Under the lock. A new hash is remembered, a program renders a few pictures, so a scan is enough
+bool IsRendered(RenderQueue* queue, size_t hash)
+{
+    assert(queue);
+
+    for (size_t i = 0; i < queue->num_hashes; ++i)
+    {
+        if (queue->hashes[i] == hash) return true;
+    }
+
+    if (queue->num_hashes == queue->hash_capacity)
+    {
+        queue->hash_capacity = (queue->hash_capacity == 0) ? RENDER_START_CAPACITY : 2 * queue->hash_capacity;
+
+        queue->hashes = (size_t*)realloc(queue->hashes, queue->hash_capacity * sizeof(size_t));
+        assert(queue->hashes);
+    }
+
+    queue->hashes[queue->num_hashes++] = hash;
+
+    return false;
+}
+
+// Under the lock
+bool IsRendering(RenderQueue* queue, size_t hash)
+{
+    assert(queue);
+
+    for (size_t i = 0; i < queue->num_rendering; ++i)
+    {
+        if (queue->rendering[i] == hash) return true;
+    }
+
+    return false;
+}
+
+// render_<hash> with the extension of the output, next to it. Left empty when the name does not fit
+void SetCachedName(RenderJob* job)
+{
+    assert(job);
+
+    const char* slash     = strrchr(job->output, '/');
+    const char* extension = strrchr(job->output, '.');
+    int         directory = (slash != nullptr) ? (int)(slash - job->output + 1) : 0;
+
+    if (extension == nullptr || extension < slash) extension = "";
+
+    int length = snprintf(job->cached, RENDER_PATH_LEN, RENDER_CACHED_FORMAT, directory, job->output, job->hash,
+                          extension);
+
+    if (length < 0 || (size_t)length >= RENDER_PATH_LEN) job->cached[0] = '\0';
+}
+
+// Takes jobs in order until the queue is empty and is_stopping is set
+void* RenderWorkerMain(void* arg)
+{
+    assert(arg);
+
+    RenderQueue* queue = (RenderQueue*)arg;
+
+    while (true)
+    {
+        pthread_mutex_lock(&queue->lock);
+
+        while (queue->begin == queue->end && !queue->is_stopping)
+        {
+            pthread_cond_wait(&queue->has_jobs, &queue->lock);
+        }
+
+        if (queue->begin == queue->end)
+        {
+            pthread_mutex_unlock(&queue->lock);
+            break;
+        }
+
+        RenderJob job = queue->jobs[queue->begin++];
+
+        // Jobs are taken in order, so the render a cached job waits for is already here or done
+        if (job.is_cached)
+        {
+            while (IsRendering(queue, job.hash)) pthread_cond_wait(&queue->has_rendered, &queue->lock);
+        }
+        else
+        {
+            queue->rendering[queue->num_rendering++] = job.hash;
+        }
+
+        pthread_mutex_unlock(&queue->lock);
+
+        bool is_rendered = RunRenderJob(&job);
+
+        pthread_mutex_lock(&queue->lock);
+
+        if (!job.is_cached)
+        {
+            for (size_t i = 0; i < queue->num_rendering; ++i)
+            {
+                if (queue->rendering[i] == job.hash)
+                {
+                    queue->rendering[i] = queue->rendering[--queue->num_rendering];
+                    break;
+                }
+            }
+
+            pthread_cond_broadcast(&queue->has_rendered);
+        }
+
+        if      (!is_rendered)  queue->num_failed++;
+        else if (job.is_cached) queue->num_skipped++;
+        else                    queue->num_rendered++;
+
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    return nullptr;
+}
+
+// The tool writes the output, or a cached job links the one rendered before, then the viewer opens it
+bool RunRenderJob(RenderJob* job)
+{
+    assert(job);
+
+    bool is_rendered = false;
+
+    // An output of an earlier run may be linked to a cached copy, the tools would write over both
+    remove(job->output);
+
+    if (job->is_cached)
+    {
+        is_rendered = LinkOutput(job->cached, job->output);
+    }
+    else if (job->kind == RENDER_DOT)
+    {
+        char* dot_argv[] = {(char*)"dot", (char*)"-Tjpg", job->source, (char*)"-o", job->output, nullptr};
+
+        is_rendered = SpawnTool(dot_argv);
+    }
+    else
+    {
+        // pdflatex puts the pdf and its aux files next to the source
+        char directory[RENDER_PATH_LEN] = ".";
+        const char* slash = strrchr(job->source, '/');
+
+        if (slash != nullptr) snprintf(directory, RENDER_PATH_LEN, "%.*s", (int)(slash - job->source), job->source);
+
+        char* tex_argv[] = {(char*)"pdflatex", (char*)"-interaction=nonstopmode", (char*)"-output-directory",
+                            directory, job->source, nullptr};
+
+        is_rendered = SpawnTool(tex_argv);
+    }
+
+    if (!is_rendered)
+    {
+        printf("Render error : can't render %s\nline = %d\n", job->source, __LINE__);
+        return false;
+    }
+
+    // Without the copy the next run renders the source again, which is all it costs
+    if (!job->is_cached && job->cached[0] != '\0') LinkOutput(job->output, job->cached);
+
+    char* viewer_argv[] = {(char*)RENDER_VIEWER, job->output, nullptr};
+
+    SpawnTool(viewer_argv);
+
+    return true;
+}
+
+// A hard link, or a copy where the file system has none. to is replaced
+bool LinkOutput(const char* from, const char* to)
+{
+    assert(from);
+    assert(to);
+
+    remove(to);
+
+    if (link(from, to) == 0) return true;
+
+    FILE* from_file = fopen(from, "rb");
+    if (from_file == nullptr) return false;
+
+    FILE* to_file = fopen(to, "wb");
+    if (to_file == nullptr)
+    {
+        fclose(from_file);
+        return false;
+    }
+
+    char*  buffer    = (char*)calloc(RENDER_COPY_SIZE, sizeof(char));
+    bool   is_copied = true;
+    size_t size      = 0;
+    assert(buffer);
+
+    while ((size = fread(buffer, sizeof(char), RENDER_COPY_SIZE, from_file)) > 0)
+    {
+        is_copied = is_copied && fwrite(buffer, sizeof(char), size, to_file) == size;
+    }
+
+    free(buffer);
+    fclose(from_file);
+
+    return (fclose(to_file) == 0) && is_copied;
+}
+
+// Runs argv[0] from the path with its output thrown away and waits for it
+bool SpawnTool(char* const argv[])
+{
+    assert(argv);
+    assert(argv[0]);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, RENDER_NULL, O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, RENDER_NULL, O_WRONLY, 0);
+
+    pid_t pid   = 0;
+    int   error = posix_spawnp(&pid, argv[0], &actions, nullptr, argv, environ);
+
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (error != 0) return false;
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0)
+    {
+        if (errno != EINTR) return false;
+    }
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// The caller frees the text
+char* ReadSource(const char* source, size_t* size)
+{
+    assert(source);
+    assert(size);
+
+    FILE* file = fopen(source, "rb");
+    if (file == nullptr) return nullptr;
+
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    char* text = (length >= 0) ? (char*)calloc((size_t)length + 1, sizeof(char)) : nullptr;
+
+    if (text != nullptr) *size = fread(text, sizeof(char), (size_t)length, file);
+
+    fclose(file);
+
+    return text;
+}
+
+// FNV-1a
+size_t HashText(const char* text, size_t size)
+{
+    assert(text);
+
+    size_t hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= (unsigned char)text[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
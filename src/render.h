@@ -0,0 +1,63 @@
+#pragma once
+
+#include <pthread.h>
+
+#include "derivative.h"
+
+const size_t RENDER_PATH_LEN = 64;
+
+enum RenderKind
+{
+    RENDER_DOT = 0,
+    RENDER_TEX = 1
+};
+
+// A written source and what it is rendered into, the result is opened in the viewer when it is ready.
+// cached is the copy of the output kept by the hash of the source, a cached job only links it to output
+struct RenderJob
+{
+    RenderKind kind;
+    size_t     hash;
+    bool       is_cached;
+
+    char source[RENDER_PATH_LEN];
+    char output[RENDER_PATH_LEN];
+    char cached[RENDER_PATH_LEN];
+};
+
+// Jobs wait in order and up to max_running workers spawn the tools, each one waits for its own job only.
+// The workers are started by the first job and stopped by WaitRenders
+struct RenderQueue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t  has_jobs;
+    pthread_cond_t  has_rendered;
+
+    RenderJob* jobs      = nullptr;
+    size_t     begin     = 0;
+    size_t     end       = 0;
+    size_t     capacity  = 0;
+
+    // Of the sources already queued, a source with the same text is not rendered again
+    size_t* hashes        = nullptr;
+    size_t  num_hashes    = 0;
+    size_t  hash_capacity = 0;
+
+    // Of the jobs being rendered, one per worker at most. A cached job waits until its hash is gone
+    size_t* rendering     = nullptr;
+    size_t  num_rendering = 0;
+
+    pthread_t* workers     = nullptr;
+    size_t     num_workers = 0;
+    size_t     max_running = 0;
+    bool       is_stopping = false;
+
+    size_t num_rendered = 0;
+    size_t num_skipped  = 0;
+    size_t num_failed   = 0;
+};
+
+void   SetRenderLimit(size_t max_running);
+bool   QueueRender   (RenderKind kind, const char* source, const char* output);
+void   WaitRenders   ();
+size_t HashText      (const char* text, size_t size);
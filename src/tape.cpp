@@ -0,0 +1,227 @@
+#include "tape.h"
+
+
+const size_t TAPE_START_CAPACITY = 64;
+
+static const char* TAPE_OP[] = {"const", "var", "add", "sub", "mul", "div", "pow",
+                                "sin", "cos", "tan", "ctg", "sqrt", "ln", "exp", "error"};
+
+Tape*  CompileTape    (DerTree* tree);
+void   CompileNode    (DerTree* tree, DerNode* node, Tape* tape, size_t* depth);
+void   TapeEmit       (Tape* tape, unsigned char opcode, unsigned int arg, size_t* depth, int depth_change);
+size_t TapeAddConst   (Tape* tape, double value);
+void   DestructTape   (Tape* tape);
+double EvalTape       (Tape* tape, double x, double y);
+double EvalTapeOnStack(const Tape* tape, double* stack, double x, double y);
+void   PrintTape      (const Tape* tape, FILE* file);
+
+
+Tape* CompileTape(DerTree* tree)
+{
+    assert(tree);
+
+    Tape* tape = (Tape*)calloc(1, sizeof(Tape));
+    assert(tape);
+
+    size_t depth = 0;
+    CompileNode(tree, tree->root, tape, &depth);
+
+    tape->stack = (double*)calloc(tape->max_stack + 1, sizeof(double));
+    assert(tape->stack);
+
+    return tape;
+}
+
+// Post-order on an explicit stack, an operation is emitted when its frame comes up the second time
+void CompileNode(DerTree* tree, DerNode* node, Tape* tape, size_t* depth)
+{
+    assert(tree);
+    assert(node);
+    assert(tape);
+    assert(depth);
+
+    if (node == tree->nil) return;
+
+    WalkStack stack;
+    InitWalkStack(&stack);
+
+    PushFrame(&stack, node, nullptr, nullptr, 0);
+
+    while (stack.size > 0)
+    {
+        WalkFrame frame = stack.frames[--stack.size];
+        node            = frame.node;
+
+        switch (node->type)
+        {
+            case TYPE_CONST :
+            {
+                TapeEmit(tape, TAPE_CONST, (unsigned int)TapeAddConst(tape, node->value.number), depth, 1);
+                break;
+            }
+            case TYPE_VAR :
+            {
+                const char* slot = strchr(VARIABLES, node->value.var);
+                assert(slot);
+
+                TapeEmit(tape, TAPE_VAR, (unsigned int)(slot - VARIABLES), depth, 1);
+                break;
+            }
+            case TYPE_BIN_OP :
+            {
+                if (frame.state == 1)
+                {
+                    TapeEmit(tape, (unsigned char)(TAPE_ADD + node->value.op), 0, depth, -1);
+                    break;
+                }
+
+                PushFrame(&stack, node, nullptr, nullptr, 1);
+                PushFrame(&stack, node->right, nullptr, nullptr, 0);
+                PushFrame(&stack, node->left,  nullptr, nullptr, 0);
+                break;
+            }
+            case TYPE_UN_OP :
+            {
+                if (frame.state == 1)
+                {
+                    TapeEmit(tape, (unsigned char)(TAPE_SIN + node->value.op), 0, depth, 0);
+                    break;
+                }
+
+                PushFrame(&stack, node, nullptr, nullptr, 1);
+                PushFrame(&stack, node->right, nullptr, nullptr, 0);
+                break;
+            }
+            default :
+            {
+                TapeEmit(tape, TAPE_ERROR, 0, depth, 1);
+                break;
+            }
+        }
+    }
+
+    DestructWalkStack(&stack);
+}
+
+void TapeEmit(Tape* tape, unsigned char opcode, unsigned int arg, size_t* depth, int depth_change)
+{
+    assert(tape);
+    assert(depth);
+
+    if (tape->size == tape->capacity)
+    {
+        tape->capacity = (tape->capacity == 0) ? TAPE_START_CAPACITY : 2 * tape->capacity;
+
+        tape->code = (unsigned char*)realloc(tape->code, tape->capacity * sizeof(unsigned char));
+        tape->args = (unsigned int*) realloc(tape->args, tape->capacity * sizeof(unsigned int));
+        assert(tape->code);
+        assert(tape->args);
+    }
+
+    tape->code[tape->size] = opcode;
+    tape->args[tape->size] = arg;
+    tape->size++;
+
+    *depth = (size_t)((long long)*depth + depth_change);
+    if (*depth > tape->max_stack) tape->max_stack = *depth;
+}
+
+size_t TapeAddConst(Tape* tape, double value)
+{
+    assert(tape);
+
+    if (tape->num_consts == tape->consts_capacity)
+    {
+        tape->consts_capacity = (tape->consts_capacity == 0) ? TAPE_START_CAPACITY : 2 * tape->consts_capacity;
+
+        tape->consts = (double*)realloc(tape->consts, tape->consts_capacity * sizeof(double));
+        assert(tape->consts);
+    }
+
+    tape->consts[tape->num_consts] = value;
+
+    return tape->num_consts++;
+}
+
+void DestructTape(Tape* tape)
+{
+    assert(tape);
+
+    free(tape->code);
+    free(tape->args);
+    free(tape->consts);
+    free(tape->stack);
+
+    free(tape);
+}
+
+double EvalTape(Tape* tape, double x, double y)
+{
+    assert(tape);
+
+    return EvalTapeOnStack(tape, tape->stack, x, y);
+}
+
+// The stack must hold tape->max_stack values, one per thread when evaluating in parallel
+double EvalTapeOnStack(const Tape* tape, double* stack, double x, double y)
+{
+    assert(tape);
+    assert(stack);
+
+    const double variables[TAPE_NUM_VARIABLES] = {x, y};
+
+    const unsigned char* code   = tape->code;
+    const unsigned int*  args   = tape->args;
+    const double*        consts = tape->consts;
+
+    double* top = stack;
+
+    for (size_t i = 0, size = tape->size; i < size; ++i)
+    {
+        switch (code[i])
+        {
+            case TAPE_CONST : *top++ = consts[args[i]];    break;
+            case TAPE_VAR   : *top++ = variables[args[i]]; break;
+
+            case TAPE_ADD   : top--; top[-1] += top[0];               break;
+            case TAPE_SUB   : top--; top[-1] -= top[0];               break;
+            case TAPE_MUL   : top--; top[-1] *= top[0];               break;
+            case TAPE_DIV   : top--; top[-1] /= top[0];               break;
+            case TAPE_POW   : top--; top[-1] = pow(top[-1], top[0]); break;
+
+            case TAPE_SIN   : top[-1] = sin(top[-1]);     break;
+            case TAPE_COS   : top[-1] = cos(top[-1]);     break;
+            case TAPE_TAN   : top[-1] = tan(top[-1]);     break;
+            case TAPE_CTG   : top[-1] = 1 / tan(top[-1]); break;
+            case TAPE_SQRT  : top[-1] = sqrt(top[-1]);    break;
+            case TAPE_LN    : top[-1] = log(top[-1]);     break;
+            case TAPE_EXP   : top[-1] = exp(top[-1]);     break;
+
+            default         : *top++ = NAN; break;
+        }
+    }
+
+    return (top == stack) ? NAN : top[-1];
+}
+
+void PrintTape(const Tape* tape, FILE* file)
+{
+    assert(tape);
+    assert(file);
+
+    for (size_t i = 0; i < tape->size; ++i)
+    {
+        fprintf(file, "%4zu %-6s", i, TAPE_OP[tape->code[i]]);
+
+        if (tape->code[i] == TAPE_CONST)
+        {
+            fprintf(file, " %lg", tape->consts[tape->args[i]]);
+        }
+        else if (tape->code[i] == TAPE_VAR)
+        {
+            fprintf(file, " %c", VARIABLES[tape->args[i]]);
+        }
+
+        fprintf(file, "\n");
+    }
+}
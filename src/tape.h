@@ -0,0 +1,61 @@
+#pragma once
+
+#include "derivative.h"
+
+enum TapeOpcode
+{
+    TAPE_CONST = 0,
+    TAPE_VAR   = 1,
+
+    TAPE_ADD   = 2,
+    TAPE_SUB   = 3,
+    TAPE_MUL   = 4,
+    TAPE_DIV   = 5,
+    TAPE_POW   = 6,
+
+    TAPE_SIN   = 7,
+    TAPE_COS   = 8,
+    TAPE_TAN   = 9,
+    TAPE_CTG   = 10,
+    TAPE_SQRT  = 11,
+    TAPE_LN    = 12,
+    TAPE_EXP   = 13,
+
+    TAPE_ERROR = 14
+};
+
+enum BatchKernel
+{
+    KERNEL_UNKNOWN = 0,
+    KERNEL_SCALAR  = 1,
+    KERNEL_AVX2    = 2
+};
+
+const size_t TAPE_NUM_VARIABLES = 2;
+
+struct Tape
+{
+    unsigned char* code = nullptr;
+    unsigned int*  args = nullptr;
+
+    size_t size     = 0;
+    size_t capacity = 0;
+
+    double* consts          = nullptr;
+    size_t  num_consts      = 0;
+    size_t  consts_capacity = 0;
+
+    size_t  max_stack = 0;
+    double* stack     = nullptr;
+};
+
+Tape*  CompileTape    (DerTree* tree);
+void   DestructTape   (Tape* tape);
+double EvalTape       (Tape* tape, double x, double y);
+double EvalTapeOnStack(const Tape* tape, double* stack, double x, double y);
+void   PrintTape      (const Tape* tape, FILE* file);
+
+void        EvalTapeBatch     (const Tape* tape, const double* xs, const double* ys, double* out, size_t count);
+BatchKernel GetBatchKernel    ();
+const char* GetBatchKernelName();
+void        SetBatchKernel    (BatchKernel kernel);
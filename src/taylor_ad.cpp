@@ -0,0 +1,448 @@
+#include "derivative.h"
+
+
+const size_t SERIES_START_CAPACITY = 16;
+
+/////////////////////////////////
+//Truncated power series
+/////////////////////////////////
+double* TaylorCoefficients(DerTree* tree, size_t order, double point);
+void    TaylorAD          (DerTree* tree, size_t order);
+DerTree* TaylorADTree     (DerTree* tree, size_t order);
+void    SeriesOfNode      (DerTree* tree, DerNode* node, size_t len, double point, double* result);
+void    SeriesOfLeaf      (DerNode* node, size_t len, double point, double* result);
+void    SeriesOfBinOP     (int op, const double* left, const double* right, size_t len, double* result);
+void    SeriesOfUnOP      (int op, const double* arg, size_t len, double* result);
+void    SeriesMul         (const double* left, const double* right, size_t len, double* result);
+void    SeriesDiv         (const double* left, const double* right, size_t len, double* result);
+void    SeriesExp         (const double* arg, size_t len, double* result);
+void    SeriesLn          (const double* arg, size_t len, double* result);
+void    SeriesSinCos      (const double* arg, size_t len, double* sin_result, double* cos_result);
+void    SeriesSqrt        (const double* arg, size_t len, double* result);
+void    SeriesPow         (const double* base, const double* power, size_t len, double* result);
+bool    IsConstSeries     (const double* series, size_t len);
+
+
+// Returns f^(k)(point) / k! for k = 0..order, the caller frees the array
+double* TaylorCoefficients(DerTree* tree, size_t order, double point)
+{
+    assert(tree);
+
+    double* coefficients = (double*)calloc(order + 1, sizeof(double));
+    assert(coefficients);
+
+    SeriesOfNode(tree, tree->root, order + 1, point, coefficients);
+
+    return coefficients;
+}
+
+void TaylorAD(DerTree* tree, size_t order)
+{
+    assert(tree);
+
+    DerTree* taylor_tree = TaylorADTree(tree, order);
+
+    PrintExpression(taylor_tree);
+
+    Destruct(taylor_tree);
+    Delete(taylor_tree);
+}
+
+// Returns the Taylor polynomial at zero as a new tree, the caller destructs it
+DerTree* TaylorADTree(DerTree* tree, size_t order)
+{
+    assert(tree);
+
+    double* coefficients = TaylorCoefficients(tree, order, 0);
+
+    DerTree* taylor_tree = NewTree();
+    taylor_tree->root    = ConstructNode(taylor_tree, TYPE_CONST, { .number = coefficients[0] },
+                                         taylor_tree->nil, taylor_tree->nil);
+
+    // k! overflows size_t past 20, in double it stays exact up to 22 and close after that
+    double factorial = 1;
+
+    for (size_t i = 1; i <= order; ++i)
+    {
+        factorial *= (double)i;
+
+        SimplifyFrom(taylor_tree, AddTaylorTerm(taylor_tree, i, factorial, coefficients[i] * factorial));
+    }
+
+    free(coefficients);
+
+    return taylor_tree;
+}
+
+// Post-order on an explicit stack. The series of finished nodes lie one after another in values,
+// an operation takes its operands from the top and puts its own series in place of the first one
+void SeriesOfNode(DerTree* tree, DerNode* node, size_t len, double point, double* result)
+{
+    assert(tree);
+    assert(node);
+    assert(result);
+
+    size_t  num_values = 0;
+    size_t  capacity   = SERIES_START_CAPACITY;
+    double* values     = (double*)calloc(capacity * len, sizeof(double));
+    double* scratch    = (double*)calloc(len, sizeof(double));
+    assert(values);
+    assert(scratch);
+
+    WalkStack stack;
+    InitWalkStack(&stack);
+
+    PushFrame(&stack, node, nullptr, nullptr, 0);
+
+    while (stack.size > 0)
+    {
+        WalkFrame frame = stack.frames[--stack.size];
+        node            = frame.node;
+
+        bool is_op = node->type == TYPE_BIN_OP || node->type == TYPE_UN_OP;
+
+        if (is_op && frame.state == 0)
+        {
+            PushFrame(&stack, node, nullptr, nullptr, 1);
+            PushFrame(&stack, node->right, nullptr, nullptr, 0);
+            if (node->type == TYPE_BIN_OP) PushFrame(&stack, node->left, nullptr, nullptr, 0);
+            continue;
+        }
+
+        if (!is_op)
+        {
+            if (num_values == capacity)
+            {
+                capacity *= 2;
+                values    = (double*)realloc(values, capacity * len * sizeof(double));
+                assert(values);
+            }
+
+            SeriesOfLeaf(node, len, point, values + num_values * len);
+            num_values++;
+            continue;
+        }
+
+        for (size_t i = 0; i < len; ++i)
+        {
+            scratch[i] = 0;
+        }
+
+        double* top = values + num_values * len;
+
+        if (node->type == TYPE_BIN_OP)
+        {
+            SeriesOfBinOP(node->value.op, top - 2 * len, top - len, len, scratch);
+            num_values--;
+        }
+        else
+        {
+            SeriesOfUnOP(node->value.op, top - len, len, scratch);
+        }
+
+        memcpy(values + (num_values - 1) * len, scratch, len * sizeof(double));
+    }
+
+    memcpy(result, values, len * sizeof(double));
+
+    DestructWalkStack(&stack);
+    free(values);
+    free(scratch);
+}
+
+void SeriesOfLeaf(DerNode* node, size_t len, double point, double* result)
+{
+    assert(node);
+    assert(result);
+
+    for (size_t i = 0; i < len; ++i)
+    {
+        result[i] = 0;
+    }
+
+    switch (node->type)
+    {
+        case TYPE_CONST :
+        {
+            result[0] = node->value.number;
+            return;
+        }
+        case TYPE_VAR :
+        {
+            // Only x is expanded, other variables are held at zero like SetX leaves them
+            if (node->value.var == 'x')
+            {
+                result[0] = point;
+                if (len > 1) result[1] = 1;
+            }
+            return;
+        }
+        default :
+        {
+            printf("Error type was discovored while expanding a series\nline = %d\n", __LINE__);
+            result[0] = NAN;
+            return;
+        }
+    }
+}
+
+void SeriesOfBinOP(int op, const double* left, const double* right, size_t len, double* result)
+{
+    assert(left);
+    assert(right);
+    assert(result);
+
+    switch (op)
+    {
+        case OP_ADD :
+        {
+            for (size_t i = 0; i < len; ++i) result[i] = left[i] + right[i];
+            break;
+        }
+        case OP_SUB :
+        {
+            for (size_t i = 0; i < len; ++i) result[i] = left[i] - right[i];
+            break;
+        }
+        case OP_MUL :
+        {
+            SeriesMul(left, right, len, result);
+            break;
+        }
+        case OP_DIV :
+        {
+            SeriesDiv(left, right, len, result);
+            break;
+        }
+        case OP_POW :
+        {
+            SeriesPow(left, right, len, result);
+            break;
+        }
+        default :
+        {
+            printf("Error: unknown binary operation, line %d\n", __LINE__);
+            break;
+        }
+    }
+}
+
+void SeriesOfUnOP(int op, const double* arg, size_t len, double* result)
+{
+    assert(arg);
+    assert(result);
+
+    switch (op)
+    {
+        case OP_SIN :
+        case OP_COS :
+        case OP_TAN :
+        case OP_CTG :
+        {
+            double* sin_series = (double*)calloc(len, sizeof(double));
+            double* cos_series = (double*)calloc(len, sizeof(double));
+            assert(sin_series);
+            assert(cos_series);
+
+            SeriesSinCos(arg, len, sin_series, cos_series);
+
+            if      (op == OP_SIN) memcpy(result, sin_series, len * sizeof(double));
+            else if (op == OP_COS) memcpy(result, cos_series, len * sizeof(double));
+            else if (op == OP_TAN) SeriesDiv(sin_series, cos_series, len, result);
+            else                   SeriesDiv(cos_series, sin_series, len, result);
+
+            free(sin_series);
+            free(cos_series);
+            break;
+        }
+        case OP_SQRT :
+        {
+            SeriesSqrt(arg, len, result);
+            break;
+        }
+        case OP_LN :
+        {
+            SeriesLn(arg, len, result);
+            break;
+        }
+        case OP_EXP :
+        {
+            SeriesExp(arg, len, result);
+            break;
+        }
+        default :
+        {
+            printf("Error: unknown unary operation, line %d\n", __LINE__);
+            break;
+        }
+    }
+}
+
+void SeriesMul(const double* left, const double* right, size_t len, double* result)
+{
+    for (size_t k = 0; k < len; ++k)
+    {
+        double sum = 0;
+        for (size_t j = 0; j <= k; ++j)
+        {
+            sum += left[j] * right[k - j];
+        }
+        result[k] = sum;
+    }
+}
+
+// q = a / b  =>  q_k = (a_k - sum_{j=1..k} b_j q_{k-j}) / b_0
+void SeriesDiv(const double* left, const double* right, size_t len, double* result)
+{
+    for (size_t k = 0; k < len; ++k)
+    {
+        double sum = left[k];
+        for (size_t j = 1; j <= k; ++j)
+        {
+            sum -= right[j] * result[k - j];
+        }
+        result[k] = sum / right[0];
+    }
+}
+
+// e = exp(u)  =>  k e_k = sum_{j=1..k} j u_j e_{k-j}
+void SeriesExp(const double* arg, size_t len, double* result)
+{
+    result[0] = exp(arg[0]);
+
+    for (size_t k = 1; k < len; ++k)
+    {
+        double sum = 0;
+        for (size_t j = 1; j <= k; ++j)
+        {
+            sum += (double)j * arg[j] * result[k - j];
+        }
+        result[k] = sum / (double)k;
+    }
+}
+
+// l = ln(u)  =>  u_0 l_k = u_k - 1/k sum_{j=1..k-1} j l_j u_{k-j}
+void SeriesLn(const double* arg, size_t len, double* result)
+{
+    result[0] = log(arg[0]);
+
+    for (size_t k = 1; k < len; ++k)
+    {
+        double sum = 0;
+        for (size_t j = 1; j < k; ++j)
+        {
+            sum += (double)j * result[j] * arg[k - j];
+        }
+        result[k] = (arg[k] - sum / (double)k) / arg[0];
+    }
+}
+
+// k s_k = sum_{j=1..k} j u_j c_{k-j},  k c_k = -sum_{j=1..k} j u_j s_{k-j}
+void SeriesSinCos(const double* arg, size_t len, double* sin_result, double* cos_result)
+{
+    sin_result[0] = sin(arg[0]);
+    cos_result[0] = cos(arg[0]);
+
+    for (size_t k = 1; k < len; ++k)
+    {
+        double sin_sum = 0;
+        double cos_sum = 0;
+        for (size_t j = 1; j <= k; ++j)
+        {
+            sin_sum += (double)j * arg[j] * cos_result[k - j];
+            cos_sum += (double)j * arg[j] * sin_result[k - j];
+        }
+        sin_result[k] =  sin_sum / (double)k;
+        cos_result[k] = -cos_sum / (double)k;
+    }
+}
+
+// r = sqrt(u)  =>  2 r_0 r_k = u_k - sum_{j=1..k-1} r_j r_{k-j}
+void SeriesSqrt(const double* arg, size_t len, double* result)
+{
+    result[0] = sqrt(arg[0]);
+
+    for (size_t k = 1; k < len; ++k)
+    {
+        double sum = arg[k];
+        for (size_t j = 1; j < k; ++j)
+        {
+            sum -= result[j] * result[k - j];
+        }
+        result[k] = sum / (2 * result[0]);
+    }
+}
+
+void SeriesPow(const double* base, const double* power, size_t len, double* result)
+{
+    if (!IsConstSeries(power, len))
+    {
+        // u^v = exp(v ln u)
+        double* ln_base = (double*)calloc(len, sizeof(double));
+        double* product = (double*)calloc(len, sizeof(double));
+        assert(ln_base);
+        assert(product);
+
+        SeriesLn(base, len, ln_base);
+        SeriesMul(power, ln_base, len, product);
+        SeriesExp(product, len, result);
+
+        free(ln_base);
+        free(product);
+        return;
+    }
+
+    double exponent = power[0];
+
+    if (base[0] != 0)
+    {
+        // p = u^c  =>  k u_0 p_k = sum_{j=1..k} ((c + 1) j - k) u_j p_{k-j}
+        result[0] = pow(base[0], exponent);
+
+        for (size_t k = 1; k < len; ++k)
+        {
+            double sum = 0;
+            for (size_t j = 1; j <= k; ++j)
+            {
+                sum += ((exponent + 1) * (double)j - (double)k) * base[j] * result[k - j];
+            }
+            result[k] = sum / ((double)k * base[0]);
+        }
+        return;
+    }
+
+    if (exponent >= 0 && exponent == floor(exponent))
+    {
+        // The recurrence divides by u_0, a zero base needs plain repeated products
+        double* tmp = (double*)calloc(len, sizeof(double));
+        assert(tmp);
+
+        for (size_t i = 0; i < len; ++i) result[i] = 0;
+        result[0] = 1;
+
+        // With u_0 = 0 every product shifts the series, len of them leave only zeros
+        for (size_t i = 0; i < (size_t)exponent && i <= len; ++i)
+        {
+            SeriesMul(result, base, len, tmp);
+            memcpy(result, tmp, len * sizeof(double));
+        }
+
+        free(tmp);
+        return;
+    }
+
+    for (size_t i = 0; i < len; ++i)
+    {
+        result[i] = NAN;
+    }
+}
+
+bool IsConstSeries(const double* series, size_t len)
+{
+    for (size_t i = 1; i < len; ++i)
+    {
+        if (series[i] != 0) return false;
+    }
+
+    return true;
+}
@@ -1,4 +0,0 @@
-cd tech
-pdflatex tech.tex > nul
-tech.pdf
-cd ../
\ No newline at end of file